@@ -22,3 +22,7 @@ run   dispatch-loop   ./build/test/zcm/dispatch_loop
 run   forking         ./build/test/zcm/forking
 run   forking2        ./build/test/zcm/forking2
 run   flushing        ./build/test/zcm/flushing
+run   udp-unicast     ./build/test/zcm/udp_unicast
+run   tcp-fanout      ./build/test/zcm/tcp_fanout
+run   unsub-shared    ./build/test/zcm/unsub_shared
+run   inproc-multi    ./build/test/zcm/inproc_multi
@@ -0,0 +1,117 @@
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Sweeps the ipc transport's high water marks ('sndhwm' and 'rcvhwm' url
+ * options) against the message size. For each pair, one transport publishes
+ * as fast as it can for a while and another receives; reports the throughput
+ * and how many messages zmq dropped at the high water marks. */
+
+#define DURATION 2.0
+
+static const int HWMS[] = { 100, 1000, 10000 };
+static const size_t SIZES[] = { 64, 4096, 65536, 1 << 20 };
+
+typedef struct
+{
+    zcm_trans_t *zt;
+    const char *channel;
+    volatile size_t recvd;
+    size_t bytes;
+    volatile int running;
+} receiver_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static zcm_trans_t *create(int hwm)
+{
+    char url[128];
+    snprintf(url, sizeof(url), "ipc://?sndhwm=%d&rcvhwm=%d", hwm, hwm);
+
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_create_func *create = zcm_transport_find("ipc");
+    zcm_trans_t *zt = create ? create(u) : NULL;
+    zcm_url_destroy(u);
+    return zt;
+}
+
+static void *receiver(void *usr)
+{
+    receiver_t *r = (receiver_t*)usr;
+    zcm_msg_t msg;
+    while (r->running) {
+        if (zcm_trans_recvmsg(r->zt, &msg, 100) != ZCM_EOK)
+            continue;
+        r->recvd++;
+        r->bytes += msg.len;
+    }
+    return NULL;
+}
+
+static void run(int hwm, size_t datasz)
+{
+    char channel[64];
+    snprintf(channel, sizeof(channel), "HWM_SWEEP_%d_%zu", hwm, datasz);
+
+    zcm_trans_t *tx = create(hwm);
+    zcm_trans_t *rx = create(hwm);
+    if (!tx || !rx) {
+        fprintf(stderr, "failed to create the ipc transport (built without zmq?)\n");
+        exit(1);
+    }
+    zcm_trans_recvmsg_enable(rx, channel, 1);
+
+    receiver_t r = { rx, channel, 0, 0, 1 };
+    pthread_t thr;
+    pthread_create(&thr, NULL, receiver, &r);
+
+    char *data = calloc(1, datasz);
+    zcm_msg_t msg = { 0, channel, datasz, data };
+
+    /* let the subscriber connect before counting */
+    while (r.recvd == 0) {
+        zcm_trans_sendmsg(tx, msg);
+        usleep(10000);
+    }
+    size_t base = r.recvd;
+
+    size_t sent = 0;
+    double start = now();
+    while (now() - start < DURATION) {
+        zcm_trans_sendmsg(tx, msg);
+        sent++;
+    }
+    double elapsed = now() - start;
+    usleep(500000);
+    r.running = 0;
+    pthread_join(thr, NULL);
+
+    size_t recvd = r.recvd - base;
+    printf("hwm %6d size %8zu: %9.0f msgs/s sent, %9.0f msgs/s received, %8.1f MB/s, %5.1f%% dropped\n",
+           hwm, datasz, sent / elapsed, recvd / elapsed, recvd * datasz / elapsed / 1e6,
+           sent ? 100.0 * (sent - (recvd < sent ? recvd : sent)) / sent : 0.0);
+
+    zcm_trans_destroy(tx);
+    zcm_trans_destroy(rx);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    for (size_t i = 0; i < sizeof(HWMS)/sizeof(HWMS[0]); i++)
+        for (size_t j = 0; j < sizeof(SIZES)/sizeof(SIZES[0]); j++)
+            run(HWMS[i], SIZES[j]);
+    return 0;
+}
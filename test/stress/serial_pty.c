@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <zcm/transport_serial.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Measures the serial transport's throughput over a pseudo terminal, for both
+ * framings ('framing' url option) and a range of message sizes. A thread
+ * echoes everything the transport writes back to it, so one transport both
+ * sends and receives. A pty isn't paced by the baud rate: this is the most the
+ * transport itself can move, not what a real link would. Every message carries
+ * a sequence number and a pattern full of escape chars and zeros, which the
+ * receiver checks. Extra url options (e.g. "vmin=0&vtime=0") are given with -o. */
+
+#define BYTES_PER_RUN (16 << 20)
+#define MIN_MSGS 200
+
+static const char *FRAMINGS[] = { "legacy", "cobs" };
+static const size_t SIZES[] = { 16, 256, 4096, 65536, 1 << 20 };
+
+typedef struct
+{
+    int master;
+    volatile int running;
+} echo_t;
+
+typedef struct
+{
+    zcm_trans_t *zt;
+    size_t nmsgs;
+    size_t datasz;
+} sender_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(uint8_t *data, size_t datasz, uint32_t seq)
+{
+    for (size_t i = 0; i < datasz; i++)
+        data[i] = (uint8_t)((seq + i) * 17);
+    if (datasz >= sizeof(seq))
+        memcpy(data, &seq, sizeof(seq));
+}
+
+static void *echo(void *usr)
+{
+    echo_t *e = (echo_t*)usr;
+    uint8_t buf[65536];
+    while (e->running) {
+        struct pollfd pfd = { e->master, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        ssize_t n = read(e->master, buf, sizeof(buf));
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(e->master, buf + off, n - off);
+            if (w > 0)
+                off += w;
+        }
+    }
+    return NULL;
+}
+
+static void *sender(void *usr)
+{
+    sender_t *s = (sender_t*)usr;
+    uint8_t *data = malloc(s->datasz);
+    for (uint32_t i = 0; i < s->nmsgs; i++) {
+        fill(data, s->datasz, i);
+        zcm_msg_t msg = { 0, "SERIAL_PTY", s->datasz, (char*)data };
+        zcm_trans_sendmsg(s->zt, msg);
+    }
+    zcm_trans_serial_flush(s->zt);
+    free(data);
+    return NULL;
+}
+
+static int run(const char *framing, size_t datasz, const char *extra)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("failed to create a pty");
+        exit(1);
+    }
+
+    char url[256];
+    snprintf(url, sizeof(url), "serial://%s?baud=3000000&framing=%s%s%s",
+             ptsname(master), framing, extra[0] ? "&" : "", extra);
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_create_func *create = zcm_transport_find("serial");
+    zcm_trans_t *zt = create ? create(u) : NULL;
+    zcm_url_destroy(u);
+    if (!zt) {
+        fprintf(stderr, "failed to create the serial transport (built without it?)\n");
+        exit(1);
+    }
+    zcm_trans_recvmsg_enable(zt, "SERIAL_PTY", 1);
+
+    echo_t e = { master, 1 };
+    pthread_t echoThr;
+    pthread_create(&echoThr, NULL, echo, &e);
+
+    size_t nmsgs = BYTES_PER_RUN / datasz;
+    if (nmsgs < MIN_MSGS)
+        nmsgs = MIN_MSGS;
+    sender_t s = { zt, nmsgs, datasz };
+    pthread_t sendThr;
+    double start = now();
+    pthread_create(&sendThr, NULL, sender, &s);
+
+    uint8_t *expect = malloc(datasz);
+    size_t recvd = 0, corrupt = 0;
+    uint32_t next = 0;
+    double last = start;
+    zcm_msg_t msg;
+    while (recvd < nmsgs && zcm_trans_recvmsg(zt, &msg, 2000) == ZCM_EOK) {
+        uint32_t seq = next;
+        if (msg.len >= sizeof(seq))
+            memcpy(&seq, msg.buf, sizeof(seq));
+        fill(expect, datasz, seq);
+        if (msg.len != datasz || seq != next || memcmp(msg.buf, expect, datasz) != 0)
+            corrupt++;
+        next = seq + 1;
+        recvd++;
+        last = now();
+    }
+    pthread_join(sendThr, NULL);
+
+    zcm_serial_stats_t stats;
+    zcm_trans_serial_stats(zt, &stats);
+    double elapsed = last - start;
+    printf("%-6s size %8zu: %9.0f msgs/s, %7.1f MB/s, %zu/%zu received, %zu corrupt, "
+           "%llu invalid frames, %.1f msgs per write\n",
+           framing, datasz, recvd / elapsed, recvd * datasz / elapsed / 1e6, recvd, nmsgs,
+           corrupt, (unsigned long long)stats.frames_invalid,
+           stats.write_syscalls ? (double)stats.messages_sent / stats.write_syscalls : 0.0);
+
+    e.running = 0;
+    pthread_join(echoThr, NULL);
+    zcm_trans_destroy(zt);
+    close(master);
+    free(expect);
+    return recvd == nmsgs && corrupt == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *extra = "";
+    int c;
+    while ((c = getopt(argc, argv, "o:h")) != -1) {
+        switch (c) {
+            case 'o': extra = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-o <extra url options>]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    int ok = 1;
+    for (size_t i = 0; i < sizeof(FRAMINGS)/sizeof(FRAMINGS[0]); i++)
+        for (size_t j = 0; j < sizeof(SIZES)/sizeof(SIZES[0]); j++)
+            ok &= run(FRAMINGS[i], SIZES[j], extra);
+    return ok ? 0 : 1;
+}
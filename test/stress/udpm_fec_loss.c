@@ -0,0 +1,100 @@
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <zcm/transport_udpm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* Measures how many multi-fragment messages survive random packet loss with
+ * and without forward error correction, and what the parity costs in CPU time.
+ * Loss is injected by the receiving transport ('loss_inject' url option). */
+
+#define URL "udpm://239.255.76.67:7667?ttl=0&rcvbuf=16000000"
+#define CHANNEL "FEC_LOSS_TEST"
+#define DATASZ (1024*1024)
+#define N 200
+#define SLEEPUS 2000
+
+static const int FEC[] = { 0, 16, 8, 4 };
+static const double LOSS[] = { 0.001, 0.01, 0.03 };
+
+static size_t recv_count = 0;
+static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    recv_count++;
+}
+
+static double cpuTime(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void run(int fec, double loss, size_t n, size_t datasz)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "%s&fec=%d&loss_inject=%g", URL, fec, loss);
+
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_t *zt = zcm_transport_find("udpm")(u);
+    assert(zt);
+    zcm_t *zcm = zcm_create_trans(zt);
+    assert(zcm);
+
+    char *data = malloc(datasz);
+    memset(data, 0x5a, datasz);
+
+    recv_count = 0;
+    zcm_subscribe(zcm, CHANNEL, handler, NULL);
+    zcm_start(zcm);
+
+    size_t sent = 0;
+    double start = cpuTime();
+    for (size_t i = 0; i < n; i++) {
+        if (zcm_publish(zcm, CHANNEL, data, datasz) == ZCM_EOK)
+            sent++;
+        usleep(SLEEPUS);
+    }
+    usleep(100000);
+    double cpu = cpuTime() - start;
+
+    zcm_stop(zcm);
+
+    zcm_udpm_stats_t stats;
+    zcm_trans_udpm_stats(zt, &stats);
+    printf("fec=%-3d loss=%5.1f%%  delivered %3zu/%zu (%5.1f%%)  recovered %5lu fragments  "
+           "cpu %6.2f ms/msg\n",
+           fec, 100 * loss, recv_count, sent, sent ? 100.0 * recv_count / sent : 0,
+           (unsigned long)stats.fragments_recovered, 1000 * cpu / n);
+
+    zcm_destroy(zcm);
+    zcm_url_destroy(u);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = N, datasz = DATASZ;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+            case 'n': n = strtoul(optarg, NULL, 10); break;
+            case 's': datasz = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-n <count>] [-s <bytes>]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(LOSS)/sizeof(LOSS[0]); i++)
+        for (size_t j = 0; j < sizeof(FEC)/sizeof(FEC[0]); j++)
+            run(FEC[j], LOSS[i], n, datasz);
+    return 0;
+}
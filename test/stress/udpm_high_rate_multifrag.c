@@ -1,8 +1,10 @@
 #include <zcm/zcm.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #define URL "udpm://239.255.76.67:7667?ttl=0"
 #define CHANNEL "HIGHRATE_TEST"
@@ -10,34 +12,111 @@
 #define N 1000000
 #define SLEEPUS 100
 
+/* Pacing settings tried by the sweep mode: { pace_rate, pace_burst } in bytes */
+static const size_t SWEEP[][2] = {
+    {         0,        0 }, /* no pacing */
+    { 400000000, 131072 },
+    { 200000000, 131072 },
+    { 100000000, 131072 },
+    {  50000000, 131072 },
+    { 100000000,  65536 },
+    { 100000000, 524288 },
+};
+#define SWEEP_N 5000
+
 static size_t recv_count = 0;
 static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
 {
     recv_count++;
 }
 
-int main(int argc, char *argv[])
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Returns the fraction of the published messages that were delivered. Messages
+   that didn't fit in the send queue (zcm_publish() failed) are not counted */
+static double run(size_t rate, size_t burst, size_t n, size_t datasz, size_t sleepus)
 {
-    char *data = malloc(DATASZ);
-    memset(data, 0, DATASZ);
+    char url[256];
+    if (rate > 0)
+        snprintf(url, sizeof(url), "%s&pace_rate=%zu&pace_burst=%zu", URL, rate, burst);
+    else
+        snprintf(url, sizeof(url), "%s", URL);
 
-    zcm_t *zcm = zcm_create(URL);
+    char *data = malloc(datasz);
+    memset(data, 0, datasz);
+
+    zcm_t *zcm = zcm_create(url);
     assert(zcm);
 
+    recv_count = 0;
     zcm_subscribe(zcm, CHANNEL, handler, NULL);
     zcm_start(zcm);
 
-    for (size_t i = 0; i < N; i++) {
-        zcm_publish(zcm, CHANNEL, data, DATASZ);
-        usleep(SLEEPUS);
+    size_t sent = 0;
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        if (zcm_publish(zcm, CHANNEL, data, datasz) == ZCM_EOK)
+            sent++;
+        if (sleepus)
+            usleep(sleepus);
     }
+    double elapsed = now() - start;
 
     usleep(100000);
     zcm_stop(zcm);
     zcm_destroy(zcm);
+    free(data);
 
-    printf("Message success: %d/%d\n", (int)recv_count, N);
+    double ratio = sent ? (double)recv_count / sent : 0;
+    printf("pace_rate=%-10zu pace_burst=%-8zu  delivered %zu/%zu (%5.1f%%)  "
+           "queue full %zu  %7.1f MB/s published\n",
+           rate, burst, recv_count, sent, 100.0 * ratio, n - sent, sent * datasz / elapsed / 1e6);
+    return ratio;
+}
 
-    free(data);
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n <count>   messages to publish (default %d, %d per run with -S)\n"
+            "  -s <bytes>   message size (default %d)\n"
+            "  -u <usecs>   sleep between publishes (default %d)\n"
+            "  -r <bytes/s> pace_rate url option (default: no pacing)\n"
+            "  -b <bytes>   pace_burst url option\n"
+            "  -S           sweep over a set of pacing settings and report the\n"
+            "               delivery ratio of each\n",
+            prog, N, SWEEP_N, DATASZ, SLEEPUS);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = 0, datasz = DATASZ, sleepus = SLEEPUS, rate = 0, burst = 131072;
+    int sweep = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:u:r:b:Sh")) != -1) {
+        switch (c) {
+            case 'n': n = strtoul(optarg, NULL, 10); break;
+            case 's': datasz = strtoul(optarg, NULL, 10); break;
+            case 'u': sleepus = strtoul(optarg, NULL, 10); break;
+            case 'r': rate = strtoul(optarg, NULL, 10); break;
+            case 'b': burst = strtoul(optarg, NULL, 10); break;
+            case 'S': sweep = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (!sweep) {
+        run(rate, burst, n ? n : N, datasz, sleepus);
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(SWEEP)/sizeof(SWEEP[0]); i++)
+        run(SWEEP[i][0], SWEEP[i][1], n ? n : SWEEP_N, datasz, sleepus);
     return 0;
 }
@@ -0,0 +1,167 @@
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <zcm/transport_udpm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Compares the two I/O backends ('io' url option). A burst of fragmented
+ * messages is sent and received on one transport to count the system calls
+ * per message, then a ping-pong between two transports measures the round
+ * trip latency of small messages. */
+
+#define URL "udpm://239.255.76.67:7667?ttl=0&rcvbuf=16000000"
+#define NBURST 200
+#define BURSTSZ (64*1024)
+#define NPING 10000
+#define PINGSZ 64
+
+static const char *IO[] = { "sync", "uring" };
+
+static volatile int done = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static zcm_trans_t *create(const char *io)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "%s&io=%s", URL, io);
+
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_t *zt = zcm_transport_find("udpm")(u);
+    zcm_url_destroy(u);
+    assert(zt);
+    return zt;
+}
+
+static void *ponger(void *usr)
+{
+    zcm_trans_t *zt = (zcm_trans_t*)usr;
+    zcm_trans_recvmsg_enable(zt, "PING", 1);
+
+    zcm_msg_t msg;
+    while (!done) {
+        if (zcm_trans_recvmsg(zt, &msg, 100) != ZCM_EOK)
+            continue;
+        zcm_msg_t pong = { 0, "PONG", msg.len, msg.buf };
+        zcm_trans_sendmsg(zt, pong);
+    }
+    return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void burst(const char *io, size_t n, size_t datasz)
+{
+    zcm_trans_t *zt = create(io);
+    zcm_trans_recvmsg_enable(zt, "BURST", 1);
+
+    char *data = calloc(1, datasz);
+    zcm_udpm_stats_t before, after;
+    zcm_trans_udpm_stats(zt, &before);
+
+    /* send in small batches so that the receive buffer never overflows */
+    size_t recvd = 0;
+    for (size_t i = 0; i < n; i += 10) {
+        for (size_t j = i; j < n && j < i + 10; j++) {
+            zcm_msg_t msg = { 0, "BURST", datasz, data };
+            zcm_trans_sendmsg(zt, msg);
+        }
+        zcm_msg_t msg;
+        while (zcm_trans_recvmsg(zt, &msg, 10) == ZCM_EOK)
+            recvd++;
+    }
+
+    zcm_trans_udpm_stats(zt, &after);
+    printf("io=%-5s (%s) burst: %zu/%zu messages of %zu bytes, "
+           "%.2f send and %.2f receive syscalls/msg\n",
+           io, after.io_uring ? "io_uring" : "plain", recvd, n, datasz,
+           (double)(after.send_syscalls - before.send_syscalls) / n,
+           recvd ? (double)(after.recv_syscalls - before.recv_syscalls) / recvd : 0);
+
+    zcm_trans_destroy(zt);
+    free(data);
+}
+
+static void pingpong(const char *io, size_t n, size_t datasz)
+{
+    zcm_trans_t *ping = create(io);
+    zcm_trans_t *pong = create(io);
+    zcm_trans_recvmsg_enable(ping, "PONG", 1);
+
+    done = 0;
+    pthread_t thr;
+    pthread_create(&thr, NULL, ponger, pong);
+
+    char *data = calloc(1, datasz);
+    double *rtt = malloc(n * sizeof(double));
+    size_t nrtt = 0, timeouts = 0;
+
+    for (size_t i = 0; i < n + n / 10; i++) {
+        zcm_msg_t msg = { 0, "PING", datasz, data };
+        double start = now();
+        zcm_trans_sendmsg(ping, msg);
+
+        zcm_msg_t reply;
+        if (zcm_trans_recvmsg(ping, &reply, 100) != ZCM_EOK) {
+            timeouts++;
+            continue;
+        }
+        /* the first 10% warm up the caches and the pools */
+        if (i >= n / 10 && nrtt < n)
+            rtt[nrtt++] = (now() - start) * 1e6;
+    }
+
+    done = 1;
+    pthread_join(thr, NULL);
+
+    printf("io=%-5s ping-pong: %zu round trips, %zu timeouts", io, nrtt, timeouts);
+    if (nrtt > 0) {
+        qsort(rtt, nrtt, sizeof(double), cmpDouble);
+        printf(", usecs p50 %.1f  p99 %.1f  max %.1f",
+               rtt[nrtt / 2], rtt[nrtt * 99 / 100], rtt[nrtt - 1]);
+    }
+    printf("\n");
+
+    zcm_trans_destroy(ping);
+    zcm_trans_destroy(pong);
+    free(rtt);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nburst = NBURST, nping = NPING, datasz = BURSTSZ;
+    int c;
+    while ((c = getopt(argc, argv, "n:p:s:h")) != -1) {
+        switch (c) {
+            case 'n': nburst = strtoul(optarg, NULL, 10); break;
+            case 'p': nping = strtoul(optarg, NULL, 10); break;
+            case 's': datasz = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-n <burst msgs>] [-p <round trips>] [-s <bytes>]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(IO)/sizeof(IO[0]); i++) {
+        burst(IO[i], nburst, datasz);
+        pingpong(IO[i], nping, PINGSZ);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <zcm/transport_udpm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Measures the round trip latency of small messages over loopback. A ponger
+ * thread answers every PING with a PONG, each side on its own transport, and
+ * the round trip times are reported as a histogram and percentiles. By default
+ * the plain poll() receive path is compared with the busy poll mode. */
+
+#define URL "udpm://239.255.76.67:7667?ttl=0"
+#define N 20000
+#define DATASZ 64
+#define BUSY_POLL_US 200
+#define NBUCKETS 16  /* bucket i holds round trips of [2^(i-1), 2^i) usecs */
+
+static volatile int done = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static zcm_trans_t *create(const char *opts, int cpu)
+{
+    char url[256];
+    if (cpu >= 0)
+        snprintf(url, sizeof(url), "%s%s&recv_cpu=%d", URL, opts, cpu);
+    else
+        snprintf(url, sizeof(url), "%s%s", URL, opts);
+
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_t *zt = zcm_transport_find("udpm")(u);
+    zcm_url_destroy(u);
+    assert(zt);
+    return zt;
+}
+
+static void *ponger(void *usr)
+{
+    zcm_trans_t *zt = (zcm_trans_t*)usr;
+    zcm_trans_recvmsg_enable(zt, "PING", 1);
+
+    zcm_msg_t msg;
+    while (!done) {
+        if (zcm_trans_recvmsg(zt, &msg, 100) != ZCM_EOK)
+            continue;
+        zcm_msg_t pong = { 0, "PONG", msg.len, msg.buf };
+        zcm_trans_sendmsg(zt, pong);
+    }
+    return NULL;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(unsigned busyPoll, int pingCpu, int pongCpu, size_t n, size_t datasz)
+{
+    char opts[64] = "";
+    if (busyPoll > 0)
+        snprintf(opts, sizeof(opts), "&busy_poll=%u", busyPoll);
+
+    zcm_trans_t *ping = create(opts, pingCpu);
+    zcm_trans_t *pong = create(opts, pongCpu);
+    zcm_trans_recvmsg_enable(ping, "PONG", 1);
+
+    done = 0;
+    pthread_t thr;
+    pthread_create(&thr, NULL, ponger, pong);
+
+    char *data = calloc(1, datasz);
+    double *rtt = malloc(n * sizeof(double));
+    size_t hist[NBUCKETS] = {0};
+    size_t nrtt = 0, timeouts = 0;
+
+    for (size_t i = 0; i < n + n / 10; i++) {
+        zcm_msg_t msg = { 0, "PING", datasz, data };
+        double start = now();
+        zcm_trans_sendmsg(ping, msg);
+
+        zcm_msg_t reply;
+        if (zcm_trans_recvmsg(ping, &reply, 100) != ZCM_EOK) {
+            timeouts++;
+            continue;
+        }
+        double us = (now() - start) * 1e6;
+
+        /* the first 10% warm up the caches and the pools */
+        if (i < n / 10 || nrtt == n)
+            continue;
+        rtt[nrtt++] = us;
+        size_t b = 0;
+        while (b < NBUCKETS - 1 && us >= (double)(1u << b))
+            b++;
+        hist[b]++;
+    }
+
+    done = 1;
+    pthread_join(thr, NULL);
+
+    zcm_udpm_stats_t stats;
+    zcm_trans_udpm_stats(ping, &stats);
+
+    printf("busy_poll=%u ping_cpu=%d pong_cpu=%d: %zu round trips, %zu timeouts, "
+           "%lu spins hit, %lu missed\n",
+           busyPoll, pingCpu, pongCpu, nrtt, timeouts,
+           (unsigned long)stats.busy_poll_hits, (unsigned long)stats.busy_poll_misses);
+    if (nrtt > 0) {
+        qsort(rtt, nrtt, sizeof(double), cmpDouble);
+        printf("  usecs: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               rtt[nrtt / 2], rtt[nrtt * 9 / 10], rtt[nrtt * 99 / 100],
+               rtt[nrtt * 999 / 1000], rtt[nrtt - 1]);
+        for (size_t b = 0; b < NBUCKETS; b++) {
+            if (hist[b] == 0)
+                continue;
+            printf("  %6u - %-6u us %8zu  ", b ? 1u << (b - 1) : 0, 1u << b, hist[b]);
+            for (size_t j = 0; j < 60 * hist[b] / nrtt; j++)
+                putchar('#');
+            putchar('\n');
+        }
+    }
+
+    zcm_trans_destroy(ping);
+    zcm_trans_destroy(pong);
+    free(rtt);
+    free(data);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n <count>   round trips to measure (default %d)\n"
+            "  -s <bytes>   message size (default %d)\n"
+            "  -b <usecs>   only measure this busy_poll setting (0: plain poll())\n"
+            "  -c <cpu>     pin the pinging thread to this cpu\n"
+            "  -C <cpu>     pin the answering thread to this cpu\n",
+            prog, N, DATASZ);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = N, datasz = DATASZ;
+    int busyPoll = -1, pingCpu = -1, pongCpu = -1;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:b:c:C:h")) != -1) {
+        switch (c) {
+            case 'n': n = strtoul(optarg, NULL, 10); break;
+            case 's': datasz = strtoul(optarg, NULL, 10); break;
+            case 'b': busyPoll = atoi(optarg); break;
+            case 'c': pingCpu = atoi(optarg); break;
+            case 'C': pongCpu = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (busyPoll >= 0) {
+        run(busyPoll, pingCpu, pongCpu, n, datasz);
+    } else {
+        run(0, pingCpu, pongCpu, n, datasz);
+        run(BUSY_POLL_US, pingCpu, pongCpu, n, datasz);
+    }
+    return 0;
+}
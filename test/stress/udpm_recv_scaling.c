@@ -0,0 +1,146 @@
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <zcm/transport_udpm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Measures receive throughput against the number of receive sockets
+ * ('recv_sockets' url option). Several senders, each its own transport (and so
+ * its own source port), send fragmented messages to one receiver. Every
+ * message carries its sender and sequence number, so the receiver also checks
+ * that each sender's messages arrive complete and in order. */
+
+#define URL "udpm://239.255.76.67:7667?ttl=0&rcvbuf=16000000"
+#define NSENDERS 8
+#define NMSGS 2000
+#define MSGSZ (16*1024)
+
+static const int SOCKETS[] = { 1, 2, 4 };
+
+typedef struct
+{
+    uint32_t id;
+    size_t nmsgs;
+    size_t datasz;
+} sender_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static zcm_trans_t *create(const char *opts)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "%s%s", URL, opts);
+
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_t *zt = zcm_transport_find("udpm")(u);
+    zcm_url_destroy(u);
+    assert(zt);
+    return zt;
+}
+
+static void *sender(void *usr)
+{
+    sender_t *s = (sender_t*)usr;
+    zcm_trans_t *zt = create("");
+
+    char *data = calloc(1, s->datasz);
+    for (uint32_t i = 0; i < s->nmsgs; i++) {
+        memcpy(data, &s->id, sizeof(s->id));
+        memcpy(data + sizeof(s->id), &i, sizeof(i));
+        zcm_msg_t msg = { 0, "SCALING", s->datasz, data };
+        zcm_trans_sendmsg(zt, msg);
+        /* keep the total rate below what the kernel buffers can absorb */
+        if (i % 50 == 49)
+            usleep(1000);
+    }
+
+    zcm_trans_destroy(zt);
+    free(data);
+    return NULL;
+}
+
+static void run(int nsockets, size_t nsenders, size_t nmsgs, size_t datasz)
+{
+    char opts[64];
+    snprintf(opts, sizeof(opts), "&recv_sockets=%d", nsockets);
+    zcm_trans_t *zt = create(opts);
+    zcm_trans_recvmsg_enable(zt, "SCALING", 1);
+
+    uint32_t *next = calloc(nsenders, sizeof(uint32_t));
+    size_t recvd = 0, misordered = 0;
+
+    pthread_t thr[nsenders];
+    sender_t senders[nsenders];
+    double start = now();
+    for (size_t i = 0; i < nsenders; i++) {
+        senders[i].id = i;
+        senders[i].nmsgs = nmsgs;
+        senders[i].datasz = datasz;
+        pthread_create(&thr[i], NULL, sender, &senders[i]);
+    }
+
+    double last = start;
+    zcm_msg_t msg;
+    while (recvd < nsenders * nmsgs && zcm_trans_recvmsg(zt, &msg, 500) == ZCM_EOK) {
+        uint32_t id, seq;
+        memcpy(&id, msg.buf, sizeof(id));
+        memcpy(&seq, msg.buf + sizeof(id), sizeof(seq));
+        assert(id < nsenders);
+        if (seq < next[id])
+            misordered++;
+        next[id] = seq + 1;
+        recvd++;
+        last = now();
+    }
+
+    for (size_t i = 0; i < nsenders; i++)
+        pthread_join(thr[i], NULL);
+
+    zcm_udpm_stats_t stats;
+    zcm_trans_udpm_stats(zt, &stats);
+    printf("recv_sockets=%d: %zu/%zu messages, %zu out of order, %.0f msgs/s, "
+           "%llu kernel drops\n  packets per socket:",
+           nsockets, recvd, nsenders * nmsgs, misordered, recvd / (last - start),
+           (unsigned long long)stats.kernel_drops);
+    for (size_t i = 0; i < stats.recv_sockets; i++)
+        printf(" %llu", (unsigned long long)stats.recv_socket_packets[i]);
+    printf("\n");
+
+    zcm_trans_destroy(zt);
+    free(next);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nsenders = NSENDERS, nmsgs = NMSGS, datasz = MSGSZ;
+    int c;
+    while ((c = getopt(argc, argv, "p:n:s:h")) != -1) {
+        switch (c) {
+            case 'p': nsenders = strtoul(optarg, NULL, 10); break;
+            case 'n': nmsgs = strtoul(optarg, NULL, 10); break;
+            case 's': datasz = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-p <senders>] [-n <msgs per sender>] [-s <bytes>]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (datasz < 8)
+        datasz = 8;
+
+    for (size_t i = 0; i < sizeof(SOCKETS)/sizeof(SOCKETS[0]); i++)
+        run(SOCKETS[i], nsenders, nmsgs, datasz);
+    return 0;
+}
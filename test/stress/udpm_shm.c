@@ -0,0 +1,136 @@
+#include <zcm/zcm.h>
+#include <zcm/url.h>
+#include <zcm/transport_registrar.h>
+#include <zcm/transport_udpm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Compares delivering large messages to a receiver on the same host as
+ * fragments and through the shared memory side channel ('shm' url option).
+ * Reports the throughput, the cpu time both ends spent, and the messages the
+ * receiver lost or got corrupted. */
+
+#define URL "udpm://239.255.76.67:7667?ttl=0"
+#define NMSGS 2000
+#define MSGSZ (256*1024)
+#define ARENASZ (64*1024*1024)
+
+typedef struct
+{
+    zcm_trans_t *zt;
+    size_t nmsgs;
+    size_t datasz;
+} sender_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cputime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static zcm_trans_t *create(const char *opts)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "%s%s", URL, opts);
+
+    zcm_url_t *u = zcm_url_create(url);
+    zcm_trans_t *zt = zcm_transport_find("udpm")(u);
+    zcm_url_destroy(u);
+    assert(zt);
+    return zt;
+}
+
+static void *sender(void *usr)
+{
+    sender_t *s = (sender_t*)usr;
+    char *data = malloc(s->datasz);
+    for (size_t i = 0; i < s->datasz; i++)
+        data[i] = (char)i;
+
+    for (uint32_t i = 0; i < s->nmsgs; i++) {
+        memcpy(data, &i, sizeof(i));
+        zcm_msg_t msg = { 0, "SHM", s->datasz, data };
+        zcm_trans_sendmsg(s->zt, msg);
+        /* keep the fragments within what the kernel buffers can absorb */
+        if (i % 4 == 3)
+            usleep(1000);
+    }
+
+    free(data);
+    return NULL;
+}
+
+static void run(const char *opts, size_t nmsgs, size_t datasz)
+{
+    zcm_trans_t *rx = create("&rcvbuf=16000000");
+    zcm_trans_recvmsg_enable(rx, "SHM", 1);
+    sender_t s = { create(opts), nmsgs, datasz };
+
+    size_t recvd = 0, corrupt = 0;
+    double start = now(), cpu = cputime();
+    pthread_t thr;
+    pthread_create(&thr, NULL, sender, &s);
+
+    double last = start;
+    zcm_msg_t msg;
+    while (recvd < nmsgs && zcm_trans_recvmsg(rx, &msg, 500) == ZCM_EOK) {
+        for (size_t i = sizeof(uint32_t); i < msg.len; i++) {
+            if (msg.buf[i] != (char)i) {
+                corrupt++;
+                break;
+            }
+        }
+        recvd++;
+        last = now();
+    }
+    pthread_join(thr, NULL);
+    cpu = cputime() - cpu;
+
+    zcm_udpm_stats_t stats;
+    zcm_trans_udpm_stats(rx, &stats);
+    printf("%-24s %zu/%zu messages, %zu corrupt, %.0f MB/s, %.2fs cpu, "
+           "%llu shm reads, %llu shm lost\n",
+           opts[0] ? opts + 1 : "fragments:", recvd, nmsgs, corrupt,
+           recvd * datasz / (last - start) / 1e6, cpu,
+           (unsigned long long)stats.shm_received, (unsigned long long)stats.shm_lost);
+
+    zcm_trans_destroy(s.zt);
+    zcm_trans_destroy(rx);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nmsgs = NMSGS, datasz = MSGSZ;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+            case 'n': nmsgs = strtoul(optarg, NULL, 10); break;
+            case 's': datasz = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-n <msgs>] [-s <bytes>]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (datasz < 8)
+        datasz = 8;
+
+    char shm[64];
+    snprintf(shm, sizeof(shm), "&shm=%d", ARENASZ);
+    run("", nmsgs, datasz);
+    run(shm, nmsgs, datasz);
+    return 0;
+}
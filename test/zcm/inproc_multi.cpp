@@ -0,0 +1,90 @@
+#include "zcm/zcm.h"
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+
+// Two inproc transports publish on the same channel. Subscribers that were
+// created before and after them, and one receiving all channels, must get
+// the messages of both, and every transport must tear down cleanly
+#define URL "inproc"
+#define CHANNEL "TEST_CHANNEL"
+#define N 150
+
+struct Counts
+{
+    size_t a = 0;
+    size_t b = 0;
+};
+
+static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    Counts *c = (Counts*)usr;
+    if (rbuf->data_size != 1)
+        return;
+    if (rbuf->data[0] == 'a')
+        c->a++;
+    else if (rbuf->data[0] == 'b')
+        c->b++;
+}
+
+int main()
+{
+    // teardown used to hang when the second publisher failed to bind
+    alarm(20);
+
+    Counts cearly, clate, call;
+    zcm_t *early = zcm_create(URL);
+    assert(early);
+    zcm_subscribe(early, CHANNEL, handler, &cearly);
+    zcm_start(early);
+
+    zcm_t *a = zcm_create(URL);
+    zcm_t *b = zcm_create(URL);
+    assert(a && b);
+    // bind the channel in both of them
+    char data = 'w';
+    assert(zcm_publish(a, CHANNEL, &data, 1) == ZCM_EOK);
+    assert(zcm_publish(b, CHANNEL, &data, 1) == ZCM_EOK);
+    usleep(200000);
+
+    zcm_t *late = zcm_create(URL);
+    zcm_t *all = zcm_create(URL);
+    assert(late && all);
+    zcm_subscribe(late, CHANNEL, handler, &clate);
+    zcm_subscribe(all, ".*", handler, &call);
+    zcm_start(late);
+    zcm_start(all);
+    usleep(200000);
+
+    bool ok = true;
+    for (size_t i = 0; i < N; i++) {
+        data = 'a';
+        ok &= zcm_publish(a, CHANNEL, &data, 1) == ZCM_EOK;
+        data = 'b';
+        ok &= zcm_publish(b, CHANNEL, &data, 1) == ZCM_EOK;
+        usleep(1000);
+    }
+    usleep(200000);
+
+    zcm_stop(early);
+    zcm_stop(late);
+    zcm_stop(all);
+    zcm_destroy(early);
+    zcm_destroy(late);
+    zcm_destroy(all);
+    zcm_destroy(a);
+    zcm_destroy(b);
+
+    if (!ok)
+        printf("inproc-multi: publishing failed\n");
+    Counts *counts[] = {&cearly, &clate, &call};
+    const char *names[] = {"early", "late", "all"};
+    for (size_t i = 0; i < 3; i++) {
+        if (counts[i]->a != N || counts[i]->b != N) {
+            printf("inproc-multi: %s subscriber got %zu of a and %zu of b, expected %d\n",
+                   names[i], counts[i]->a, counts[i]->b, N);
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
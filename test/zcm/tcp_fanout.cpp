@@ -0,0 +1,105 @@
+#include "zcm/zcm.h"
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+// A tcp server with two clients on loopback. Every client must get all of the
+// server's messages, small and large, and the server must get all of theirs.
+// The huge messages are larger than the transport's read buffer
+#define URL_SERVER "tcp://127.0.0.1:7810?mode=server"
+#define URL_CLIENT "tcp://127.0.0.1:7810"
+#define CHANNEL "TEST_CHANNEL"
+#define N 50
+#define LARGE (1000*1000)
+#define HUGE (3*1000*1000)
+#define HUGE_EVERY 10
+
+struct Counts
+{
+    size_t small = 0;
+    size_t large = 0;
+    size_t huge = 0;
+    size_t bad = 0;
+};
+
+static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    Counts *c = (Counts*)usr;
+    if (rbuf->data_size == 1 && rbuf->data[0] == 'A') {
+        c->small++;
+        return;
+    }
+    for (size_t i = 0; i < rbuf->data_size; i++) {
+        if (rbuf->data[i] != (char)i) {
+            c->bad++;
+            return;
+        }
+    }
+    if (rbuf->data_size == LARGE)
+        c->large++;
+    else if (rbuf->data_size == HUGE)
+        c->huge++;
+    else
+        c->bad++;
+}
+
+int main()
+{
+    zcm_t *server = zcm_create(URL_SERVER);
+    zcm_t *client1 = zcm_create(URL_CLIENT);
+    zcm_t *client2 = zcm_create(URL_CLIENT);
+    assert(server && client1 && client2);
+
+    Counts cs, c1, c2;
+    zcm_subscribe(server, CHANNEL, handler, &cs);
+    zcm_subscribe(client1, CHANNEL, handler, &c1);
+    zcm_subscribe(client2, CHANNEL, handler, &c2);
+    zcm_start(server);
+    zcm_start(client1);
+    zcm_start(client2);
+
+    // give the server time to accept the clients
+    usleep(200000);
+
+    std::vector<char> large(LARGE), huge(HUGE);
+    for (size_t i = 0; i < large.size(); i++)
+        large[i] = (char)i;
+    for (size_t i = 0; i < huge.size(); i++)
+        huge[i] = (char)i;
+
+    char data = 'A';
+    for (size_t i = 0; i < N; i++) {
+        zcm_publish(server, CHANNEL, &data, 1);
+        zcm_publish(server, CHANNEL, large.data(), large.size());
+        zcm_publish(client1, CHANNEL, &data, 1);
+        zcm_publish(client2, CHANNEL, &data, 1);
+        if (i % HUGE_EVERY == 0) {
+            zcm_publish(server, CHANNEL, huge.data(), huge.size());
+            zcm_publish(client1, CHANNEL, huge.data(), huge.size());
+        }
+        usleep(10000);
+    }
+    usleep(500000);
+
+    zcm_stop(server);
+    zcm_stop(client1);
+    zcm_stop(client2);
+    zcm_destroy(client1);
+    zcm_destroy(client2);
+    zcm_destroy(server);
+
+    const size_t NHUGE = N / HUGE_EVERY;
+    bool ok = c1.small == N && c1.large == N && c1.huge == NHUGE && c1.bad == 0 &&
+              c2.small == N && c2.large == N && c2.huge == NHUGE && c2.bad == 0 &&
+              cs.small == 2 * N && cs.large == 0 && cs.huge == NHUGE && cs.bad == 0;
+    if (!ok) {
+        printf("server got %zu small %zu huge %zu bad\n", cs.small, cs.huge, cs.bad);
+        printf("client1 got %zu small %zu large %zu huge %zu bad\n",
+               c1.small, c1.large, c1.huge, c1.bad);
+        printf("client2 got %zu small %zu large %zu huge %zu bad\n",
+               c2.small, c2.large, c2.huge, c2.bad);
+        return 1;
+    }
+    return 0;
+}
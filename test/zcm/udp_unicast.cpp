@@ -0,0 +1,153 @@
+#include "zcm/zcm.h"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+
+// Two udp:// transports on loopback, each the other's only peer. Both small
+// and fragmented messages have to make it across in both directions. Each
+// side only subscribes to what the other one sends
+#define URL_A "udp://127.0.0.1:7701?peers=127.0.0.1:7702"
+#define URL_B "udp://127.0.0.1:7702?peers=127.0.0.1:7701"
+#define CHANNEL_A "TO_A"
+#define CHANNEL_B "TO_B"
+#define N 20
+#define LARGE (200*1000)
+
+struct Counts
+{
+    size_t small = 0;
+    size_t large = 0;
+    size_t bad = 0;
+};
+
+static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    Counts *c = (Counts*)usr;
+    if (rbuf->data_size == 1 && rbuf->data[0] == 'A') {
+        c->small++;
+        return;
+    }
+    for (size_t i = 0; i < rbuf->data_size; i++) {
+        if (rbuf->data[i] != (char)i) {
+            c->bad++;
+            return;
+        }
+    }
+    if (rbuf->data_size == LARGE)
+        c->large++;
+    else
+        c->bad++;
+}
+
+static bool test(const char *opts)
+{
+    char urlA[256], urlB[256];
+    snprintf(urlA, sizeof(urlA), "%s%s", URL_A, opts);
+    snprintf(urlB, sizeof(urlB), "%s%s", URL_B, opts);
+
+    zcm_t *a = zcm_create(urlA);
+    zcm_t *b = zcm_create(urlB);
+    assert(a && b);
+
+    Counts ca, cb;
+    zcm_subscribe(a, CHANNEL_A, handler, &ca);
+    zcm_subscribe(b, CHANNEL_B, handler, &cb);
+    zcm_start(a);
+    zcm_start(b);
+
+    std::vector<char> large(LARGE);
+    for (size_t i = 0; i < large.size(); i++)
+        large[i] = (char)i;
+
+    char data = 'A';
+    for (size_t i = 0; i < N; i++) {
+        zcm_publish(a, CHANNEL_B, &data, 1);
+        zcm_publish(b, CHANNEL_A, &data, 1);
+        zcm_publish(a, CHANNEL_B, large.data(), large.size());
+        zcm_publish(b, CHANNEL_A, large.data(), large.size());
+        usleep(10000);
+    }
+    usleep(200000);
+
+    zcm_stop(a);
+    zcm_stop(b);
+    zcm_destroy(a);
+    zcm_destroy(b);
+
+    bool ok = ca.small == N && ca.large == N && ca.bad == 0 &&
+              cb.small == N && cb.large == N && cb.bad == 0;
+    if (!ok)
+        printf("udp%s: A got %zu small %zu large %zu bad, B got %zu small %zu large %zu bad\n",
+               opts, ca.small, ca.large, ca.bad, cb.small, cb.large, cb.bad);
+    return ok;
+}
+
+// The url ports are real ports: the transport binds the one it was given and
+// sends to its peer's, so that it can talk to anything else on the link
+#define URL_PORTS "udp://127.0.0.1:7703?peers=127.0.0.1:7704"
+#define PORT_BOUND 7703
+#define PORT_PEER 7704
+
+static int udpSocket(u_short port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool testPorts()
+{
+    int peer = udpSocket(PORT_PEER);
+    assert(peer >= 0);
+    struct timeval tv = {1, 0};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    zcm_t *zcm = zcm_create(URL_PORTS);
+    assert(zcm);
+
+    bool ok = true;
+    int bound = udpSocket(PORT_BOUND);
+    if (bound >= 0 || errno != EADDRINUSE) {
+        printf("udp: the transport isn't bound to port %d\n", PORT_BOUND);
+        ok = false;
+    }
+    if (bound >= 0)
+        close(bound);
+
+    char data = 'A';
+    char buf[256];
+    zcm_publish(zcm, CHANNEL_B, &data, 1);
+    if (recv(peer, buf, sizeof(buf), 0) <= 0) {
+        printf("udp: nothing was sent to port %d\n", PORT_PEER);
+        ok = false;
+    }
+
+    zcm_destroy(zcm);
+    close(peer);
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= test("");
+    ok &= test("&connect=1");
+    ok &= testPorts();
+    return ok ? 0 : 1;
+}
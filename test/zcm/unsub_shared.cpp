@@ -0,0 +1,46 @@
+#include "zcm/zcm.h"
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+
+// Two handlers subscribe to the same channel and one of them is unsubscribed.
+// The other one must keep getting every message
+#define URL "udpm://239.255.76.67:7667?ttl=0"
+#define CHANNEL "TEST_SHARED"
+#define N 10
+
+static void handler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    (*(size_t*)usr)++;
+}
+
+int main()
+{
+    zcm_t *zcm = zcm_create(URL);
+    assert(zcm);
+
+    size_t nkept = 0, ndropped = 0;
+    zcm_sub_t *kept = zcm_subscribe(zcm, CHANNEL, handler, &nkept);
+    zcm_sub_t *dropped = zcm_subscribe(zcm, CHANNEL, handler, &ndropped);
+    assert(kept && dropped);
+    zcm_unsubscribe(zcm, dropped);
+    zcm_start(zcm);
+
+    char data = 'A';
+    for (size_t i = 0; i < N; i++) {
+        zcm_publish(zcm, CHANNEL, &data, 1);
+        usleep(10000);
+    }
+    usleep(200000);
+
+    zcm_stop(zcm);
+    zcm_unsubscribe(zcm, kept);
+    zcm_destroy(zcm);
+
+    if (nkept != N || ndropped != 0) {
+        printf("unsub-shared: kept handler got %zu of %d, dropped handler got %zu\n",
+               nkept, N, ndropped);
+        return 1;
+    }
+    return 0;
+}
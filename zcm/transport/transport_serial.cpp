@@ -1,51 +1,131 @@
 #include "zcm/transport.h"
 #include "zcm/transport_registrar.h"
 #include "zcm/transport_register.hpp"
+#include "zcm/transport_serial.h"
 #include "zcm/util/lockfile.h"
 #include "zcm/util/debug.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 #include <linux/usbdevice_fs.h>
+#include <asm/ioctls.h>
 
 #include <cassert>
 #include <cstring>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <mutex>
+#include <vector>
 using namespace std;
 
 // TODO: This transport layer needs to be "hardened" to handle
 // all of the possible errors and corner cases. Currently, it
 // should work fine in most cases, but it might fail on some
 // rare cases...
+//
+// sendmsg() frames messages into a ring buffer (the 'queue' url option) and
+// returns; a writer thread empties it with one write() per contiguous run of
+// bytes, so frames queued while the previous write was in progress go out
+// together. sendmsg() only blocks when the ring is full. Nothing waits for
+// the bytes to leave the UART except zcm_trans_serial_flush().
+//
+// Two framings are supported, selected with the 'framing' url option. Both
+// ends of a link must use the same one:
+//
+//   legacy (the default, for existing peers):
+//     0xcc 0x00 | channel length (1) | data length (4) | channel | data | sum (1)
+//     with every 0xcc in the channel and data doubled, and an 8-bit additive sum
+//
+//   cobs:
+//     COBS(version (1) | channel length (1) | channel | data | CRC-32C (4)) | 0x00
+//     where COBS encoding removes every zero byte, so the 0x00 delimiter is
+//     unambiguous and a receiver resyncs on the next one. It costs one byte in
+//     254 instead of one in 256 for random data, and the CRC catches the
+//     corrupted frames the additive sum lets through.
 
 // Define this the class name you want
 #define ZCM_TRANS_CLASSNAME TransportSerial
 #define MTU (1<<20)
 #define ESCAPE_CHAR 0xcc
+#define FRAME_OVERHEAD 8                  // sync, lengths and checksum
+#define MAX_FRAME_SIZE (FRAME_OVERHEAD + 2*(ZCM_CHANNEL_MAXLEN + MTU))
+#define COBS_VERSION 1
+#define COBS_OVERHEAD 6                   // version, channel length and CRC
+// an encoded frame of 'n' bytes, with its delimiter
+#define COBS_ENCODED_SIZE(n) ((n) + (n)/254 + 2)
+#define COBS_MAX_FRAME_SIZE COBS_ENCODED_SIZE(COBS_OVERHEAD + ZCM_CHANNEL_MAXLEN + MTU)
+#define READ_BUF_SIZE (64<<10)
+#define READ_RETRY_MS 10                  // wait after a failed read
+#define DEFAULT_VMIN 30
+#define DEFAULT_VTIME 1
+#define DEFAULT_QUEUE_SIZE (4<<20)
+#define RATE_PERIOD_MS 1000
 
 using u8  = uint8_t;
 using u16 = uint16_t;
 using u32 = uint32_t;
 using u64 = uint64_t;
 
+// Rates that aren't one of the B* constants are set with the termios2
+// ioctls. <asm/termbits.h> declares struct termios2 but can't be included
+// alongside <termios.h>, so the generic layout (and with it the ioctl
+// numbers, which encode its size) is repeated here
+#if defined(TCGETS2) && (defined(__x86_64__) || defined(__i386__) || \
+                         defined(__aarch64__) || defined(__arm__))
+#define SERIAL_CUSTOM_BAUD
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+struct serial_termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t     c_line;
+    cc_t     c_cc[19];
+    speed_t  c_ispeed;
+    speed_t  c_ospeed;
+};
+#define SERIAL_TCGETS2 _IOR('T', 0x2A, struct serial_termios2)
+#define SERIAL_TCSETS2 _IOW('T', 0x2B, struct serial_termios2)
+#endif
+
 struct Serial
 {
     Serial(){}
     ~Serial() { close(); }
 
-    bool open(const string& port, int baud);
+    // 'vmin' and 'vtime' are the termios read settings: a read() returns
+    // once it has 'vmin' bytes, or 'vtime' tenths of a second after the last
+    // byte arrived. 'lowLatency' asks the driver not to buffer received bytes
+    bool open(const string& port, int baud, int vmin, int vtime, bool lowLatency);
     bool isOpen() { return fd > 0; };
     void close();
 
     int write(const u8 *buf, size_t sz);
     int read(u8 *buf, size_t sz);
+    // Wait up to 'timeout' ms (forever if negative) for something to read.
+    // Returns 1 if there is, 0 on timeout and -1 on error
+    int waitReadable(int timeout);
+    // Wait until everything written has been transmitted
+    int drain();
     static bool baudIsValid(int baud);
+    // The B* constant for 'baud', or B0 if there isn't one
+    static speed_t baudToSpeed(int baud);
 
     Serial(const Serial&) = delete;
     Serial(Serial&&) = delete;
@@ -57,11 +137,12 @@ struct Serial
     int fd = -1;
 };
 
-bool Serial::open(const string& port_, int baud)
+bool Serial::open(const string& port_, int baud, int vmin, int vtime, bool lowLatency)
 {
     if (baud == 0) {
         fprintf(stderr, "Serial baud rate not specified in url. Proceeding without setting baud\n");
     } else if (!baudIsValid(baud)) {
+        ZCM_DEBUG("unsupported baud rate: %d", baud);
         return false;
     }
 
@@ -71,7 +152,7 @@ bool Serial::open(const string& port_, int baud)
     }
     this->port = port_;
 
-    int flags = O_RDWR | O_NOCTTY | O_SYNC;
+    int flags = O_RDWR | O_NOCTTY;
     fd = ::open(port.c_str(), flags, 0);
     if(fd < 0) {
         ZCM_DEBUG("failed to open serial device (%s): %s", port.c_str(), strerror(errno));
@@ -92,17 +173,22 @@ bool Serial::open(const string& port_, int baud)
         goto fail;
     }
 
-    if (baud != 0) {
-        cfsetispeed(&opts, baud);
-        cfsetospeed(&opts, baud);
+    if (baudToSpeed(baud) != B0) {
+        cfsetispeed(&opts, baudToSpeed(baud));
+        cfsetospeed(&opts, baudToSpeed(baud));
     }
+#ifdef CIBAUD
+    // a separate input rate left by a previous custom rate would stick
+    if (baud != 0)
+        opts.c_cflag &= ~CIBAUD;
+#endif
     cfmakeraw(&opts);
 
     opts.c_cflag &= ~CSTOPB;
     opts.c_cflag |= CS8;
     opts.c_cflag &= ~PARENB;
-    opts.c_cc[VTIME]    = 1;
-    opts.c_cc[VMIN]     = 30;
+    opts.c_cc[VTIME]    = vtime;
+    opts.c_cc[VMIN]     = vmin;
 
     // set the new termios config
     if(tcsetattr(fd, TCSANOW, &opts)) {
@@ -110,6 +196,37 @@ bool Serial::open(const string& port_, int baud)
         goto fail;
     }
 
+#ifdef SERIAL_CUSTOM_BAUD
+    if (baud != 0 && baudToSpeed(baud) == B0) {
+        struct serial_termios2 opts2;
+        if (ioctl(fd, SERIAL_TCGETS2, &opts2)) {
+            ZCM_DEBUG("failed to get termios2 options on fd: %s", strerror(errno));
+            goto fail;
+        }
+        opts2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+        opts2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+        opts2.c_ispeed = baud;
+        opts2.c_ospeed = baud;
+        if (ioctl(fd, SERIAL_TCSETS2, &opts2)) {
+            ZCM_DEBUG("failed to set baud %d on fd: %s", baud, strerror(errno));
+            goto fail;
+        }
+    }
+#endif
+
+    if (lowLatency) {
+        // Only real UARTs have this, and some of their drivers ignore it
+        struct serial_struct ss;
+        bool ok = ioctl(fd, TIOCGSERIAL, &ss) == 0;
+        if (ok) {
+            ss.flags |= ASYNC_LOW_LATENCY;
+            ok = ioctl(fd, TIOCSSERIAL, &ss) == 0;
+        }
+        if (!ok)
+            fprintf(stderr, "ZCM Warning: failed to set low latency mode on %s: %s\n",
+                    port.c_str(), strerror(errno));
+    }
+
     tcflush(fd, TCIOFLUSH);
 
     return true;
@@ -151,10 +268,37 @@ int Serial::write(const u8 *buf, size_t sz)
     assert(this->isOpen());
     int ret = ::write(fd, buf, sz);
     if(ret == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
         ZCM_DEBUG("ERR: write failed: %s", strerror(errno));
         return -1;
     }
-    fsync(fd);
+    return ret;
+}
+
+int Serial::waitReadable(int timeout)
+{
+    assert(this->isOpen());
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ret = poll(&pfd, 1, timeout);
+    if (ret < 0) {
+        if (errno == EINTR)
+            return 0;
+        ZCM_DEBUG("ERR: poll failed: %s", strerror(errno));
+        return -1;
+    }
+    return ret > 0 ? 1 : 0;
+}
+
+int Serial::drain()
+{
+    assert(this->isOpen());
+    int ret;
+    do {
+        ret = tcdrain(fd);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+        ZCM_DEBUG("ERR: tcdrain failed: %s", strerror(errno));
     return ret;
 }
 
@@ -169,17 +313,141 @@ int Serial::read(u8 *buf, size_t sz)
 }
 
 bool Serial::baudIsValid(int baud)
+{
+    if (baudToSpeed(baud) != B0)
+        return true;
+#ifdef SERIAL_CUSTOM_BAUD
+    return baud > 0;
+#else
+    return false;
+#endif
+}
+
+speed_t Serial::baudToSpeed(int baud)
 {
     switch (baud) {
-        case 9600:
-        case 19200:
-        case 38400:
-        case 57600:
-        case 115200:
-            return true;
-        default:
-            return false;
+        case 50:      return B50;
+        case 75:      return B75;
+        case 110:     return B110;
+        case 134:     return B134;
+        case 150:     return B150;
+        case 200:     return B200;
+        case 300:     return B300;
+        case 600:     return B600;
+        case 1200:    return B1200;
+        case 1800:    return B1800;
+        case 2400:    return B2400;
+        case 4800:    return B4800;
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+#ifdef B460800
+        case 460800:  return B460800;
+        case 500000:  return B500000;
+        case 576000:  return B576000;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 1152000: return B1152000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 2500000: return B2500000;
+        case 3000000: return B3000000;
+        case 3500000: return B3500000;
+        case 4000000: return B4000000;
+#endif
+        default:      return B0;
+    }
+}
+
+// CRC-32C (Castagnoli), as used by iSCSI and ext4. Chains like zlib's
+// crc32(): crc32c(crc32c(0, a), b) is the CRC of a followed by b
+struct Crc32cTables
+{
+    u32 t[8][256];
+    Crc32cTables()
+    {
+        for (u32 i = 0; i < 256; i++) {
+            u32 c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+            t[0][i] = c;
+        }
+        for (u32 i = 0; i < 256; i++)
+            for (int k = 1; k < 8; k++)
+                t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+    }
+};
+
+// Slicing-by-8: one table lookup per byte, but eight independent ones
+static u32 crc32cSw(u32 crc, const u8 *p, size_t len)
+{
+    static const Crc32cTables tables;
+    const auto& t = tables.t;
+    while (len >= 8) {
+        u32 lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24);
+        u32 hi = p[4] | p[5] << 8 | p[6] << 16 | (u32)p[7] << 24;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
     }
+    while (len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+// The SSE4.2 crc32 instruction computes exactly this CRC
+__attribute__((target("sse4.2")))
+static u32 crc32cHw(u32 crc, const u8 *p, size_t len)
+{
+    u64 c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        u64 v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (u32)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static u32 crc32c(u32 crc, const u8 *p, size_t len)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw)
+        return ~crc32cHw(~crc, p, len);
+#endif
+    return ~crc32cSw(~crc, p, len);
+}
+
+// Decode the COBS encoded 'len' bytes at 'buf' (without the delimiter) in
+// place. Returns the decoded length, or -1 if they aren't valid COBS
+static ssize_t cobsDecode(u8 *buf, size_t len)
+{
+    size_t in = 0, out = 0;
+    while (in < len) {
+        u8 code = buf[in++];
+        size_t n = code - 1;
+        if (code == 0 || in + n > len)
+            return -1;
+        memmove(buf + out, buf + in, n);
+        in += n;
+        out += n;
+        // every block but the last, and those of 254 bytes, ends with a zero
+        if (code != 0xff && in < len)
+            buf[out++] = 0;
+    }
+    return out;
 }
 
 struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
@@ -191,9 +459,66 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     unordered_map<string, int> recvChannels;
     bool recvAllChannels = false;
 
-    // Preallocated memory for recv
-    u8 recvChannelMem[33];
-    u8 recvDataMem[MTU];
+    enum class Framing { LEGACY, COBS };
+    Framing framing = Framing::LEGACY;
+
+    // Bytes read from the device but not parsed yet. One read may return
+    // several frames, or end in the middle of one
+    vector<u8> readBuf;
+    size_t readIndex = 0, readSize = 0;
+
+    // The receive state machine. A frame can span any number of reads and
+    // recvmsg() calls, so where the parser is in it is kept here
+    enum class RecvState {
+        SYNC,           // looking for the escape char of a sync
+        SYNC_ZERO,      // the zero after it
+        CHANNEL_LEN,
+        DATA_LEN,
+        CHANNEL,
+        DATA,
+        CHECKSUM,
+    };
+    RecvState recvState = RecvState::SYNC;
+    size_t recvPos = 0;         // bytes of the current field received so far
+    bool recvEscaped = false;   // the last byte was an escape char
+    u8 recvChannelLen = 0;
+    u32 recvDataLen = 0;
+
+    // The message being received. Both grow to fit the largest one seen
+    u8 recvChannelMem[ZCM_CHANNEL_MAXLEN + 1];
+    vector<u8> recvData;
+
+    // cobs framing: the frame being received, decoded in place once its
+    // delimiter arrives. Frames too large for any message are skipped
+    vector<u8> cobsFrame;
+    size_t cobsFrameLen = 0;
+    bool cobsFrameOverflow = false;
+
+    atomic<u64> messagesReceived {0};
+    atomic<u64> framesInvalid {0};
+
+    // The send queue: a ring of framed bytes. 'queueHead' and 'queueTail'
+    // only grow, the bytes between them are waiting to be written. sendmsg()
+    // reserves space under 'queueMut', fills it without the lock, and then
+    // publishes it by advancing 'queueHead'
+    mutex sendMut;   // one sendmsg() at a time
+    mutex queueMut;
+    condition_variable queueCond;
+    vector<u8> queue;
+    u64 queueHead = 0;
+    u64 queueTail = 0;
+    bool running = false;
+    std::thread writerThread;
+
+    // Counters, protected by 'queueMut'
+    u64 bytesWritten = 0;
+    u64 bytesDropped = 0;
+    u64 messagesSent = 0;
+    u64 writeSyscalls = 0;
+    size_t queueBytesMax = 0;
+    double writeRate = 0;
+    u64 rateBytes = 0;
+    chrono::steady_clock::time_point rateStart;
 
     string *findOption(const string& s)
     {
@@ -233,13 +558,142 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             }
         }
 
+        auto parseInt = [&](const char *name, int& value, int lo, int hi) {
+            auto *str = findOption(name);
+            if (!str)
+                return true;
+            char *end;
+            long v = strtol(str->c_str(), &end, 10);
+            if (str->empty() || *end != '\0' || v < lo || v > hi) {
+                ZCM_DEBUG("serial: '%s' must be an integer in [%d, %d]", name, lo, hi);
+                return false;
+            }
+            value = (int)v;
+            return true;
+        };
+        int vmin = DEFAULT_VMIN, vtime = DEFAULT_VTIME, lowLatency = 0;
+        if (!parseInt("vmin", vmin, 0, 255) || !parseInt("vtime", vtime, 0, 255) ||
+            !parseInt("low_latency", lowLatency, 0, 1))
+            return;
+
+        size_t queueSize = DEFAULT_QUEUE_SIZE;
+        auto *queueStr = findOption("queue");
+        if (queueStr) {
+            queueSize = strtoull(queueStr->c_str(), NULL, 10);
+            if (queueSize < MAX_FRAME_SIZE) {
+                ZCM_DEBUG("serial: 'queue' must be at least %zu bytes", (size_t)MAX_FRAME_SIZE);
+                return;
+            }
+        }
+
+        auto *framingStr = findOption("framing");
+        if (framingStr) {
+            if (*framingStr == "cobs") {
+                framing = Framing::COBS;
+            } else if (*framingStr != "legacy") {
+                ZCM_DEBUG("serial: 'framing' must be 'legacy' or 'cobs'");
+                return;
+            }
+        }
+        readBuf.resize(READ_BUF_SIZE);
+
         auto address = zcm_url_address(url);
-        ser.open(address, baud);
+        if (!ser.open(address, baud, vmin, vtime, lowLatency))
+            return;
+
+        queue.resize(queueSize);
+        rateStart = chrono::steady_clock::now();
+        running = true;
+        writerThread = std::thread(&ZCM_TRANS_CLASSNAME::runWriter, this);
     }
 
     ~ZCM_TRANS_CLASSNAME()
     {
-        // TODO shutdown serial
+        // The writer empties the queue before it exits
+        if (writerThread.joinable()) {
+            {
+                unique_lock<mutex> lk(queueMut);
+                running = false;
+            }
+            queueCond.notify_all();
+            writerThread.join();
+        }
+    }
+
+    // Fold the bytes written since 'rateStart' into 'writeRate' once a period
+    // has passed. Requires 'queueMut'
+    void updateRate()
+    {
+        auto now = chrono::steady_clock::now();
+        double elapsed = chrono::duration<double>(now - rateStart).count();
+        if (elapsed * 1000 < RATE_PERIOD_MS)
+            return;
+        writeRate = rateBytes / elapsed;
+        rateBytes = 0;
+        rateStart = now;
+    }
+
+    void runWriter()
+    {
+        unique_lock<mutex> lk(queueMut);
+        while (true) {
+            if (queueHead == queueTail) {
+                if (!running)
+                    break;
+                // wake up once a period while idle, so that the rate decays
+                queueCond.wait_for(lk, chrono::milliseconds(RATE_PERIOD_MS));
+                updateRate();
+                continue;
+            }
+
+            // Everything up to the end of the ring goes out in one write().
+            // The bytes between the tail and the head aren't touched by
+            // sendmsg(), so they can be written without the lock
+            size_t off = queueTail % queue.size();
+            size_t len = min((size_t)(queueHead - queueTail), queue.size() - off);
+            lk.unlock();
+            int ret = ser.write(&queue[off], len);
+            lk.lock();
+
+            writeSyscalls++;
+            if (ret < 0) {
+                // The device is gone or broken: drop what's queued rather
+                // than hold up the senders forever
+                bytesDropped += queueHead - queueTail;
+                queueTail = queueHead;
+            } else {
+                queueTail += ret;
+                bytesWritten += ret;
+                rateBytes += ret;
+            }
+            updateRate();
+            queueCond.notify_all();
+        }
+    }
+
+    int flush()
+    {
+        {
+            unique_lock<mutex> lk(queueMut);
+            queueCond.wait(lk, [&]() { return queueHead == queueTail; });
+        }
+        return ser.drain() == 0 ? ZCM_EOK : ZCM_EUNKNOWN;
+    }
+
+    void getStats(zcm_serial_stats_t *stats)
+    {
+        unique_lock<mutex> lk(queueMut);
+        updateRate();
+        stats->bytes_written = bytesWritten;
+        stats->bytes_dropped = bytesDropped;
+        stats->messages_sent = messagesSent;
+        stats->messages_received = messagesReceived;
+        stats->frames_invalid = framesInvalid;
+        stats->write_syscalls = writeSyscalls;
+        stats->bytes_per_sec = writeRate;
+        stats->queue_size = queue.size();
+        stats->queue_bytes = queueHead - queueTail;
+        stats->queue_bytes_max = queueBytesMax;
     }
 
     bool good()
@@ -253,67 +707,148 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         return MTU;
     }
 
-    int sendmsg(zcm_msg_t msg)
+    // Copy 'len' bytes into the queue at 'index', which may wrap around
+    void putBytes(u64& index, const u8 *data, size_t len)
     {
-        string channel = msg.channel;
-        if (channel.size() > ZCM_CHANNEL_MAXLEN)
-            return ZCM_EINVALID;
-        if (msg.len > MTU)
-            return ZCM_EINVALID;
+        size_t off = index % queue.size();
+        size_t n = min(len, queue.size() - off);
+        memcpy(&queue[off], data, n);
+        memcpy(&queue[0], data + n, len - n);
+        index += len;
+    }
+
+    void putByte(u64& index, u8 c)
+    {
+        queue[index++ % queue.size()] = c;
+    }
 
-        u8 buffer[1024];
-        size_t index = 0;
+    // Frame a message into the queue at 'index', returning the end of the
+    // frame. The space must have been reserved
+    u64 frameLegacy(u64 index, const string& channel, const zcm_msg_t& msg)
+    {
         u8 sum = 0;  // TODO introduce better checksum
 
+        // Copy the runs between escape chars as they are
         auto writeBytes = [&](const u8 *data, size_t len) {
-            for (size_t i = 0; i < len; i++) {
-                // Less than 2 bytes of buffer left? Flush it.
-                if (index >= sizeof(buffer)-1) {
-                    ser.write(buffer, index);
-                    index = 0;
-                }
-                u8 c = data[i];
-                sum += c;
+            for (size_t i = 0; i < len; i++)
+                sum += data[i];
+            while (len > 0) {
+                auto *esc = (const u8*)memchr(data, ESCAPE_CHAR, len);
+                size_t n = esc ? esc - data + 1 : len;
+                putBytes(index, data, n);
                 // Escape byte?
-                if (c == ESCAPE_CHAR) {
-                    buffer[index++] = ESCAPE_CHAR;
-                    buffer[index++] = c;
-                } else {
-                    buffer[index++] = c;
-                }
-            }
-        };
-
-        auto finish = [&]() {
-            if (index != 0) {
-                ser.write(buffer, index);
-                index = 0;
+                if (esc)
+                    putByte(index, ESCAPE_CHAR);
+                data += n;
+                len -= n;
             }
-            ser.write(&sum, 1);
         };
 
         // Sync bytes are Escape and 1 zero
-        buffer[index++] = ESCAPE_CHAR;
-        buffer[index++] = 0;
+        putByte(index, ESCAPE_CHAR);
+        putByte(index, 0);
 
         // Length of the channel (1 byte) due to ZCM_CHANNEL_MAXLEN
         // being less than 256
         static_assert(ZCM_CHANNEL_MAXLEN < (1<<8),
                       "Expected channel length to fit in one byte");
-        buffer[index++] = (uint8_t)channel.size();
+        putByte(index, (u8)channel.size());
 
         // Length of the data (32-bits): Big Endian
         static_assert(MTU < (1ULL<<32),
                       "Expected data length to fit in 32-bits");
         u32 len = (u32)msg.len;
-        buffer[index++] = (len>>24)&0xff;
-        buffer[index++] = (len>>16)&0xff;
-        buffer[index++] = (len>>8)&0xff;
-        buffer[index++] = (len>>0)&0xff;
+        putByte(index, (len>>24)&0xff);
+        putByte(index, (len>>16)&0xff);
+        putByte(index, (len>>8)&0xff);
+        putByte(index, (len>>0)&0xff);
 
         writeBytes((u8*)channel.c_str(), channel.size());
         writeBytes((u8*)msg.buf, msg.len);
-        finish();
+        putByte(index, sum);
+        return index;
+    }
+
+    u64 frameCobs(u64 index, const string& channel, const zcm_msg_t& msg)
+    {
+        // Each block is a code byte, one more than the number of nonzero
+        // bytes that follow it, and stands for those bytes and a zero
+        // (unless the block is full, code 0xff, or is the last one)
+        u64 codeIndex = index++;
+        u8 code = 1;
+        auto encode = [&](const u8 *data, size_t len) {
+            while (len > 0) {
+                size_t run = min(len, (size_t)(0xff - code));
+                auto *zero = (const u8*)memchr(data, 0, run);
+                size_t n = zero ? zero - data : run;
+                putBytes(index, data, n);
+                code += n;
+                data += n;
+                len -= n;
+                if (zero || code == 0xff) {
+                    queue[codeIndex % queue.size()] = code;
+                    codeIndex = index++;
+                    code = 1;
+                    if (zero) {
+                        data++;
+                        len--;
+                    }
+                }
+            }
+        };
+
+        u8 header[2] = { COBS_VERSION, (u8)channel.size() };
+        u32 crc = crc32c(0, header, sizeof(header));
+        crc = crc32c(crc, (const u8*)channel.c_str(), channel.size());
+        crc = crc32c(crc, (const u8*)msg.buf, msg.len);
+        u8 trailer[4] = { (u8)(crc>>24), (u8)(crc>>16), (u8)(crc>>8), (u8)crc };
+
+        encode(header, sizeof(header));
+        encode((const u8*)channel.c_str(), channel.size());
+        encode((const u8*)msg.buf, msg.len);
+        encode(trailer, sizeof(trailer));
+        queue[codeIndex % queue.size()] = code;
+        putByte(index, 0);
+        return index;
+    }
+
+    int sendmsg(zcm_msg_t msg)
+    {
+        string channel = msg.channel;
+        if (channel.size() > ZCM_CHANNEL_MAXLEN)
+            return ZCM_EINVALID;
+        if (msg.len > MTU)
+            return ZCM_EINVALID;
+
+        unique_lock<mutex> sendLk(sendMut);
+
+        // Reserve room for the frame at its largest
+        size_t maxSize;
+        if (framing == Framing::COBS)
+            maxSize = COBS_ENCODED_SIZE(COBS_OVERHEAD + channel.size() + msg.len);
+        else
+            maxSize = FRAME_OVERHEAD + 2*(channel.size() + msg.len);
+        u64 start;
+        {
+            unique_lock<mutex> lk(queueMut);
+            queueCond.wait(lk, [&]() {
+                return queue.size() - (queueHead - queueTail) >= maxSize;
+            });
+            start = queueHead;
+        }
+
+        u64 end = (framing == Framing::COBS) ? frameCobs(start, channel, msg)
+                                              : frameLegacy(start, channel, msg);
+
+        {
+            unique_lock<mutex> lk(queueMut);
+            bool wasEmpty = queueHead == queueTail;
+            queueHead = end;
+            messagesSent++;
+            queueBytesMax = max(queueBytesMax, (size_t)(queueHead - queueTail));
+            if (wasEmpty)
+                queueCond.notify_all();
+        }
 
         return ZCM_EOK;
     }
@@ -330,101 +865,254 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
     int recvmsg(zcm_msg_t *msg, int timeout)
     {
-        u8 buffer[1024];
-        size_t index = 0, size = 0;
-        u8 sum = 0;  // TODO introduce better checksum
-
-        auto refillBuffer = [&]() {
-            while (index == size) {
-                size = ser.read(buffer, sizeof(buffer));
-                index = 0;
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+        while (true) {
+            bool got = (framing == Framing::COBS) ? parseCobs(msg) : parseLegacy(msg);
+            if (got)
+                return ZCM_EOK;
+
+            // Everything buffered has been parsed, wait for more
+            int wait = -1;
+            if (timeout >= 0) {
+                auto left = chrono::duration_cast<chrono::milliseconds>(
+                    deadline - chrono::steady_clock::now()).count();
+                wait = left > 0 ? (int)left : 0;
             }
-        };
-        auto readByte = [&]() {
-            if (index == size)
-                refillBuffer();
-            return buffer[index++];
-        };
-        auto readU32 = [&]() {
-            u32 a = readByte();
-            u32 b = readByte();
-            u32 c = readByte();
-            u32 d = readByte();
-            return a<<24 | b<<16 | c<<8 | d<<0;
-        };
-        auto syncStream = [&]() {
-            while (1) {
-                u8 c = readByte();
-                if (c != ESCAPE_CHAR)
-                    continue;
-                // We got one escape char, see if it's
-                // followed by a zero
-                c = readByte();
-                if (c == 0)
-                    return;
+            int ready = ser.waitReadable(wait);
+            if (ready == 0) {
+                if (wait >= 0 && chrono::steady_clock::now() >= deadline)
+                    return ZCM_EAGAIN;
+                continue;
             }
-        };
-        auto readByteUnescape = [&]() {
-            u8 c = readByte();
-            if (c != ESCAPE_CHAR)
-                return c;
-            // Byte was escaped, strip off the escape char
-            return readByte();
-        };
-        auto readBytes = [&](u8 *buffer, size_t sz) {
-            for (size_t i = 0; i < sz; i++) {
-                u8 c = readByteUnescape();
-                sum += c;
-                buffer[i] = c;
+            int ret = ready > 0 ? ser.read(readBuf.data(), readBuf.size()) : -1;
+            if (ret <= 0) {
+                // Don't spin on a device that went away
+                if (wait == 0)
+                    return ZCM_EAGAIN;
+                int sleepMs = wait > 0 ? min(wait, READ_RETRY_MS) : READ_RETRY_MS;
+                this_thread::sleep_for(chrono::milliseconds(sleepMs));
+                continue;
             }
-        };
-        auto checkFinish = [&]() {
-            u8 expect = readByte();
-            return expect == sum;
-        };
-
-        syncStream();
-        u8 channelLen = readByte();
-        u32 dataLen = readU32();
-
-        // Validate the lengths received
-        if (channelLen > ZCM_CHANNEL_MAXLEN) {
-            ZCM_DEBUG("serial recvmsg: channel is too long: %d", channelLen);
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout);
+            readIndex = 0;
+            readSize = ret;
         }
-        if (dataLen > MTU) {
-            ZCM_DEBUG("serial recvmsg: data is too long: %d", dataLen);
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout);
+    }
+
+    // Unescape buffered bytes into 'dst' until it holds 'len' bytes. Runs
+    // without an escape char are copied at once. Returns true once it's full
+    bool readEscaped(u8 *dst, size_t len)
+    {
+        while (recvPos < len && readIndex < readSize) {
+            if (recvEscaped) {
+                // Byte was escaped, the escape char has been stripped off
+                dst[recvPos++] = readBuf[readIndex++];
+                recvEscaped = false;
+                continue;
+            }
+            size_t n = min(len - recvPos, readSize - readIndex);
+            auto *start = &readBuf[readIndex];
+            auto *esc = (u8*)memchr(start, ESCAPE_CHAR, n);
+            if (esc)
+                n = esc - start;
+            memcpy(dst + recvPos, start, n);
+            recvPos += n;
+            readIndex += n;
+            if (esc) {
+                readIndex++;
+                recvEscaped = true;
+            }
         }
+        return recvPos == len;
+    }
 
-        // Lengths are good! Recv the data
-        readBytes(recvChannelMem, (size_t)channelLen);
-        readBytes(recvDataMem,    (size_t)dataLen);
+    // Feed the buffered bytes to the legacy frame parser. Returns true once
+    // a message on an enabled channel is complete, with the bytes after it
+    // left buffered, and false once every buffered byte has been consumed
+    bool parseLegacy(zcm_msg_t *msg)
+    {
+        while (true) {
+            bool avail = readIndex < readSize;
+            switch (recvState) {
+                case RecvState::SYNC: {
+                    // Sync bytes are Escape and 1 zero
+                    if (!avail)
+                        return false;
+                    auto *esc = (u8*)memchr(&readBuf[readIndex], ESCAPE_CHAR, readSize - readIndex);
+                    if (!esc) {
+                        readIndex = readSize;
+                        return false;
+                    }
+                    readIndex = esc - readBuf.data() + 1;
+                    recvState = RecvState::SYNC_ZERO;
+                    break;
+                }
+                case RecvState::SYNC_ZERO:
+                    if (!avail)
+                        return false;
+                    recvState = readBuf[readIndex++] == 0 ? RecvState::CHANNEL_LEN
+                                                          : RecvState::SYNC;
+                    break;
+
+                case RecvState::CHANNEL_LEN:
+                    if (!avail)
+                        return false;
+                    recvChannelLen = readBuf[readIndex++];
+                    recvDataLen = 0;
+                    recvPos = 0;
+                    recvState = RecvState::DATA_LEN;
+                    break;
+
+                case RecvState::DATA_LEN:
+                    if (!avail)
+                        return false;
+                    recvDataLen = recvDataLen << 8 | readBuf[readIndex++];
+                    if (++recvPos < 4)
+                        break;
+
+                    // Validate the lengths received
+                    recvState = RecvState::SYNC;
+                    if (recvChannelLen > ZCM_CHANNEL_MAXLEN) {
+                        ZCM_DEBUG("serial recvmsg: channel is too long: %d", recvChannelLen);
+                        framesInvalid++;
+                        break;
+                    }
+                    if (recvDataLen > MTU) {
+                        ZCM_DEBUG("serial recvmsg: data is too long: %d", recvDataLen);
+                        framesInvalid++;
+                        break;
+                    }
+                    if (recvData.size() < recvDataLen)
+                        recvData.resize(recvDataLen);
+                    recvPos = 0;
+                    recvEscaped = false;
+                    recvState = RecvState::CHANNEL;
+                    break;
+
+                case RecvState::CHANNEL:
+                    if (!readEscaped(recvChannelMem, recvChannelLen))
+                        return false;
+                    recvChannelMem[recvChannelLen] = '\0';
+                    recvPos = 0;
+                    recvState = RecvState::DATA;
+                    break;
+
+                case RecvState::DATA:
+                    if (!readEscaped(recvData.data(), recvDataLen))
+                        return false;
+                    recvState = RecvState::CHECKSUM;
+                    break;
+
+                case RecvState::CHECKSUM: {
+                    if (!avail)
+                        return false;
+                    u8 expect = readBuf[readIndex++];
+                    recvState = RecvState::SYNC;
+
+                    u8 sum = 0;  // TODO introduce better checksum
+                    for (size_t i = 0; i < recvChannelLen; i++)
+                        sum += recvChannelMem[i];
+                    for (size_t i = 0; i < recvDataLen; i++)
+                        sum += recvData[i];
+                    if (sum != expect) {
+                        ZCM_DEBUG("serial recvmsg: checksum failed!");
+                        framesInvalid++;
+                        break;
+                    }
+                    messagesReceived++;
+
+                    // Has this channel been enabled?
+                    if (!isChannelEnabled((char*)recvChannelMem))
+                        break;
+
+                    msg->channel = (char*)recvChannelMem;
+                    msg->len = recvDataLen;
+                    msg->buf = (char*)recvData.data();
+                    return true;
+                }
+            }
+        }
+    }
 
-        // Set the null-terminator
-        recvChannelMem[channelLen] = '\0';
+    // Same as parseLegacy(), for cobs frames
+    bool parseCobs(zcm_msg_t *msg)
+    {
+        while (readIndex < readSize) {
+            // Gather everything up to the next delimiter
+            u8 *start = &readBuf[readIndex];
+            size_t avail = readSize - readIndex;
+            auto *delim = (u8*)memchr(start, 0, avail);
+            size_t n = delim ? delim - start : avail;
+            if (cobsFrameLen + n > COBS_MAX_FRAME_SIZE) {
+                cobsFrameOverflow = true;
+            } else if (!cobsFrameOverflow) {
+                if (cobsFrame.size() < cobsFrameLen + n)
+                    cobsFrame.resize(max(cobsFrameLen + n, min(2 * cobsFrame.size(),
+                                                                (size_t)COBS_MAX_FRAME_SIZE)));
+                memcpy(&cobsFrame[cobsFrameLen], start, n);
+                cobsFrameLen += n;
+            }
+            readIndex += delim ? n + 1 : n;
+            if (!delim)
+                break;
+
+            size_t len = cobsFrameLen;
+            bool overflow = cobsFrameOverflow;
+            cobsFrameLen = 0;
+            cobsFrameOverflow = false;
+            // Nothing between two delimiters isn't an error: a sender may
+            // send a delimiter first to end whatever the line noise started
+            if (len == 0 && !overflow)
+                continue;
+            if (overflow) {
+                ZCM_DEBUG("serial recvmsg: frame is too long");
+                framesInvalid++;
+                continue;
+            }
+            if (!parseCobsFrame(len, msg)) {
+                framesInvalid++;
+                continue;
+            }
+            messagesReceived++;
 
-        // Check the checksum
-        if (!checkFinish()) {
-            ZCM_DEBUG("serial recvmsg: checksum failed!");
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout);
+            // Has this channel been enabled?
+            if (isChannelEnabled(msg->channel))
+                return true;
         }
+        return false;
+    }
 
-        // Has this channel been enabled?
-        if (!isChannelEnabled((char*)recvChannelMem)) {
-            // retry the recvmsg via tail-recursion
-            return recvmsg(msg, timeout);
+    // Decode and check the cobs frame of 'len' bytes in 'cobsFrame'. The
+    // message points into it
+    bool parseCobsFrame(size_t len, zcm_msg_t *msg)
+    {
+        u8 *f = cobsFrame.data();
+        ssize_t flen = cobsDecode(f, len);
+        if (flen < COBS_OVERHEAD) {
+            ZCM_DEBUG("serial recvmsg: bad cobs frame");
+            return false;
+        }
+        if (f[0] != COBS_VERSION) {
+            ZCM_DEBUG("serial recvmsg: unsupported frame version: %d", f[0]);
+            return false;
+        }
+        size_t channelLen = f[1];
+        if (channelLen > ZCM_CHANNEL_MAXLEN || COBS_OVERHEAD + channelLen > (size_t)flen) {
+            ZCM_DEBUG("serial recvmsg: bad channel length: %zu", channelLen);
+            return false;
+        }
+        const u8 *t = f + flen - 4;
+        u32 expect = (u32)t[0]<<24 | t[1]<<16 | t[2]<<8 | t[3];
+        if (crc32c(0, f, flen - 4) != expect) {
+            ZCM_DEBUG("serial recvmsg: crc failed!");
+            return false;
         }
 
-        // Good! Return it
+        memcpy(recvChannelMem, f + 2, channelLen);
+        recvChannelMem[channelLen] = '\0';
         msg->channel = (char*)recvChannelMem;
-        msg->len = dataLen;
-        msg->buf = (char*)recvDataMem;
-
-        return ZCM_EOK;
+        msg->len = flen - COBS_OVERHEAD - channelLen;
+        msg->buf = (char*)(f + 2 + channelLen);
+        return true;
     }
 
     /********************** STATICS **********************/
@@ -453,6 +1141,21 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     static const TransportRegister reg;
 };
 
+int zcm_trans_serial_stats(zcm_trans_t *zt, zcm_serial_stats_t *stats)
+{
+    if (!zt || zt->vtbl != &ZCM_TRANS_CLASSNAME::methods)
+        return ZCM_EINVALID;
+    ZCM_TRANS_CLASSNAME::cast(zt)->getStats(stats);
+    return ZCM_EOK;
+}
+
+int zcm_trans_serial_flush(zcm_trans_t *zt)
+{
+    if (!zt || zt->vtbl != &ZCM_TRANS_CLASSNAME::methods)
+        return ZCM_EINVALID;
+    return ZCM_TRANS_CLASSNAME::cast(zt)->flush();
+}
+
 zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_getMtu,
     &ZCM_TRANS_CLASSNAME::_sendmsg,
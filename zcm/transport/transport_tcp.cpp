@@ -0,0 +1,723 @@
+#include "zcm/transport.h"
+#include "zcm/transport_registrar.h"
+#include "zcm/transport_register.hpp"
+#include "zcm/util/debug.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <cassert>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// A stream transport for reliable links between hosts. Messages are framed
+// on a single TCP connection as:
+//
+//   magic (4 bytes) | channel length (1 byte) | data length (4 bytes) | channel | data
+//
+// with the integers in network byte order. In client mode (the default) the
+// transport connects to <host>:<port>, and reconnects whenever the connection
+// drops. In server mode it listens on <ip>:<port>: every client receives the
+// server's messages, and the server receives the messages of every client.
+//
+// All the socket I/O happens on one thread. sendmsg() only queues a message,
+// so that everything queued while the previous write was in progress goes out
+// with the next writev(), and reads fill a large buffer to parse many frames
+// per read(). Every connection has a bounded send queue: a slow client loses
+// messages instead of holding up the others.
+
+// Define this the class name you want
+#define ZCM_TRANS_CLASSNAME TransportTcp
+#define MTU (1<<28)
+#define MAGIC 0x5a434d54                  // "ZCMT"
+#define HEADER_SIZE 9
+#define READ_BUF_SIZE (1<<20)
+#define DEFAULT_QUEUE_SIZE (16<<20)
+#define MAX_IOVS 64                       // frames written per writev()
+#define RECONNECT_MS 500
+
+using u8  = uint8_t;
+using u16 = uint16_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
+using Clock = std::chrono::steady_clock;
+
+static void putU32(u8 *p, u32 v)
+{
+    p[0] = (v>>24)&0xff;
+    p[1] = (v>>16)&0xff;
+    p[2] = (v>>8)&0xff;
+    p[3] = (v>>0)&0xff;
+}
+
+static u32 getU32(const u8 *p)
+{
+    return (u32)p[0]<<24 | (u32)p[1]<<16 | (u32)p[2]<<8 | (u32)p[3]<<0;
+}
+
+static bool setNonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Small messages must not wait for the acks of earlier ones
+static void setNoDelay(int fd)
+{
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+        ZCM_DEBUG("tcp: failed to set TCP_NODELAY: %s", strerror(errno));
+}
+
+using Frame = vector<char>;
+
+struct Message
+{
+    string channel;
+    vector<char> data;
+};
+
+struct Connection
+{
+    int fd = -1;
+    bool connecting = false;   // a nonblocking connect() is in progress
+    bool hungUp = false;       // the peer closed while reads were paused
+    string peer;
+
+    // Frames waiting to be written, and how much of the first one already
+    // was. A frame is shared by every connection it was queued on. Protected
+    // by the transport's 'mut'
+    deque<shared_ptr<const Frame>> sendq;
+    size_t sendqBytes = 0;
+    size_t sentBytes = 0;
+    u64 dropped = 0;
+
+    // Received bytes that don't make up a whole frame yet. Only used by the
+    // I/O thread
+    vector<char> rbuf;
+    size_t rlen = 0;
+
+    Connection() : rbuf(READ_BUF_SIZE) {}
+    ~Connection() { closeFd(); }
+
+    void closeFd()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        connecting = false;
+        hungUp = false;
+        rlen = 0;
+    }
+};
+
+struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+{
+    bool server = false;
+    string host, port;
+    size_t queueSize = DEFAULT_QUEUE_SIZE;
+
+    int listenfd = -1;
+    int wakefds[2] = {-1, -1};
+    std::thread ioThread;
+    std::atomic<bool> running {false};
+    Clock::time_point nextConnect;
+
+    // Protects everything below
+    mutex mut;
+    condition_variable recvCond;
+
+    // A client has a single connection, which outlives reconnects. Connections
+    // are only added and removed by the I/O thread
+    vector<unique_ptr<Connection>> conns;
+
+    // Received messages, bounded by 'queueSize'. Once full, the I/O thread
+    // stops reading and TCP flow control holds the senders back
+    deque<unique_ptr<Message>> recvq;
+    size_t recvqBytes = 0;
+    unique_ptr<Message> current;   // returned by the last recvmsg()
+
+    unordered_map<string, bool> recvChannels;
+    bool recvAllChannels = false;
+
+    ZCM_TRANS_CLASSNAME(zcm_url_t *url)
+    {
+        trans_type = ZCM_BLOCKING;
+        vtbl = &methods;
+
+        string address = zcm_url_address(url);
+        size_t sep = address.rfind(':');
+        if (sep == string::npos || sep == 0 || sep + 1 == address.size()) {
+            ZCM_DEBUG("tcp: url format is <host>:<port>");
+            return;
+        }
+        host = address.substr(0, sep);
+        port = address.substr(sep + 1);
+
+        auto *opts = zcm_url_opts(url);
+        for (size_t i = 0; i < opts->numopts; i++) {
+            string name = opts->name[i], value = opts->value[i];
+            if (name == "mode" && (value == "server" || value == "client")) {
+                server = (value == "server");
+            } else if (name == "queue" && strtoull(value.c_str(), NULL, 10) > 0) {
+                queueSize = strtoull(value.c_str(), NULL, 10);
+            } else {
+                ZCM_DEBUG("tcp: invalid url option %s=%s", name.c_str(), value.c_str());
+                return;
+            }
+        }
+
+        if (pipe(wakefds) < 0 || !setNonblock(wakefds[0]) || !setNonblock(wakefds[1])) {
+            ZCM_DEBUG("tcp: failed to create the wakeup pipe: %s", strerror(errno));
+            return;
+        }
+
+        if (server) {
+            if (!listen())
+                return;
+        } else {
+            conns.emplace_back(new Connection());
+        }
+
+        running = true;
+        ioThread = std::thread(&ZCM_TRANS_CLASSNAME::runIO, this);
+    }
+
+    ~ZCM_TRANS_CLASSNAME()
+    {
+        if (ioThread.joinable()) {
+            running = false;
+            wakeIO();
+            ioThread.join();
+        }
+        if (listenfd >= 0)
+            ::close(listenfd);
+        for (int fd : wakefds)
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    bool good()
+    {
+        return running;
+    }
+
+    bool listen()
+    {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (err != 0) {
+            ZCM_DEBUG("tcp: failed to resolve %s: %s", host.c_str(), gai_strerror(err));
+            return false;
+        }
+
+        listenfd = socket(res->ai_family, SOCK_STREAM, 0);
+        int one = 1;
+        if (listenfd < 0 ||
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(listenfd, res->ai_addr, res->ai_addrlen) < 0 ||
+            ::listen(listenfd, SOMAXCONN) < 0 || !setNonblock(listenfd)) {
+            ZCM_DEBUG("tcp: failed to listen on %s:%s: %s",
+                      host.c_str(), port.c_str(), strerror(errno));
+            freeaddrinfo(res);
+            return false;
+        }
+        freeaddrinfo(res);
+        ZCM_DEBUG("tcp: listening on %s:%s", host.c_str(), port.c_str());
+        return true;
+    }
+
+    /********************** I/O THREAD **********************/
+    void wakeIO()
+    {
+        char c = 0;
+        if (::write(wakefds[1], &c, 1) < 0 && errno != EAGAIN)
+            ZCM_DEBUG("tcp: failed to wake the I/O thread: %s", strerror(errno));
+    }
+
+    void runIO()
+    {
+        vector<struct pollfd> fds;
+        vector<Connection*> polled;
+        char drain[64];
+
+        while (running) {
+            if (!server && conns[0]->fd < 0 && Clock::now() >= nextConnect)
+                startConnect(*conns[0]);
+
+            fds.clear();
+            polled.clear();
+            fds.push_back({wakefds[0], POLLIN, 0});
+            if (listenfd >= 0)
+                fds.push_back({listenfd, POLLIN, 0});
+
+            int timeout = -1;
+            {
+                unique_lock<mutex> lk(mut);
+                bool canRead = recvqBytes < queueSize;
+                for (auto& c : conns) {
+                    if (c->fd < 0 || (c->hungUp && !canRead))
+                        continue;
+                    short events = 0;
+                    if (c->connecting)
+                        events = POLLOUT;
+                    else {
+                        if (canRead)
+                            events |= POLLIN;
+                        if (!c->sendq.empty())
+                            events |= POLLOUT;
+                    }
+                    fds.push_back({c->fd, events, 0});
+                    polled.push_back(c.get());
+                }
+                if (!server && conns[0]->fd < 0)
+                    timeout = RECONNECT_MS;
+            }
+
+            if (poll(fds.data(), fds.size(), timeout) < 0) {
+                if (errno == EINTR)
+                    continue;
+                ZCM_DEBUG("tcp: poll failed: %s", strerror(errno));
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+
+            if (fds[0].revents)
+                while (::read(wakefds[0], drain, sizeof(drain)) > 0) {}
+            size_t first = 1;
+            if (listenfd >= 0) {
+                if (fds[1].revents & POLLIN)
+                    acceptClients();
+                first = 2;
+            }
+
+            for (size_t i = 0; i < polled.size(); i++) {
+                Connection& c = *polled[i];
+                short revents = fds[first + i].revents;
+                if (!revents)
+                    continue;
+
+                bool ok = true;
+                if (c.connecting) {
+                    ok = finishConnect(c);
+                } else {
+                    if (revents & POLLIN)
+                        ok = readFrames(c);
+                    if (ok && (revents & POLLOUT))
+                        ok = writeFrames(c);
+                    if (ok && (revents & (POLLERR | POLLNVAL)))
+                        ok = false;
+                    // without POLLIN, wait for recvmsg() to make room before
+                    // reading what the peer sent last
+                    if (ok && (revents & POLLHUP) && !(fds[first + i].events & POLLIN))
+                        c.hungUp = true;
+                }
+                if (!ok)
+                    dropConnection(c);
+            }
+        }
+    }
+
+    void startConnect(Connection& c)
+    {
+        nextConnect = Clock::now() + std::chrono::milliseconds(RECONNECT_MS);
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (err != 0) {
+            ZCM_DEBUG("tcp: failed to resolve %s: %s", host.c_str(), gai_strerror(err));
+            return;
+        }
+
+        c.fd = socket(res->ai_family, SOCK_STREAM, 0);
+        if (c.fd < 0 || !setNonblock(c.fd)) {
+            ZCM_DEBUG("tcp: failed to create a socket: %s", strerror(errno));
+            c.closeFd();
+            freeaddrinfo(res);
+            return;
+        }
+        setNoDelay(c.fd);
+        c.peer = host + ":" + port;
+
+        int ret = connect(c.fd, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        if (ret == 0) {
+            ZCM_DEBUG("tcp: connected to %s", c.peer.c_str());
+        } else if (errno == EINPROGRESS) {
+            c.connecting = true;
+        } else {
+            ZCM_DEBUG("tcp: failed to connect to %s: %s", c.peer.c_str(), strerror(errno));
+            c.closeFd();
+        }
+    }
+
+    bool finishConnect(Connection& c)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            ZCM_DEBUG("tcp: failed to connect to %s: %s", c.peer.c_str(), strerror(err));
+            return false;
+        }
+        ZCM_DEBUG("tcp: connected to %s", c.peer.c_str());
+        c.connecting = false;
+        return true;
+    }
+
+    void acceptClients()
+    {
+        while (true) {
+            struct sockaddr_storage addr;
+            socklen_t addrlen = sizeof(addr);
+            int fd = accept(listenfd, (struct sockaddr*)&addr, &addrlen);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    ZCM_DEBUG("tcp: accept failed: %s", strerror(errno));
+                return;
+            }
+            if (!setNonblock(fd)) {
+                ::close(fd);
+                continue;
+            }
+            setNoDelay(fd);
+
+            unique_ptr<Connection> c(new Connection());
+            c->fd = fd;
+            char name[NI_MAXHOST], serv[NI_MAXSERV];
+            if (getnameinfo((struct sockaddr*)&addr, addrlen, name, NI_MAXHOST, serv,
+                            sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+                c->peer = string(name) + ":" + serv;
+            }
+            ZCM_DEBUG("tcp: accepted a client from %s", c->peer.c_str());
+
+            unique_lock<mutex> lk(mut);
+            conns.push_back(std::move(c));
+        }
+    }
+
+    // A server forgets the client. A client reconnects, and resends what is
+    // left of its queue, except for a frame the peer only got part of
+    void dropConnection(Connection& c)
+    {
+        ZCM_DEBUG("tcp: connection to %s closed", c.peer.c_str());
+        unique_lock<mutex> lk(mut);
+        if (server) {
+            for (size_t i = 0; i < conns.size(); i++) {
+                if (conns[i].get() == &c) {
+                    conns.erase(conns.begin() + i);
+                    break;
+                }
+            }
+            return;
+        }
+
+        c.closeFd();
+        if (c.sentBytes > 0) {
+            c.sendqBytes -= c.sendq.front()->size();
+            c.sendq.pop_front();
+            c.sentBytes = 0;
+            c.dropped++;
+        }
+    }
+
+    // Returns false once the connection is closed or broken
+    bool writeFrames(Connection& c)
+    {
+        struct iovec iov[MAX_IOVS];
+        while (true) {
+            size_t n = 0;
+            {
+                unique_lock<mutex> lk(mut);
+                for (auto& frame : c.sendq) {
+                    if (n == MAX_IOVS)
+                        break;
+                    size_t skip = (n == 0) ? c.sentBytes : 0;
+                    iov[n].iov_base = (char*)frame->data() + skip;
+                    iov[n].iov_len = frame->size() - skip;
+                    n++;
+                }
+            }
+            if (n == 0)
+                return true;
+
+            // Frames are only removed from the queue by this thread, so the
+            // iovecs stay valid without the lock. This is writev(), except
+            // that a closed peer doesn't raise SIGPIPE
+            struct msghdr mhdr;
+            memset(&mhdr, 0, sizeof(mhdr));
+            mhdr.msg_iov = iov;
+            mhdr.msg_iovlen = n;
+            ssize_t ret = ::sendmsg(c.fd, &mhdr, MSG_NOSIGNAL);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return true;
+                ZCM_DEBUG("tcp: write to %s failed: %s", c.peer.c_str(), strerror(errno));
+                return false;
+            }
+
+            unique_lock<mutex> lk(mut);
+            size_t left = ret;
+            while (left > 0) {
+                size_t remaining = c.sendq.front()->size() - c.sentBytes;
+                if (left < remaining) {
+                    c.sentBytes += left;
+                    return true;   // the socket buffer is full
+                }
+                left -= remaining;
+                c.sendqBytes -= c.sendq.front()->size();
+                c.sendq.pop_front();
+                c.sentBytes = 0;
+            }
+        }
+    }
+
+    // Returns false once the connection is closed or broken
+    bool readFrames(Connection& c)
+    {
+        ssize_t ret = ::read(c.fd, c.rbuf.data() + c.rlen, c.rbuf.size() - c.rlen);
+        if (ret == 0)
+            return false;
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return true;
+            ZCM_DEBUG("tcp: read from %s failed: %s", c.peer.c_str(), strerror(errno));
+            return false;
+        }
+        c.rlen += ret;
+
+        size_t off = 0;
+        size_t nqueued = 0;
+        while (c.rlen - off >= HEADER_SIZE) {
+            const u8 *hdr = (const u8*)c.rbuf.data() + off;
+            u32 magic = getU32(hdr);
+            size_t channelLen = hdr[4];
+            size_t dataLen = getU32(hdr + 5);
+            if (magic != MAGIC || channelLen > ZCM_CHANNEL_MAXLEN || dataLen > MTU) {
+                ZCM_DEBUG("tcp: bad frame from %s", c.peer.c_str());
+                return false;
+            }
+
+            size_t frameLen = HEADER_SIZE + channelLen + dataLen;
+            if (c.rlen - off < frameLen) {
+                // make room for a frame larger than the buffer
+                if (frameLen > c.rbuf.size()) {
+                    memmove(c.rbuf.data(), c.rbuf.data() + off, c.rlen - off);
+                    c.rlen -= off;
+                    off = 0;
+                    c.rbuf.resize(frameLen);
+                }
+                break;
+            }
+
+            const char *channel = (const char*)hdr + HEADER_SIZE;
+            const char *data = channel + channelLen;
+            unique_ptr<Message> msg(new Message());
+            msg->channel.assign(channel, channelLen);
+            off += frameLen;
+
+            unique_lock<mutex> lk(mut);
+            if (!isChannelEnabled(msg->channel))
+                continue;
+            msg->data.assign(data, data + dataLen);
+            recvqBytes += dataLen;
+            recvq.push_back(std::move(msg));
+            nqueued++;
+        }
+
+        if (off > 0) {
+            memmove(c.rbuf.data(), c.rbuf.data() + off, c.rlen - off);
+            c.rlen -= off;
+        }
+        // Go back to the default size once no large frame is pending. A
+        // partial frame that fits is regrown above if it has to be
+        if (c.rbuf.size() > READ_BUF_SIZE && pendingFrameLen(c) <= READ_BUF_SIZE)
+            c.rbuf.resize(READ_BUF_SIZE);
+
+        if (nqueued > 0)
+            recvCond.notify_one();
+        return true;
+    }
+
+    // The length of the partial frame at the start of 'c.rbuf', or 0 if its
+    // header hasn't arrived yet
+    static size_t pendingFrameLen(const Connection& c)
+    {
+        if (c.rlen < HEADER_SIZE)
+            return 0;
+        const u8 *hdr = (const u8*)c.rbuf.data();
+        return HEADER_SIZE + hdr[4] + getU32(hdr + 5);
+    }
+
+    // Must be called with 'mut' held
+    bool isChannelEnabled(const string& channel)
+    {
+        if (recvAllChannels)
+            return true;
+        auto it = recvChannels.find(channel);
+        return it != recvChannels.end() && it->second;
+    }
+
+    /********************** METHODS **********************/
+    size_t getMtu()
+    {
+        return MTU;
+    }
+
+    int sendmsg(zcm_msg_t msg)
+    {
+        size_t channelLen = strlen(msg.channel);
+        if (channelLen > ZCM_CHANNEL_MAXLEN)
+            return ZCM_EINVALID;
+        if (msg.len > MTU)
+            return ZCM_EINVALID;
+
+        auto frame = std::make_shared<Frame>(HEADER_SIZE + channelLen + msg.len);
+        u8 *hdr = (u8*)frame->data();
+        putU32(hdr, MAGIC);
+        hdr[4] = (u8)channelLen;
+        putU32(hdr + 5, (u32)msg.len);
+        memcpy(frame->data() + HEADER_SIZE, msg.channel, channelLen);
+        memcpy(frame->data() + HEADER_SIZE + channelLen, msg.buf, msg.len);
+
+        // the I/O thread only needs waking when a queue was empty, otherwise
+        // it is already waiting to write
+        bool wake = false;
+        size_t queued = 0;
+        {
+            unique_lock<mutex> lk(mut);
+            for (auto& c : conns) {
+                if (!c->sendq.empty() && c->sendqBytes + frame->size() > queueSize) {
+                    if (c->dropped++ == 0)
+                        ZCM_DEBUG("tcp: the queue of %s is full, dropping messages",
+                                  c->peer.c_str());
+                    continue;
+                }
+                wake |= c->sendq.empty();
+                c->sendq.push_back(frame);
+                c->sendqBytes += frame->size();
+                queued++;
+            }
+        }
+        if (wake)
+            wakeIO();
+
+        // a server without clients has nobody to send to, which is fine
+        if (!server && queued == 0)
+            return ZCM_EAGAIN;
+        return ZCM_EOK;
+    }
+
+    int recvmsgEnable(const char *channel, bool enable)
+    {
+        unique_lock<mutex> lk(mut);
+        if (channel == NULL)
+            recvAllChannels = enable;
+        else
+            recvChannels[channel] = enable;
+        return ZCM_EOK;
+    }
+
+    int recvmsg(zcm_msg_t *msg, int timeout)
+    {
+        unique_lock<mutex> lk(mut);
+        current.reset();
+
+        auto ready = [&]() { return !recvq.empty(); };
+        if (timeout < 0)
+            recvCond.wait(lk, ready);
+        else if (!recvCond.wait_for(lk, std::chrono::milliseconds(timeout), ready))
+            return ZCM_EAGAIN;
+
+        bool wasFull = recvqBytes >= queueSize;
+        current = std::move(recvq.front());
+        recvq.pop_front();
+        recvqBytes -= current->data.size();
+        bool resume = wasFull && recvqBytes < queueSize;
+        lk.unlock();
+
+        if (resume)
+            wakeIO();
+
+        msg->channel = current->channel.c_str();
+        msg->len = current->data.size();
+        msg->buf = current->data.data();
+        return ZCM_EOK;
+    }
+
+    /********************** STATICS **********************/
+    static zcm_trans_methods_t methods;
+    static ZCM_TRANS_CLASSNAME *cast(zcm_trans_t *zt)
+    {
+        assert(zt->vtbl == &methods);
+        return (ZCM_TRANS_CLASSNAME*)zt;
+    }
+
+    static size_t _getMtu(zcm_trans_t *zt)
+    { return cast(zt)->getMtu(); }
+
+    static int _sendmsg(zcm_trans_t *zt, zcm_msg_t msg)
+    { return cast(zt)->sendmsg(msg); }
+
+    static int _recvmsgEnable(zcm_trans_t *zt, const char *channel, bool enable)
+    { return cast(zt)->recvmsgEnable(channel, enable); }
+
+    static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, int timeout)
+    { return cast(zt)->recvmsg(msg, timeout); }
+
+    static void _destroy(zcm_trans_t *zt)
+    { delete cast(zt); }
+
+    static const TransportRegister reg;
+};
+
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
+    &ZCM_TRANS_CLASSNAME::_getMtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsgEnable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_destroy,
+};
+
+static zcm_trans_t *create(zcm_url_t *url)
+{
+    auto *trans = new ZCM_TRANS_CLASSNAME(url);
+    if (trans->good())
+        return trans;
+
+    delete trans;
+    return nullptr;
+}
+
+#ifdef USING_TRANS_TCP
+// Register this transport with ZCM
+const TransportRegister ZCM_TRANS_CLASSNAME::reg(
+    "tcp", "Transfer data over a TCP connection "
+    "(e.g. 'tcp://10.0.0.2:7700' or 'tcp://0.0.0.0:7700?mode=server')", create);
+#endif
@@ -8,59 +8,323 @@
 #include <zmq.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <climits>
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 using namespace std;
 
 // Define this the class name you want
 #define ZCM_TRANS_CLASSNAME TransportZmqLocal
 #define MTU (1<<28)
-#define START_BUF_SIZE (1 << 20)
 #define ZMQ_IO_THREADS 1
 #define IPC_NAME_PREFIX "zcm-channel-zmq-ipc-"
 #define IPC_ADDR_PREFIX "ipc:///tmp/" IPC_NAME_PREFIX
 #define INPROC_ADDR_PREFIX "inproc://"
+#define MUX_NAME_PREFIX "zcm-mux-zmq-ipc-"
+#define MUX_INPROC_NAME_PREFIX "zcm-mux-"
+#define IPC_SCAN_PERIOD_MS 1000   // without inotify
+#define RECV_BATCH_PER_SOCKET 16  // messages taken from a ready socket per poll
 
 enum Type { IPC, INPROC, };
 
+// Process wide registry of inproc endpoints, shared by all the inproc
+// transports of the process. Entries are only ever added, so a reader
+// remembers how many it has seen and only takes the lock when 'count' says
+// there are more. Readers that want to hear about new entries right away
+// register the write end of a pipe, which gets a byte per new entry
+class InprocRegistry
+{
+  public:
+    void add(const string& name)
+    {
+        unique_lock<mutex> lk(mut);
+        if (!known.insert(name).second)
+            return;
+        names.push_back(name);
+        count.store(names.size(), memory_order_release);
+        for (int fd : watchers) {
+            char c = 0;
+            // a full pipe already has a wakeup pending
+            if (write(fd, &c, 1) < 0 && errno != EAGAIN)
+                ZCM_DEBUG("failed to wake an inproc watcher: %s", strerror(errno));
+        }
+    }
+
+    // Append the entries after the first 'seen' to 'out'
+    void read(size_t& seen, vector<string>& out)
+    {
+        if (count.load(memory_order_acquire) <= seen)
+            return;
+        unique_lock<mutex> lk(mut);
+        for (; seen < names.size(); seen++)
+            out.push_back(names[seen]);
+    }
+
+    void watch(int fd)
+    {
+        unique_lock<mutex> lk(mut);
+        watchers.push_back(fd);
+    }
+
+    void unwatch(int fd)
+    {
+        unique_lock<mutex> lk(mut);
+        watchers.erase(std::remove(watchers.begin(), watchers.end(), fd), watchers.end());
+    }
+
+    // Append the entries that start with 'prefix' to 'out'
+    void find(const string& prefix, vector<string>& out)
+    {
+        unique_lock<mutex> lk(mut);
+        for (auto& name : names)
+            if (name.compare(0, prefix.size(), prefix) == 0)
+                out.push_back(name);
+    }
+
+  private:
+    mutex mut;
+    vector<string> names;
+    unordered_set<string> known;
+    atomic<size_t> count {0};
+    vector<int> watchers;
+};
+
+// Each inproc transport binds its own endpoint for a channel,
+// '<channel>/<instance>', so that several of them can publish on it.
+// Subscribers connect to the endpoints of all of them
+static InprocRegistry inprocChannels;     // the endpoints of the per channel pubsocks
+static InprocRegistry inprocMuxEndpoints; // the mux pubsocks
+
+// inproc only connects the sockets of one context, so the inproc transports
+// share theirs
+static mutex inprocCtxMut;
+static void *inprocCtx = nullptr;
+static size_t inprocCtxUsers = 0;
+
+static void *inprocCtxAcquire()
+{
+    unique_lock<mutex> lk(inprocCtxMut);
+    if (inprocCtxUsers++ == 0)
+        inprocCtx = zmq_init(ZMQ_IO_THREADS);
+    return inprocCtx;
+}
+
+static void inprocCtxRelease()
+{
+    unique_lock<mutex> lk(inprocCtxMut);
+    if (--inprocCtxUsers > 0)
+        return;
+    int rc = zmq_ctx_term(inprocCtx);
+    if (rc == -1) {
+        ZCM_DEBUG("failed to terminate context: %s", zmq_strerror(errno));
+    }
+    inprocCtx = nullptr;
+}
+
 struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 {
     void *ctx;
     Type type;
+    bool valid = true;
+
+    // Socket options from the url, applied by newSocket(). Negative hwms and
+    // buffer sizes keep zmq's defaults
+    int sndhwm = -1;
+    int rcvhwm = -1;
+    int sndbuf = -1;
+    int rcvbuf = -1;
+    bool hasLinger = false;
+    int linger = 0;
+    uint64_t affinity = 0;
 
     unordered_map<string, void*> pubsocks;
-    // socket pair contains the socket + whether it was subscribed to explicitly or not
-    unordered_map<string, pair<void*, bool>> subsocks;
+    struct Subsock
+    {
+        void *sock;
+        bool subExplicit;          // subscribed to explicitly, not just by recvAllChannels
+        vector<string> addresses;  // the pubsocks it's connected to
+    };
+    unordered_map<string, Subsock> subsocks;
     bool recvAllChannels = false;
 
+    // Names the inproc endpoints of this transport's pubsocks
+    unsigned inprocInstance = 0;
+
+    // The poll set of recvmsg(), rebuilt only when 'subsocks' changes. The
+    // vectors are only touched by the recv thread, 'pollDirty' is protected
+    // by 'mut'
+    vector<zmq_pollitem_t> pitems;
+    vector<string> pchannels;
+    bool pollDirty = true;
+
+    // While receiving all channels, new ipc channels are found by watching
+    // /tmp with inotify, whose fd is part of the poll set. Owned by the recv
+    // thread
+    int ipcWatchFd = -1;
+    chrono::steady_clock::time_point ipcLastScan;
+
+    // While receiving anything, inproc endpoints are read from a registry,
+    // which wakes up the poll through a pipe. Owned by the recv thread
+    int inprocWakeFds[2] = {-1, -1};
+    size_t inprocSeen = 0;     // registry entries read so far
+
+    // Mux mode ('mux' url option): one pubsock per transport, bound to
+    // 'muxAddress', and one subsock that connects to all of them (to the
+    // endpoints found in /tmp/ for ipc). Messages are a topic frame with the
+    // channel and its terminator, then the data, so that the subscriptions
+    // (prefixes) match whole channel names. The subsock and its peers are
+    // only touched by the recv thread: recvmsgEnable() queues the changes to
+    // 'muxTopics' in 'muxTopicChanges' (both protected by 'mut')
+    bool mux = false;
+    string muxAddress;
+    void *muxPub = nullptr;
+    void *muxSub = nullptr;
+    unordered_set<string> muxPeers;
+    unordered_set<string> muxTopics;
+    vector<pair<string, bool>> muxTopicChanges;
+
     string recvmsgChannel;
-    size_t recvmsgBufferSize = START_BUF_SIZE; // Start at 1MB but allow it to grow to MTU
-    char* recvmsgBuffer;
+    // The message last returned by recvmsg(). Its buffer is handed out
+    // directly and stays valid until the next zmq_msg_recv() replaces it
+    zmq_msg_t recvmsgMsg;
+
+    // Messages received by the last poll that recvmsg() hasn't returned yet.
+    // A deque, so that the zmq messages don't move while they're queued
+    struct Pending
+    {
+        string channel;
+        zmq_msg_t msg;
+    };
+    deque<Pending> batch;
+    size_t pollStart = 0;   // the poll set index that is drained first
 
     // Mutex used to protect 'subsocks' while allowing
     // recvmsgEnable() and recvmsg() to be called
     // concurrently
     mutex mut;
 
-    ZCM_TRANS_CLASSNAME(Type type_)
+    ZCM_TRANS_CLASSNAME(Type type_, zcm_url_t *url)
     {
         trans_type = ZCM_BLOCKING;
         vtbl = &methods;
 
-        recvmsgBuffer = new char[recvmsgBufferSize];
+        zmq_msg_init(&recvmsgMsg);
 
-        ctx = zmq_init(ZMQ_IO_THREADS);
-        assert(ctx != nullptr);
         type = type_;
+
+        int ioThreads = ZMQ_IO_THREADS;
+        auto *opts = zcm_url_opts(url);
+        for (size_t i = 0; i < opts->numopts; i++) {
+            string name = opts->name[i], value = opts->value[i];
+            if (name == "mux" && (value == "0" || value == "1")) {
+                mux = (value == "1");
+            } else if (name == "io_threads" && parseInt(value, 1, 64, ioThreads)) {
+            } else if (name == "sndhwm" && parseInt(value, 0, INT_MAX, sndhwm)) {
+            } else if (name == "rcvhwm" && parseInt(value, 0, INT_MAX, rcvhwm)) {
+            } else if (name == "sndbuf" && parseInt(value, 1, INT_MAX, sndbuf)) {
+            } else if (name == "rcvbuf" && parseInt(value, 1, INT_MAX, rcvbuf)) {
+            } else if (name == "linger" && parseInt(value, -1, INT_MAX, linger)) {
+                hasLinger = true;
+            } else if (name == "affinity" && !value.empty()) {
+                char *end;
+                affinity = strtoull(value.c_str(), &end, 0);
+                if (*end != '\0') {
+                    ZCM_DEBUG("zmq: invalid url option %s=%s", name.c_str(), value.c_str());
+                    valid = false;
+                }
+            } else {
+                ZCM_DEBUG("zmq: invalid url option %s=%s", name.c_str(), value.c_str());
+                valid = false;
+            }
+        }
+
+        // inproc moves messages without the I/O threads, so its shared
+        // context keeps the default
+        ctx = (type == INPROC) ? inprocCtxAcquire() : zmq_init(ioThreads);
+        assert(ctx != nullptr);
+
+        static atomic<unsigned> instances {0};
+        if (type == INPROC && !mux)
+            inprocInstance = instances++;
+        if (mux) {
+            char name[64];
+            if (type == IPC) {
+                snprintf(name, sizeof(name), "%s%u-%u", MUX_NAME_PREFIX, (unsigned)getpid(), instances++);
+                muxAddress = string("ipc:///tmp/") + name;
+            } else {
+                snprintf(name, sizeof(name), "%s%u", MUX_INPROC_NAME_PREFIX, instances++);
+                muxAddress = string(INPROC_ADDR_PREFIX) + name;
+            }
+        }
+    }
+
+    bool good()
+    {
+        return valid;
+    }
+
+    static bool parseInt(const string& s, int min, int max, int& out)
+    {
+        char *end;
+        long v = strtol(s.c_str(), &end, 10);
+        if (s.empty() || *end != '\0' || v < min || v > max)
+            return false;
+        out = (int)v;
+        return true;
+    }
+
+    bool setSockOpt(void *sock, int opt, const void *value, size_t size, const char *name)
+    {
+        if (zmq_setsockopt(sock, opt, value, size) == 0)
+            return true;
+        ZCM_DEBUG("failed to set %s: %s", name, zmq_strerror(errno));
+        return false;
+    }
+
+    // Creates a socket with the url's socket options applied. The send side
+    // options only apply to pubsocks and the receive side ones to subsocks
+    void *newSocket(int socktype)
+    {
+        void *sock = zmq_socket(ctx, socktype);
+        if (sock == nullptr)
+            return nullptr;
+
+        bool pub = (socktype == ZMQ_PUB);
+        int hwm = pub ? sndhwm : rcvhwm;
+        int buf = pub ? sndbuf : rcvbuf;
+        bool ok = true;
+        if (hwm >= 0)
+            ok &= setSockOpt(sock, pub ? ZMQ_SNDHWM : ZMQ_RCVHWM, &hwm, sizeof(hwm), "hwm");
+        if (buf > 0)
+            ok &= setSockOpt(sock, pub ? ZMQ_SNDBUF : ZMQ_RCVBUF, &buf, sizeof(buf), "buf");
+        if (hasLinger)
+            ok &= setSockOpt(sock, ZMQ_LINGER, &linger, sizeof(linger), "linger");
+        if (affinity != 0)
+            ok &= setSockOpt(sock, ZMQ_AFFINITY, &affinity, sizeof(affinity), "affinity");
+        if (!ok) {
+            zmq_close(sock);
+            return nullptr;
+        }
+        return sock;
     }
 
     ~ZCM_TRANS_CLASSNAME()
@@ -84,40 +348,59 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         }
 
         // Clean up all subscribe sockets
-        for (auto it = subsocks.begin(); it != subsocks.end(); ++it) {
-            address = getAddress(it->first);
-
-            rc = zmq_disconnect(it->second.first, address.c_str());
-            if (rc == -1) {
-                ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
-            }
+        for (auto it = subsocks.begin(); it != subsocks.end(); ++it)
+            subsockClose(it->second);
 
-            rc = zmq_close(it->second.first);
+        if (muxPub) {
+            rc = zmq_unbind(muxPub, muxAddress.c_str());
             if (rc == -1) {
-                ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
+                ZCM_DEBUG("failed to unbind mux pubsock: %s", zmq_strerror(errno));
             }
+            zmq_close(muxPub);
         }
+        if (muxSub)
+            zmq_close(muxSub);
+
+        stopDiscovery();
+
+        for (auto& b : batch)
+            zmq_msg_close(&b.msg);
+        zmq_msg_close(&recvmsgMsg);
 
         // Clean up the zmq context
-        rc = zmq_ctx_term(ctx);
-        if (rc == -1) {
-            ZCM_DEBUG("failed to terminate context: %s", zmq_strerror(errno));
+        if (type == INPROC) {
+            inprocCtxRelease();
+        } else {
+            rc = zmq_ctx_term(ctx);
+            if (rc == -1) {
+                ZCM_DEBUG("failed to terminate context: %s", zmq_strerror(errno));
+            }
         }
-
-        delete[] recvmsgBuffer;
     }
 
+    // The address this transport's pubsock for 'channel' binds
     string getAddress(const string& channel)
     {
         switch (type) {
             case IPC:
                 return IPC_ADDR_PREFIX+channel;
             case INPROC:
-                return INPROC_ADDR_PREFIX+channel;
+                return INPROC_ADDR_PREFIX+inprocEndpoint(channel);
         }
         assert(0 && "unreachable");
     }
 
+    string inprocEndpoint(const string& channel)
+    {
+        return channel + "/" + to_string(inprocInstance);
+    }
+
+    // The channel of an inproc endpoint. Channels may contain '/' themselves
+    static string inprocEndpointChannel(const string& name)
+    {
+        return name.substr(0, name.rfind('/'));
+    }
+
     bool acquirePubLockfile(const string& channel)
     {
         switch (type) {
@@ -146,7 +429,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                             channel.c_str());
             return nullptr;
         }
-        void *sock = zmq_socket(ctx, ZMQ_PUB);
+        void *sock = newSocket(ZMQ_PUB);
         if (sock == nullptr) {
             ZCM_DEBUG("failed to create pubsock: %s", zmq_strerror(errno));
             return nullptr;
@@ -155,9 +438,12 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         int rc = zmq_bind(sock, address.c_str());
         if (rc == -1) {
             ZCM_DEBUG("failed to bind pubsock: %s", zmq_strerror(errno));
+            zmq_close(sock);
             return nullptr;
         }
         pubsocks.emplace(channel, sock);
+        if (type == INPROC)
+            inprocChannels.add(inprocEndpoint(channel));
         return sock;
     }
 
@@ -166,66 +452,432 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     {
         auto it = subsocks.find(channel);
         if (it != subsocks.end()) {
-            it->second.second |= subExplicit;
-            return it->second.first;
+            it->second.subExplicit |= subExplicit;
+            return it->second.sock;
         }
-        void *sock = zmq_socket(ctx, ZMQ_SUB);
+        void *sock = newSocket(ZMQ_SUB);
         if (sock == nullptr) {
             ZCM_DEBUG("failed to create subsock: %s", zmq_strerror(errno));
             return nullptr;
         }
-        string address = getAddress(channel);
-        int rc;
-        rc = zmq_connect(sock, address.c_str());
-        if (rc == -1) {
-            ZCM_DEBUG("failed to connect subsock: %s", zmq_strerror(errno));
-            return nullptr;
-        }
-        rc = zmq_setsockopt(sock, ZMQ_SUBSCRIBE, "", 0);
+        int rc = zmq_setsockopt(sock, ZMQ_SUBSCRIBE, "", 0);
         if (rc == -1) {
             ZCM_DEBUG("failed to setsockopt on subsock: %s", zmq_strerror(errno));
+            zmq_close(sock);
             return nullptr;
         }
-        subsocks.emplace(channel, make_pair(sock, subExplicit));
+        Subsock sub {sock, subExplicit, {}};
+        if (type == IPC) {
+            if (!subsockConnect(sub, getAddress(channel))) {
+                zmq_close(sock);
+                return nullptr;
+            }
+        } else {
+            // the pubsocks bound so far. The recv thread connects the later ones
+            vector<string> endpoints;
+            inprocChannels.find(channel + "/", endpoints);
+            for (auto& name : endpoints)
+                if (inprocEndpointChannel(name) == channel)
+                    subsockConnect(sub, INPROC_ADDR_PREFIX + name);
+        }
+        subsocks.emplace(channel, std::move(sub));
+        pollDirty = true;
         return sock;
     }
 
-    void ipcScanForNewChannels()
+    bool subsockConnect(Subsock& sub, const string& address)
+    {
+        if (std::find(sub.addresses.begin(), sub.addresses.end(), address) != sub.addresses.end())
+            return true;
+        if (zmq_connect(sub.sock, address.c_str()) == -1) {
+            ZCM_DEBUG("failed to connect subsock to %s: %s", address.c_str(), zmq_strerror(errno));
+            return false;
+        }
+        sub.addresses.push_back(address);
+        return true;
+    }
+
+    // Only fails if the socket can't be closed: the inproc publishers that
+    // were connected to may be gone already
+    bool subsockClose(Subsock& sub)
+    {
+        for (auto& address : sub.addresses) {
+            if (zmq_disconnect(sub.sock, address.c_str()) == -1) {
+                ZCM_DEBUG("failed to disconnect subsock from %s: %s",
+                          address.c_str(), zmq_strerror(errno));
+            }
+        }
+        if (zmq_close(sub.sock) == -1) {
+            ZCM_DEBUG("failed to close subsock: %s", zmq_strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // A file appeared in /tmp/: a channel's pubsock, or in mux mode, another
+    // transport's endpoint
+    void ipcFoundName(const char *name)
     {
+        if (mux) {
+            if (strncmp(name, MUX_NAME_PREFIX, strlen(MUX_NAME_PREFIX)) == 0)
+                muxConnect(name);
+            return;
+        }
+
         const char *prefix = IPC_NAME_PREFIX;
         size_t prefixLen = strlen(IPC_NAME_PREFIX);
+        if (strncmp(name, prefix, prefixLen) == 0) {
+            string channel(name + prefixLen);
+            void *sock = subsockFindOrCreate(channel, false);
+            if (sock == nullptr) {
+                ZCM_DEBUG("failed to open subsock in ipcFoundName(%s)", channel.c_str());
+            }
+        }
+    }
 
+    void ipcScanDir()
+    {
         DIR *d;
         dirent *ent;
 
         if (!(d=opendir("/tmp/")))
             return;
 
-        while ((ent=readdir(d)) != nullptr) {
-            if (strncmp(ent->d_name, prefix, prefixLen) == 0) {
-                string channel(ent->d_name + prefixLen);
-                void *sock = subsockFindOrCreate(channel, false);
-                if (sock == nullptr) {
-                    ZCM_DEBUG("failed to open subsock in scanForNewChannels(%s)", channel.c_str());
+        while ((ent=readdir(d)) != nullptr)
+            ipcFoundName(ent->d_name);
+
+        closedir(d);
+    }
+
+    void ipcScanForNewChannels()
+    {
+#ifdef __linux__
+        if (ipcWatchFd >= 0) {
+            ipcReadWatch();
+            return;
+        }
+        ipcWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ipcWatchFd >= 0 &&
+            inotify_add_watch(ipcWatchFd, "/tmp/", IN_CREATE | IN_MOVED_TO | IN_DELETE) < 0) {
+            close(ipcWatchFd);
+            ipcWatchFd = -1;
+        }
+        if (ipcWatchFd >= 0) {
+            // channels created before the watch was set up
+            ipcScanDir();
+            pollDirty = true;
+            return;
+        }
+        ZCM_DEBUG("failed to watch /tmp/, scanning it every %d ms instead", IPC_SCAN_PERIOD_MS);
+#endif
+        auto now = chrono::steady_clock::now();
+        if (now - ipcLastScan < chrono::milliseconds(IPC_SCAN_PERIOD_MS))
+            return;
+        ipcLastScan = now;
+        ipcScanDir();
+    }
+
+#ifdef __linux__
+    void ipcReadWatch()
+    {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(ipcWatchFd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                auto *ev = (struct inotify_event*)p;
+                p += sizeof(*ev) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    ipcScanDir();
+                    continue;
+                }
+                if (ev->len == 0)
+                    continue;
+                if (ev->mask & IN_DELETE) {
+                    if (mux)
+                        muxDisconnect(ev->name);
+                } else {
+                    ipcFoundName(ev->name);
                 }
             }
         }
-
-        closedir(d);
     }
+#endif
 
-    // XXX This only works for channels within this instance! Creating another
-    //     ZCM instance using 'inproc' will cause this scan to miss some channels!
-    //     Need to implement a better technique. Should use a globally shared datastruct.
+    // Reads the endpoints that the inproc transports of this process added to
+    // the registry since the last call. Without mux, a new endpoint is
+    // connected to the subsock of its channel, which is only created while
+    // receiving all channels
     void inprocScanForNewChannels()
     {
-        for (auto& elt : pubsocks) {
-            auto& channel = elt.first;
-            void *sock = subsockFindOrCreate(channel, false);
+        InprocRegistry& registry = mux ? inprocMuxEndpoints : inprocChannels;
+        if (inprocWakeFds[0] < 0) {
+            if (pipe(inprocWakeFds) < 0) {
+                ZCM_DEBUG("failed to create the inproc wakeup pipe: %s", strerror(errno));
+                inprocWakeFds[0] = inprocWakeFds[1] = -1;
+            } else {
+                fcntl(inprocWakeFds[0], F_SETFL, O_NONBLOCK);
+                fcntl(inprocWakeFds[1], F_SETFL, O_NONBLOCK);
+                registry.watch(inprocWakeFds[1]);
+                pollDirty = true;
+            }
+        } else {
+            char buf[256];
+            while (read(inprocWakeFds[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        vector<string> found;
+        registry.read(inprocSeen, found);
+        for (auto& name : found) {
+            if (mux) {
+                muxConnect(name.c_str());
+                continue;
+            }
+            string channel = inprocEndpointChannel(name);
+            if (recvAllChannels && subsockFindOrCreate(channel, false) == nullptr) {
+                ZCM_DEBUG("failed to open subsock in inprocScanForNewChannels(%s)", channel.c_str());
+                continue;
+            }
+            auto it = subsocks.find(channel);
+            if (it != subsocks.end())
+                subsockConnect(it->second, INPROC_ADDR_PREFIX + name);
+        }
+    }
+
+    void scanForNewChannels()
+    {
+        switch (type) {
+            case IPC: ipcScanForNewChannels(); break;
+            case INPROC: inprocScanForNewChannels(); break;
+        }
+    }
+
+    void stopDiscovery()
+    {
+        if (ipcWatchFd >= 0) {
+            close(ipcWatchFd);
+            ipcWatchFd = -1;
+            pollDirty = true;
+        }
+        if (inprocWakeFds[0] >= 0) {
+            (mux ? inprocMuxEndpoints : inprocChannels).unwatch(inprocWakeFds[1]);
+            close(inprocWakeFds[0]);
+            close(inprocWakeFds[1]);
+            inprocWakeFds[0] = inprocWakeFds[1] = -1;
+            // everything is read again when discovery restarts
+            inprocSeen = 0;
+            pollDirty = true;
+        }
+    }
+
+    // May return null if it cannot create the mux pubsock
+    void *muxPubFindOrCreate()
+    {
+        if (muxPub)
+            return muxPub;
+        void *sock = newSocket(ZMQ_PUB);
+        if (sock == nullptr) {
+            ZCM_DEBUG("failed to create mux pubsock: %s", zmq_strerror(errno));
+            return nullptr;
+        }
+        int rc = zmq_bind(sock, muxAddress.c_str());
+        if (rc == -1) {
+            ZCM_DEBUG("failed to bind mux pubsock: %s", zmq_strerror(errno));
+            zmq_close(sock);
+            return nullptr;
+        }
+        muxPub = sock;
+        if (type == INPROC)
+            inprocMuxEndpoints.add(muxAddress.substr(strlen(INPROC_ADDR_PREFIX)));
+        return sock;
+    }
+
+    // Apply the subscriptions recvmsgEnable() queued up, on the recv thread
+    // since zmq sockets aren't thread safe. Creates the mux subsock first
+    void muxUpdateSubscriptions()
+    {
+        if (muxTopicChanges.empty())
+            return;
+        if (!muxSub) {
+            void *sock = newSocket(ZMQ_SUB);
             if (sock == nullptr) {
-                ZCM_DEBUG("failed to open subsock in scanForNewChannels(%s)", channel.c_str());
+                ZCM_DEBUG("failed to create mux subsock: %s", zmq_strerror(errno));
+                return;
+            }
+            muxSub = sock;
+            pollDirty = true;
+        }
+        for (auto& c : muxTopicChanges) {
+            int rc = zmq_setsockopt(muxSub, c.second ? ZMQ_SUBSCRIBE : ZMQ_UNSUBSCRIBE,
+                                    c.first.data(), c.first.size());
+            if (rc == -1) {
+                ZCM_DEBUG("failed to setsockopt on mux subsock: %s", zmq_strerror(errno));
+            }
+        }
+        muxTopicChanges.clear();
+    }
+
+    void muxConnect(const char *name)
+    {
+        if (type == INPROC) {
+            if (muxPeers.count(name))
+                return;
+            string address = string(INPROC_ADDR_PREFIX) + name;
+            if (zmq_connect(muxSub, address.c_str()) == -1) {
+                ZCM_DEBUG("failed to connect mux subsock to %s: %s", address.c_str(), zmq_strerror(errno));
+                return;
             }
+            muxPeers.insert(name);
+            return;
+        }
+
+        string path = string("/tmp/") + name;
+        if (muxPeers.count(path))
+            return;
+
+        // endpoints left behind by processes that died
+        unsigned pid;
+        if (sscanf(name + strlen(MUX_NAME_PREFIX), "%u-", &pid) == 1 &&
+            kill(pid, 0) < 0 && errno == ESRCH) {
+            ZCM_DEBUG("removing the stale mux endpoint %s", path.c_str());
+            unlink(path.c_str());
+            return;
+        }
+
+        string address = "ipc://" + path;
+        if (zmq_connect(muxSub, address.c_str()) == -1) {
+            ZCM_DEBUG("failed to connect mux subsock to %s: %s", address.c_str(), zmq_strerror(errno));
+            return;
         }
+        muxPeers.insert(path);
+    }
+
+    void muxDisconnect(const char *name)
+    {
+        string path = string("/tmp/") + name;
+        if (!muxPeers.erase(path))
+            return;
+        string address = "ipc://" + path;
+        if (zmq_disconnect(muxSub, address.c_str()) == -1) {
+            ZCM_DEBUG("failed to disconnect mux subsock: %s", zmq_strerror(errno));
+        }
+    }
+
+    // Receive a message of the mux subsock: a topic frame holding the channel
+    // and its terminator, then the data. Leaves b.channel empty if the topic
+    // frame is bad
+    int muxRecv(void *sock, Pending& b)
+    {
+        zmq_msg_t topic;
+        zmq_msg_init(&topic);
+        if (zmq_msg_recv(&topic, sock, ZMQ_DONTWAIT) == -1) {
+            zmq_msg_close(&topic);
+            return -1;
+        }
+        const char *t = (const char*)zmq_msg_data(&topic);
+        size_t tlen = zmq_msg_size(&topic);
+        b.channel.clear();
+        if (tlen >= 2 && tlen <= ZCM_CHANNEL_MAXLEN + 1 && t[tlen-1] == '\0')
+            b.channel.assign(t, tlen - 1);
+        bool more = zmq_msg_more(&topic);
+        zmq_msg_close(&topic);
+        if (!more) {
+            b.channel.clear();
+            return 0;
+        }
+
+        // the parts of a message arrive together, and only two are expected
+        int rc = zmq_msg_recv(&b.msg, sock, ZMQ_DONTWAIT);
+        while (rc != -1 && zmq_msg_more(&b.msg)) {
+            b.channel.clear();
+            rc = zmq_msg_recv(&b.msg, sock, ZMQ_DONTWAIT);
+        }
+        return rc;
+    }
+
+    void rebuildPollSet()
+    {
+        pitems.clear();
+        pchannels.clear();
+        if (muxSub) {
+            zmq_pollitem_t p;
+            memset(&p, 0, sizeof(p));
+            p.socket = muxSub;
+            p.events = ZMQ_POLLIN;
+            pitems.push_back(p);
+            pchannels.emplace_back();
+        }
+        for (auto& elt : subsocks) {
+            zmq_pollitem_t p;
+            memset(&p, 0, sizeof(p));
+            p.socket = elt.second.sock;
+            p.events = ZMQ_POLLIN;
+            pitems.push_back(p);
+            pchannels.emplace_back(elt.first);
+        }
+        int watchFd = (ipcWatchFd >= 0) ? ipcWatchFd : inprocWakeFds[0];
+        if (watchFd >= 0) {
+            zmq_pollitem_t p;
+            memset(&p, 0, sizeof(p));
+            p.fd = watchFd;
+            p.events = ZMQ_POLLIN;
+            pitems.push_back(p);
+            pchannels.emplace_back();
+        }
+        pollDirty = false;
+    }
+
+    // Receive what every ready socket has (up to RECV_BATCH_PER_SOCKET each)
+    // into 'batch'. The sockets take turns going first, so that a busy channel
+    // early in the poll set can't starve the others
+    void drainReadySockets()
+    {
+        size_t n = pitems.size();
+        for (size_t k = 0; k < n; k++) {
+            size_t i = (pollStart + k) % n;
+            auto& p = pitems[i];
+            // the discovery fd: new channels are picked up before the next poll
+            if (p.socket == nullptr || p.revents == 0)
+                continue;
+            for (int j = 0; j < RECV_BATCH_PER_SOCKET; j++) {
+                batch.emplace_back();
+                auto& b = batch.back();
+                zmq_msg_init(&b.msg);
+                int rc = (p.socket == muxSub) ? muxRecv(p.socket, b)
+                                              : zmq_msg_recv(&b.msg, p.socket, ZMQ_DONTWAIT);
+                if (rc == -1) {
+                    if (errno != EAGAIN)
+                        ZCM_DEBUG("zmq_msg_recv failed with: %s", zmq_strerror(errno));
+                    zmq_msg_close(&b.msg);
+                    batch.pop_back();
+                    break;
+                }
+                assert(rc < MTU && "Received message that is bigger than a legally-published message could be");
+                if (p.socket != muxSub) {
+                    b.channel = pchannels[i];
+                } else if (b.channel.empty()) {
+                    ZCM_DEBUG("dropping a mux message with a bad topic frame");
+                    zmq_msg_close(&b.msg);
+                    batch.pop_back();
+                }
+            }
+        }
+        pollStart = (n > 0) ? (pollStart + 1) % n : 0;
+    }
+
+    int recvmsgFromBatch(zcm_msg_t *msg)
+    {
+        // Receive without copying: msg->buf points into the zmq message,
+        // which releases the previous one
+        auto& b = batch.front();
+        zmq_msg_move(&recvmsgMsg, &b.msg);
+        zmq_msg_close(&b.msg);
+        recvmsgChannel.swap(b.channel);
+        batch.pop_front();
+
+        msg->channel = recvmsgChannel.c_str();
+        msg->len = zmq_msg_size(&recvmsgMsg);
+        msg->buf = (char*)zmq_msg_data(&recvmsgMsg);
+        return ZCM_EOK;
     }
 
     /********************** METHODS **********************/
@@ -234,6 +886,9 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         return MTU;
     }
 
+    // Note: zmq_send() copies msg.buf into a zmq message once. Sending it
+    //       without the copy (zmq_msg_init_data()) would need zmq to own the
+    //       buffer, but transports only borrow it for the duration of the call
     int sendmsg(zcm_msg_t msg)
     {
         string channel = msg.channel;
@@ -242,6 +897,19 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         if (msg.len > MTU)
             return ZCM_EINVALID;
 
+        if (mux) {
+            void *sock = muxPubFindOrCreate();
+            if (sock == nullptr)
+                return ZCM_ECONNECT;
+            // the topic frame includes the terminator
+            if (zmq_send(sock, msg.channel, channel.size() + 1, ZMQ_SNDMORE) == -1 ||
+                zmq_send(sock, msg.buf, msg.len, 0) != (int)msg.len) {
+                ZCM_DEBUG("zmq_send failed with: %s", zmq_strerror(errno));
+                return ZCM_EUNKNOWN;
+            }
+            return ZCM_EOK;
+        }
+
         void *sock = pubsockFindOrCreate(channel);
         if (sock == nullptr)
             return ZCM_ECONNECT;
@@ -260,26 +928,34 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         // concurrently
         unique_lock<mutex> lk(mut);
 
+        if (mux) {
+            // the empty prefix subscribes to everything
+            string topic;
+            if (channel) {
+                topic = channel;
+                topic.push_back('\0');
+            }
+            if (enable != (muxTopics.count(topic) > 0)) {
+                if (enable)
+                    muxTopics.insert(topic);
+                else
+                    muxTopics.erase(topic);
+                muxTopicChanges.emplace_back(topic, enable);
+            }
+            return ZCM_EOK;
+        }
+
         // TODO: make this prettier
         if (channel == NULL) {
-            if (enable) {
-                recvAllChannels = enable;
-            } else {
+            recvAllChannels = enable;
+            if (!enable) {
                 for (auto it = subsocks.begin(); it != subsocks.end(); ) {
-                    if (!it->second.second) { // This channel is only subscribed to implicitly
-                        string address = getAddress(it->first);
-                        int rc = zmq_disconnect(it->second.first, address.c_str());
-                        if (rc == -1) {
-                            ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
-                            return ZCM_ECONNECT;
-                        }
-
-                        rc = zmq_close(it->second.first);
-                        if (rc == -1) {
-                            ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
-                            return ZCM_ECONNECT;
-                        }
+                    if (!it->second.subExplicit) { // This channel is only subscribed to implicitly
+                        bool ok = subsockClose(it->second);
                         it = subsocks.erase(it);
+                        pollDirty = true;
+                        if (!ok)
+                            return ZCM_ECONNECT;
                     } else {
                         ++it;
                     }
@@ -294,23 +970,15 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             } else {
                 auto it = subsocks.find(channel);
                 if (it != subsocks.end()) {
-                    if (it->second.second) { // This channel has been subscribed to explicitly
+                    if (it->second.subExplicit) { // This channel has been subscribed to explicitly
                         if (recvAllChannels) {
-                            it->second.second = false;
+                            it->second.subExplicit = false;
                         } else {
-                            string address = getAddress(it->first);
-                            int rc = zmq_disconnect(it->second.first, address.c_str());
-                            if (rc == -1) {
-                                ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
-                                return ZCM_ECONNECT;
-                            }
-
-                            rc = zmq_close(it->second.first);
-                            if (rc == -1) {
-                                ZCM_DEBUG("failed to disconnect subsock: %s", zmq_strerror(errno));
-                                return ZCM_ECONNECT;
-                            }
+                            bool ok = subsockClose(it->second);
                             subsocks.erase(it);
+                            pollDirty = true;
+                            if (!ok)
+                                return ZCM_ECONNECT;
                         }
                     }
                 }
@@ -321,34 +989,30 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
     int recvmsg(zcm_msg_t *msg, int timeout)
     {
-        // Build up a list of poll items
-        vector<zmq_pollitem_t> pitems;
-        vector<string> pchannels;
+        // Hand out what the last poll gathered before polling again
+        if (!batch.empty())
+            return recvmsgFromBatch(msg);
+
         {
             // Mutex used to protect 'subsocks' while allowing
             // recvmsgEnable() and recvmsg() to be called
             // concurrently
             unique_lock<mutex> lk(mut);
 
-            if (recvAllChannels) {
-                switch (type) {
-                    case IPC: ipcScanForNewChannels();
-                    case INPROC: inprocScanForNewChannels();
-                }
+            if (mux) {
+                muxUpdateSubscriptions();
+                // the endpoints are tracked as long as anything is subscribed
+                if (muxSub)
+                    scanForNewChannels();
+            } else if (recvAllChannels || (type == INPROC && !subsocks.empty())) {
+                // inproc channels get new publishers as well as new channels
+                scanForNewChannels();
+            } else {
+                stopDiscovery();
             }
 
-            pitems.resize(subsocks.size());
-            int i = 0;
-            for (auto& elt : subsocks) {
-                auto& channel = elt.first;
-                auto& sock = elt.second.first;
-                auto *p = &pitems[i];
-                memset(p, 0, sizeof(*p));
-                p->socket = sock;
-                p->events = ZMQ_POLLIN;
-                pchannels.emplace_back(channel);
-                i++;
-            }
+            if (pollDirty)
+                rebuildPollSet();
         }
 
         timeout = (timeout >= 0) ? timeout : -1;
@@ -360,49 +1024,10 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("zmq_poll failed with: %s", zmq_strerror(errno));
             return ZCM_EAGAIN;
         }
-        if (rc >= 0) {
-            for (size_t i = 0; i < pitems.size(); i++) {
-                auto& p = pitems[i];
-                if (p.revents != 0) {
-                    // NOTE: zmq_recv can return an integer > the len parameter passed in
-                    //       (in this case recvmsgBufferSize); however, all bytes past
-                    //       len are truncated and not placed in the buffer. This means
-                    //       that you will always lose the first message you get that is
-                    //       larger than recvmsgBufferSize
-                    int rc = zmq_recv(p.socket, recvmsgBuffer, recvmsgBufferSize, 0);
-                    if (rc == -1) {
-                        fprintf(stderr, "zmq_recv failed with: %s", zmq_strerror(errno));
-                        // XXX: implement error handling, don't just assert
-                        assert(0 && "unexpected codepath");
-                    }
-                    assert(0 < rc);
-                    assert(rc < MTU && "Received message that is bigger than a legally-published message could be");
-                    if (rc > (int)recvmsgBufferSize) {
-                        ZCM_DEBUG("Reallocating recv buffer to handle larger messages. Size is now %d", rc);
-                        recvmsgBufferSize = rc;
-                        delete[] recvmsgBuffer;
-                        recvmsgBuffer = new char[recvmsgBufferSize];
-                        return ZCM_EAGAIN;
-                    }
-                    recvmsgChannel = pchannels[i];
-                    msg->channel = recvmsgChannel.c_str();
-                    msg->len = rc;
-                    msg->buf = recvmsgBuffer;
-
-                    // Note: This is probably fine and there probably isn't an elegant
-                    //       way to improve this, but we could technically have more than
-                    //       one socket with a message ready, but because our API is set
-                    //       up to only handle one message at a time, we don't read all
-                    //       the messages that are ready, only the first. You could
-                    //       imagine a case where one channel was at a very high freq
-                    //       and getting interpreted first could shadow a low freq message
-                    //       on a resource constrained system, though perhaps that's just
-                    //       and indicator that you need to optimize your code or do less.
-
-                    return ZCM_EOK;
-                }
-            }
-        }
+        if (rc > 0)
+            drainReadySockets();
+        if (!batch.empty())
+            return recvmsgFromBatch(msg);
 
         return ZCM_EAGAIN;
     }
@@ -443,20 +1068,30 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_destroy,
 };
 
+static zcm_trans_t *create(Type type, zcm_url_t *url)
+{
+    auto *trans = new ZCM_TRANS_CLASSNAME(type, url);
+    if (trans->good())
+        return trans;
+
+    delete trans;
+    return nullptr;
+}
+
 static zcm_trans_t *createIpc(zcm_url_t *url)
 {
-    return new ZCM_TRANS_CLASSNAME(IPC);
+    return create(IPC, url);
 }
 
 static zcm_trans_t *createInproc(zcm_url_t *url)
 {
-    return new ZCM_TRANS_CLASSNAME(INPROC);
+    return create(INPROC, url);
 }
 
 // Register this transport with ZCM
 #ifdef USING_TRANS_IPC
 const TransportRegister ZCM_TRANS_CLASSNAME::regIpc(
-    "ipc",    "Transfer data via Inter-process Communication (e.g. 'ipc')", createIpc);
+    "ipc",    "Transfer data via Inter-process Communication (e.g. 'ipc' or 'ipc://?mux=1')", createIpc);
 #endif
 
 #ifdef USING_TRANS_INPROC
@@ -12,6 +12,16 @@ bool FragBuf::matchesSockaddr(struct sockaddr_in *addr)
     return sockaddrEqual(&from, addr);
 }
 
+void FragBuf::setChannel(const char *channel, size_t len)
+{
+    assert(len <= ZCM_CHANNEL_MAXLEN);
+    channellen = len;
+    has_channel = true;
+    char *dst = getChannelPtr();
+    memcpy(dst, channel, len);
+    dst[len] = '\0';
+}
+
 /************************* Utility Functions *******************/
 // XXX DISABLED due to GLIB removal
 /* static inline int */
@@ -60,6 +70,8 @@ MessagePool::MessagePool(size_t maxSize, size_t maxBuffers)
 
 MessagePool::~MessagePool()
 {
+    while (!fragbufs.empty())
+        _removeFragBuf(fragbufs.size()-1);
 }
 
 Buffer MessagePool::allocBuffer(size_t sz)
@@ -123,34 +135,50 @@ void MessagePool::freeMessage(Message *b)
 }
 
 
-FragBuf *MessagePool::addFragBuf(u32 data_size)
+FragBuf *MessagePool::addFragBuf(u32 data_size, u16 fragments_in_msg)
 {
     FragBuf *fbuf = new (mempool.alloc<FragBuf>()) FragBuf{};
-    fbuf->buf = this->allocBuffer(data_size);
-
-    while (totalSize > maxSize || fragbufs.size() > maxBuffers) {
-        // find and remove the least recently updated fragment buffer
-        int idx = -1;
-        FragBuf *eldest = nullptr;
-        for (size_t i = 0; i < fragbufs.size(); i++) {
-            FragBuf *f = fragbufs[i];
-            if (idx == -1 || f->last_packet_utime < eldest->last_packet_utime) {
+    fbuf->buf = this->allocBuffer(FragBuf::DATA_OFFSET + data_size);
+    fbuf->received.assign((fragments_in_msg + 63) / 64, 0);
+
+    // evict the least recently updated fragment buffers until the new one fits
+    while (!fragbufs.empty() &&
+           (totalSize + fbuf->buf.size > maxSize || fragbufs.size() >= maxBuffers)) {
+        int idx = 0;
+        for (size_t i = 1; i < fragbufs.size(); i++)
+            if (fragbufs[i]->last_packet_utime < fragbufs[idx]->last_packet_utime)
                 idx = (int)i;
-                eldest = f;
-            }
-        }
-        if (eldest) {
-            _removeFragBuf(idx);
-            // XXX Need to free the removed FargBuf*
-        }
+        ZCM_DEBUG("Evicting partial message (missing %d fragments)",
+                  fragbufs[idx]->fragments_remaining);
+        _removeFragBuf(idx);
+        numEvicted++;
     }
 
     fragbufs.push_back(fbuf);
-    totalSize += data_size;
+    totalSize += fbuf->buf.size;
 
     return fbuf;
 }
 
+FragBuf *MessagePool::addDiscardFragBuf()
+{
+    FragBuf *fbuf = new (mempool.alloc<FragBuf>()) FragBuf{};
+    fbuf->discard = true;
+
+    // Note: these hold no data so the total size limit doesn't apply
+    while (!fragbufs.empty() && fragbufs.size() >= maxBuffers) {
+        int idx = 0;
+        for (size_t i = 1; i < fragbufs.size(); i++)
+            if (fragbufs[i]->last_packet_utime < fragbufs[idx]->last_packet_utime)
+                idx = (int)i;
+        _removeFragBuf(idx);
+        numEvicted++;
+    }
+
+    fragbufs.push_back(fbuf);
+    return fbuf;
+}
+
 FragBuf *MessagePool::lookupFragBuf(struct sockaddr_in *key)
 {
     for (auto& elt : fragbufs)
@@ -165,7 +193,7 @@ void MessagePool::_removeFragBuf(int index)
 
     // Update the total_size of the fragment buffers
     FragBuf *fbuf = fragbufs[index];
-    totalSize -= fbuf->buf.size;
+    totalSize -= fbuf->buf.size + fbuf->parity.size;
 
     // delete old element, move last element to this slot, and shrink by 1
     size_t lastIdx = fragbufs.size()-1;
@@ -173,6 +201,8 @@ void MessagePool::_removeFragBuf(int index)
     fragbufs.resize(lastIdx);
 
     this->freeBuffer(fbuf->buf);
+    this->freeBuffer(fbuf->parity);
+    fbuf->~FragBuf();
     mempool.free(fbuf);
 }
 
@@ -188,12 +218,51 @@ void MessagePool::removeFragBuf(FragBuf *fbuf)
     assert(0 && "Tried to remove invalid fragbuf");
 }
 
+void MessagePool::allocParity(FragBuf *fbuf, u16 group_size, u32 fragment_size)
+{
+    assert(!fbuf->parity.data && !fbuf->discard);
+    size_t ngroups = (fbuf->fragments_in_msg + group_size - 1) / group_size;
+    fbuf->fec_group = group_size;
+    fbuf->fec_fragment_size = fragment_size;
+    fbuf->parity_received.assign(ngroups, false);
+    fbuf->parity = this->allocBuffer(ngroups * fragment_size);
+    totalSize += fbuf->parity.size;
+}
+
 void MessagePool::transferBufffer(Message *to, FragBuf *from)
 {
     _freeMessageBuffer(to);
     to->buf = std::move(from->buf);
 }
 
+void MessagePool::prewarm(size_t count, size_t maxPacketSize)
+{
+    mempool.reserve(sizeof(Packet), count);
+    mempool.reserve(sizeof(Message), count);
+    mempool.reserve(sizeof(FragBuf), count);
+    mempool.reserve(maxPacketSize, count);
+}
+
+void MessagePool::fillStats(zcm_udpm_stats_t *stats)
+{
+    stats->fragbufs = fragbufs.size();
+    stats->fragbuf_bytes = totalSize;
+    stats->fragbufs_evicted = numEvicted;
+
+    stats->slab_bytes = mempool.getSlabBytes();
+    stats->slab_bytes_max = mempool.getMaxSlabBytes();
+    stats->num_size_classes = std::min(mempool.numClasses(), (size_t)ZCM_UDPM_MAX_SIZE_CLASSES);
+    for (size_t i = 0; i < stats->num_size_classes; i++) {
+        auto cs = mempool.getClassStats(i);
+        auto *out = &stats->size_classes[i];
+        out->objsize = cs.objsize;
+        out->slabs = cs.slabs;
+        out->inuse = cs.inuse;
+        out->free = cs.free;
+        out->overflow = cs.overflow;
+    }
+}
+
 /************************* Linux Specific Functions *******************/
 // #ifdef __linux__
 // void linux_check_routing_table(struct in_addr zcm_mcaddr);
@@ -2,6 +2,7 @@
 
 #include "udpm.hpp"
 #include "mempool.hpp"
+#include "zcm/transport_udpm.h"
 
 /************************* Packet Headers *******************/
 
@@ -64,6 +65,121 @@ struct MsgHeaderLong
 // ASCII-encoded channel name, followed by the payload data
 // if fragment_no > 0, then header is immediately followed by the payload data
 
+// Sent after each group of 'group_size' fragments when forward error correction
+// is enabled. Fragment i carries bytes [i*fragment_size, (i+1)*fragment_size) of
+// the stream "channel, NULL, data". The parity packet is followed by the XOR of
+// the payloads of every fragment in the group, each zero-padded to the size of
+// the group's first fragment.
+// NOTE: this must be no larger than MsgHeaderLong so that a parity packet fits
+//       in a datagram along with a full fragment's worth of parity
+struct MsgHeaderParity
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;
+    u32 msg_size;
+    u16 fragment_size;
+    u16 fragments_in_msg;
+    u16 group_no;
+    u8  group_size;
+    u8  channel_len;
+
+    // Converted data
+  public:
+    u32  getMagic()                { return ntohl(magic); }
+    void setMagic(u32 v)           { magic = htonl(v); }
+    u32  getMsgSeqno()             { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v)        { msg_seqno = htonl(v); }
+    u32  getMsgSize()              { return ntohl(msg_size); }
+    void setMsgSize(u32 v)         { msg_size = htonl(v); }
+    u16  getFragmentSize()         { return ntohs(fragment_size); }
+    void setFragmentSize(u16 v)    { fragment_size = htons(v); }
+    u16  getFragmentsInMsg()       { return ntohs(fragments_in_msg); }
+    void setFragmentsInMsg(u16 v)  { fragments_in_msg = htons(v); }
+    u16  getGroupNo()              { return ntohs(group_no); }
+    void setGroupNo(u16 v)         { group_no = htons(v); }
+    u8   getGroupSize()            { return group_size; }
+    void setGroupSize(u8 v)        { group_size = v; }
+    u8   getChannelLen()           { return channel_len; }
+    void setChannelLen(u8 v)       { channel_len = v; }
+
+    // Computed data
+  public:
+    u32 getParitySize(size_t pktsz) { return pktsz - sizeof(*this); }
+    char *getDataPtr() { return (char*)(this+1); }
+};
+static_assert(sizeof(MsgHeaderParity) <= sizeof(MsgHeaderLong),
+              "Parity packets must fit in a datagram");
+static_assert(ZCM_CHANNEL_MAXLEN < (1<<8) && ZCM_FRAGMENT_MAX_PAYLOAD < (1<<16),
+              "Parity header fields are too small");
+
+// The control packets of the reliable channels:
+//   NACK:      unicast by a receiver to a sender, asking for the 'count'
+//              messages starting at 'msg_seqno' to be sent again
+//   DENY:      multicast by a sender that can't repair those messages, 'reason'
+//              is a RetransmitWindow::Status
+//   HEARTBEAT: multicast by a sender for a while after each message, with the
+//              last 'msg_seqno' it sent, so that lost tail messages are noticed
+struct MsgHeaderControl
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;
+    u32 count;
+    u32 reason;
+
+    // Converted data
+  public:
+    u32  getMagic()         { return ntohl(magic); }
+    void setMagic(u32 v)    { magic = htonl(v); }
+    u32  getMsgSeqno()      { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v) { msg_seqno = htonl(v); }
+    u32  getCount()         { return ntohl(count); }
+    void setCount(u32 v)    { count = htonl(v); }
+    u32  getReason()        { return ntohl(reason); }
+    void setReason(u32 v)   { reason = htonl(v); }
+};
+
+// Sent instead of a large message's fragments to the receivers on the sender's
+// host ('shm' url option). The message is at 'pos' in the arena of 'pid', and
+// its channel follows the header. Only receivers with the sender's 'host' can
+// read the arena, so the 64 bit fields are left in host order
+struct MsgHeaderShm
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;
+    u32 msg_size;
+    u32 pid;
+    u64 host;
+    u64 nonce;
+    u64 pos;
+
+    // Converted data
+  public:
+    u32  getMagic()         { return ntohl(magic); }
+    void setMagic(u32 v)    { magic = htonl(v); }
+    u32  getMsgSeqno()      { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v) { msg_seqno = htonl(v); }
+    u32  getMsgSize()       { return ntohl(msg_size); }
+    void setMsgSize(u32 v)  { msg_size = htonl(v); }
+    u32  getPid()           { return ntohl(pid); }
+    void setPid(u32 v)      { pid = htonl(v); }
+    u64  getHost()          { return host; }
+    void setHost(u64 v)     { host = v; }
+    u64  getNonce()         { return nonce; }
+    void setNonce(u64 v)    { nonce = v; }
+    u64  getPos()           { return pos; }
+    void setPos(u64 v)      { pos = v; }
+
+    // Computed data
+  public:
+    char *getChannelPtr() { return (char*)(this+1); }
+};
+
 /******************** message buffer **********************/
 struct Buffer
 {
@@ -122,6 +238,9 @@ struct Packet
     Packet() { memset(this, 0, sizeof(*this)); }
     MsgHeaderShort *asHeaderShort() { return (MsgHeaderShort*)buf.data; }
     MsgHeaderLong  *asHeaderLong()  { return (MsgHeaderLong* )buf.data; }
+    MsgHeaderParity *asHeaderParity() { return (MsgHeaderParity*)buf.data; }
+    MsgHeaderControl *asHeaderControl() { return (MsgHeaderControl*)buf.data; }
+    MsgHeaderShm *asHeaderShm() { return (MsgHeaderShm*)buf.data; }
 };
 
 /******************** fragment buffer **********************/
@@ -129,17 +248,50 @@ struct FragBuf
 {
     i64     last_packet_utime;
     u32     msg_seqno;
+    u32     data_size;
+    u16     fragments_in_msg;
     u16     fragments_remaining;
 
-    // The channel starts at the beginning of the buffer. The data
-    // follows immediately after the channel and its NULL
+    // Fragments may arrive in any order, so the channel is unknown until fragment 0
+    // shows up. The data is stored at a fixed offset into the buffer (leaving room
+    // for the longest channel) and the channel and its NULL are written into the
+    // bytes immediately preceding the data once fragment 0 is received.
+    static const size_t DATA_OFFSET = ZCM_CHANNEL_MAXLEN + 1;
     size_t  channellen;
+    bool    has_channel;
     struct sockaddr_in from;
 
+    // Set when fragment 0 revealed a channel that isn't enabled. Such a FragBuf
+    // has no buffer and only exists to drop the rest of the message's fragments
+    bool    discard;
+
+    // One bit per fragment, set when that fragment has been received
+    vector<u64> received;
+
+    // Forward error correction: the parity of each group of fec_group fragments
+    // is kept until the group completes. Allocated with the first parity packet
+    u16     fec_group;
+    u32     fec_fragment_size;
+    bool    channel_recovered;   // fragment 0 was rebuilt from parity
+    vector<bool> parity_received;
+    Buffer  parity;
+
     // Fields set by the allocator object
     Buffer buf;
 
     bool matchesSockaddr(struct sockaddr_in *addr);
+
+    bool hasFragment(u16 fragment_no)
+    { return (received[fragment_no >> 6] >> (fragment_no & 63)) & 1; }
+    void markFragment(u16 fragment_no)
+    { received[fragment_no >> 6] |= (u64)1 << (fragment_no & 63); }
+
+    char *getDataPtr() { return buf.data + DATA_OFFSET; }
+    // The bytes as sent by the fragments, starting with the channel
+    char *getStreamPtr() { return getDataPtr() - (channellen + 1); }
+    size_t getStreamSize() { return channellen + 1 + data_size; }
+    char *getChannelPtr() { return buf.data + DATA_OFFSET - (channellen + 1); }
+    void setChannel(const char *channel, size_t len);
 };
 
 /************** A pool to handle every alloc/dealloc operation on Message objects ******/
@@ -162,13 +314,21 @@ struct MessagePool
     void freeMessage(Message *b);
 
     // FragBuf
-    FragBuf *addFragBuf(u32 data_size);
+    FragBuf *addFragBuf(u32 data_size, u16 fragments_in_msg);
+    FragBuf *addDiscardFragBuf();
     FragBuf *lookupFragBuf(struct sockaddr_in *key);
     void removeFragBuf(FragBuf *fbuf);
+    void allocParity(FragBuf *fbuf, u16 group_size, u32 fragment_size);
 
     void transferBufffer(Message *to, FragBuf *from);
     void moveBuffer(Buffer& to, Buffer& from);
 
+    // Pre-allocate enough objects and buffers to receive 'count' packets
+    // without touching the system allocator
+    void prewarm(size_t count, size_t maxPacketSize);
+
+    void fillStats(zcm_udpm_stats_t *stats);
+
   private:
     void _freeMessageBuffer(Message *b);
     void _removeFragBuf(int index);
@@ -179,4 +339,5 @@ struct MessagePool
     size_t maxSize;
     size_t maxBuffers;
     size_t totalSize = 0;
+    u64 numEvicted = 0;
 };
@@ -4,7 +4,7 @@
 #include <cstring>
 #include <climits>
 
-MemPool::MemPool()
+MemPool::MemPool(size_t maxSlabBytes) : maxSlabBytes(maxSlabBytes)
 {
     memset(sizelists, 0, sizeof(sizelists));
 }
@@ -19,6 +19,11 @@ MemPool::~MemPool()
             blk = next;
         }
     }
+
+    // NOTE: objects from the slabs are never individually freed
+    for (size_t i = 0; i < NUMCLASSES; i++)
+        for (char *slab : classes[i].slabs)
+            std::free(slab);
 }
 
 static bool fitsInU32(size_t v)
@@ -44,8 +49,92 @@ static size_t slotToSize(int slot)
     return 1 << (slot+16);
 }
 
+// Returns the small-object class for 'sz', or -1 if it's too big for the slabs
+static int computeClass(size_t sz, size_t minBits, size_t numClasses)
+{
+    size_t bits = minBits;
+    while (((size_t)1 << bits) < sz)
+        bits++;
+    size_t cls = bits - minBits;
+    return cls < numClasses ? (int)cls : -1;
+}
+
+static size_t classToSize(size_t cls, size_t minBits)
+{
+    return (size_t)1 << (cls + minBits);
+}
+
+bool MemPool::growClass(size_t cls)
+{
+    if (slabBytes + SLAB_SIZE > maxSlabBytes)
+        return false;
+
+    char *slab = (char*)malloc(SLAB_SIZE);
+    if (!slab)
+        return false;
+    slabBytes += SLAB_SIZE;
+
+    SizeClass& c = classes[cls];
+    c.slabs.insert(std::upper_bound(c.slabs.begin(), c.slabs.end(), slab), slab);
+
+    // Thread the new objects onto the freelist
+    size_t objsize = classToSize(cls, MIN_CLASS_BITS);
+    for (size_t off = 0; off + objsize <= SLAB_SIZE; off += objsize) {
+        Block *blk = (Block*)(slab + off);
+        blk->next = c.freelist;
+        c.freelist = blk;
+        c.nfree++;
+    }
+    return true;
+}
+
+bool MemPool::ownsBlock(const SizeClass& c, char *mem) const
+{
+    // Find the last slab starting at or before 'mem'
+    auto it = std::upper_bound(c.slabs.begin(), c.slabs.end(), mem);
+    if (it == c.slabs.begin())
+        return false;
+    --it;
+    return mem < *it + SLAB_SIZE;
+}
+
+char *MemPool::allocSmall(size_t cls)
+{
+    SizeClass& c = classes[cls];
+    if (!c.freelist && !growClass(cls)) {
+        c.overflow++;
+        return (char*)malloc(classToSize(cls, MIN_CLASS_BITS));
+    }
+
+    Block *mem = c.freelist;
+    c.freelist = mem->next;
+    c.nfree--;
+    c.inuse++;
+    return (char*)mem;
+}
+
+void MemPool::freeSmall(size_t cls, char *mem)
+{
+    SizeClass& c = classes[cls];
+    if (!ownsBlock(c, mem)) {
+        // This object came from an overflow allocation
+        std::free(mem);
+        return;
+    }
+
+    Block *blk = (Block*)mem;
+    blk->next = c.freelist;
+    c.freelist = blk;
+    c.nfree++;
+    c.inuse--;
+}
+
 char *MemPool::alloc(size_t sz)
 {
+    int cls = computeClass(sz, MIN_CLASS_BITS, NUMCLASSES);
+    if (cls >= 0)
+        return allocSmall(cls);
+
     // This allocator only goes up to 2^28
     assert(sz <= (1<<28));
     assert(fitsInU32(sz));
@@ -63,6 +152,10 @@ char *MemPool::alloc(size_t sz)
 
 void MemPool::free(char *mem, size_t sz)
 {
+    int cls = computeClass(sz, MIN_CLASS_BITS, NUMCLASSES);
+    if (cls >= 0)
+        return freeSmall(cls, mem);
+
     // This allocator only goes up to 2^28
     assert(sz <= (1<<28));
     assert(fitsInU32(sz));
@@ -74,6 +167,41 @@ void MemPool::free(char *mem, size_t sz)
     sizelists[slot] = newblock;
 }
 
+void MemPool::reserve(size_t sz, size_t count)
+{
+    int cls = computeClass(sz, MIN_CLASS_BITS, NUMCLASSES);
+    if (cls >= 0) {
+        while (classes[cls].nfree < count)
+            if (!growClass(cls))
+                break;
+        return;
+    }
+
+    // Large blocks are simply allocated and placed on their free list
+    assert(sz <= (1<<28));
+    int slot = computeSlot(sz);
+    for (size_t i = 0; i < count; i++) {
+        Block *blk = (Block*)malloc(slotToSize(slot));
+        if (!blk)
+            break;
+        blk->next = sizelists[slot];
+        sizelists[slot] = blk;
+    }
+}
+
+MemPool::ClassStats MemPool::getClassStats(size_t cls) const
+{
+    assert(cls < NUMCLASSES);
+    const SizeClass& c = classes[cls];
+    ClassStats st;
+    st.objsize = classToSize(cls, MIN_CLASS_BITS);
+    st.slabs = c.slabs.size();
+    st.inuse = c.inuse;
+    st.free = c.nfree;
+    st.overflow = c.overflow;
+    return st;
+}
+
 void MemPool::test()
 {
     MemPool pool;
@@ -90,4 +218,25 @@ void MemPool::test()
     char *buf4 = pool.alloc(1<<28);
     assert(buf4);
     pool.free(buf4, 1<<28);
+
+    // Small objects share a slab and are recycled
+    char *small1 = pool.alloc(100);
+    char *small2 = pool.alloc(100);
+    assert(small1 && small2 && small1 != small2);
+    assert(pool.getClassStats(2).inuse == 2);
+    pool.free(small1, 100);
+    assert(pool.alloc(128) == small1);
+    pool.free(small1, 128);
+    pool.free(small2, 100);
+    assert(pool.getClassStats(2).slabs == 1);
+
+    // Once the slab limit is reached, small allocations overflow to malloc()
+    MemPool tiny(SLAB_SIZE);
+    tiny.reserve(32, SLAB_SIZE / 32);
+    char *inslab = tiny.alloc(32);
+    char *overflow = tiny.alloc(64);
+    assert(inslab && overflow);
+    assert(tiny.getClassStats(1).overflow == 1);
+    tiny.free(overflow, 64);
+    tiny.free(inslab, 32);
 }
@@ -1,26 +1,73 @@
 #pragma once
 #include <cstdlib>
+#include <vector>
 
 // A memory pool for the UDPM fragment buffering
 class MemPool
 {
   public:
-    MemPool();
+    // Bookkeeping for one of the small-object size classes
+    struct ClassStats
+    {
+        size_t objsize;   // bytes per object
+        size_t slabs;     // slabs carved up for this class
+        size_t inuse;     // objects currently handed out
+        size_t free;      // objects cached for reuse
+        size_t overflow;  // allocations that bypassed the slabs (limit reached)
+    };
+
+    static const size_t DEFAULT_MAX_SLAB_BYTES = 1 << 24; // 16 megabytes
+
+    MemPool(size_t maxSlabBytes = DEFAULT_MAX_SLAB_BYTES);
     ~MemPool();
 
     char *alloc(size_t sz);
     void free(char *mem, size_t sz);
 
+    // Pre-populate the free lists so that the next 'count' allocations of
+    // 'sz' bytes do not need to go to the system allocator
+    void reserve(size_t sz, size_t count);
+
     template<class T>
     T *alloc();
 
     template<class T>
     void free(T *ptr);
 
+    size_t numClasses() const { return NUMCLASSES; }
+    ClassStats getClassStats(size_t cls) const;
+    size_t getSlabBytes() const { return slabBytes; }
+    size_t getMaxSlabBytes() const { return maxSlabBytes; }
+
     static void test();
 
   private:
     struct Block { Block *next; };
+
+    // Small objects (Packet, Message, FragBuf, ...) are carved out of
+    // SLAB_SIZE chunks in pow2 size classes from 2^5 to 2^12. The total
+    // memory held by slabs is bounded by 'maxSlabBytes'. Past that, small
+    // allocations fall back to malloc() and are released with free().
+    static const size_t NUMCLASSES = 8;
+    static const size_t MIN_CLASS_BITS = 5;
+    static const size_t SLAB_SIZE = 1 << 16;
+    struct SizeClass
+    {
+        Block *freelist = nullptr;
+        std::vector<char*> slabs; // sorted, for ownership lookups in free()
+        size_t inuse = 0;
+        size_t nfree = 0;
+        size_t overflow = 0;
+    };
+    SizeClass classes[NUMCLASSES];
+    size_t slabBytes = 0;
+    size_t maxSlabBytes;
+
+    bool growClass(size_t cls);
+    bool ownsBlock(const SizeClass& c, char *mem) const;
+    char *allocSmall(size_t cls);
+    void freeSmall(size_t cls, char *mem);
+
     static const size_t NUMLISTS = 13;
     Block* sizelists[NUMLISTS]; // Pow2 blocks from 2^16 to 2^28
 
@@ -0,0 +1,33 @@
+#include "pacer.hpp"
+
+Pacer::Pacer(u64 rate, u64 burst)
+    : rate(rate), burst(burst), tokens(burst), last(Clock::now())
+{
+}
+
+u64 Pacer::reserve(size_t bytes)
+{
+    if (!isEnabled())
+        return 0;
+
+    auto now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+    last = now;
+
+    // Take the tokens up front and then pay off any debt by sleeping. Packets
+    // larger than the burst size are still let through this way
+    tokens -= bytes;
+    if (tokens >= 0)
+        return 0;
+    return (u64)(-tokens / rate * 1e6);
+}
+
+void Pacer::wait(u64 us)
+{
+    if (us == 0)
+        return;
+    numWaits++;
+    waitUtime += us;
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
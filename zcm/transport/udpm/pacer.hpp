@@ -0,0 +1,35 @@
+#pragma once
+#include "udpm.hpp"
+#include <atomic>
+#include <chrono>
+
+// A token bucket that limits the average rate at which bytes are sent, while
+// still allowing bursts of up to 'burst' bytes at full speed
+class Pacer
+{
+  public:
+    // A 'rate' of 0 disables pacing
+    Pacer(u64 rate = 0, u64 burst = 0);
+
+    bool isEnabled() const { return rate > 0; }
+
+    // Take the tokens for 'bytes', returning how many usecs to wait() before
+    // they may be sent without exceeding the rate
+    u64 reserve(size_t bytes);
+    void wait(u64 us);
+
+    u64 getNumWaits()  const { return numWaits; }
+    u64 getWaitUtime() const { return waitUtime; }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    double rate;     // bytes per second
+    double burst;    // capacity of the bucket in bytes
+    double tokens;   // may go negative, in which case we owe the bucket
+    Clock::time_point last;
+
+    // Read by UDPM::getStats() from other threads
+    std::atomic<u64> numWaits {0};
+    std::atomic<u64> waitUtime {0};
+};
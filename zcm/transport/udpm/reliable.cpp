@@ -0,0 +1,79 @@
+#include "reliable.hpp"
+
+void RetransmitWindow::add(u32 seqno, const char *channel, const char *data, size_t len,
+                           bool reliable)
+{
+    unique_lock<mutex> lk(mut);
+
+    // Note: seqnos only ever move forward by one per message
+    newest = seqno;
+    any = true;
+    history[seqno % RELIABLE_HISTORY] = reliable;
+    if (!reliable)
+        return;
+
+    auto entry = std::make_shared<Entry>();
+    entry->seqno = seqno;
+    entry->channel = channel;
+    entry->data.assign(data, data + len);
+    bytes += len;
+    entries.push_back(std::move(entry));
+
+    while (entries.size() > 1 &&
+           (bytes > maxBytes || (u32)(seqno - entries.front()->seqno) >= RELIABLE_HISTORY)) {
+        bytes -= entries.front()->data.size();
+        entries.pop_front();
+    }
+}
+
+RetransmitWindow::Status RetransmitWindow::lookup(u32 seqno, std::shared_ptr<Entry>& entry)
+{
+    unique_lock<mutex> lk(mut);
+
+    u32 age = newest - seqno;
+    if (!any || age >= RELIABLE_HISTORY)
+        return EXPIRED;
+    if (!history[seqno % RELIABLE_HISTORY])
+        return UNRELIABLE;
+
+    // entries are in seqno order, but with gaps for the best effort messages
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        if ((*it)->seqno == seqno) {
+            entry = *it;
+            return RETAINED;
+        }
+        if ((u32)(newest - (*it)->seqno) > age)
+            break;
+    }
+    return EXPIRED;
+}
+
+size_t RetransmitWindow::getBytes()
+{
+    unique_lock<mutex> lk(mut);
+    return bytes;
+}
+
+void NackTracker::add(const struct sockaddr_in *sender, u32 seqno, i64 utime)
+{
+    Key key {senderKey(sender), seqno};
+    if (pending.count(key))
+        return;
+
+    // give reordered packets a moment to show up before asking
+    Pending p;
+    p.sender = *sender;
+    p.next_utime = utime + NACK_DELAY_US;
+    p.tries = 0;
+    pending.emplace(key, p);
+}
+
+bool NackTracker::resolve(const struct sockaddr_in *sender, u32 seqno)
+{
+    return pending.erase(Key{senderKey(sender), seqno}) > 0;
+}
+
+bool NackTracker::isPending(const struct sockaddr_in *sender, u32 seqno) const
+{
+    return pending.count(Key{senderKey(sender), seqno}) > 0;
+}
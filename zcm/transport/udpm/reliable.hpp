@@ -0,0 +1,123 @@
+#pragma once
+#include "udpm.hpp"
+#include <map>
+#include <memory>
+
+// The building blocks of the NACK based reliability for channels listed in the
+// 'reliable' url option. Receivers detect missing messages from gaps in each
+// sender's msg_seqno and unicast NACKs back to the sender. The sender keeps a
+// bounded window of its recent reliable messages and multicasts them again.
+
+// Sender side: the recent messages sent on reliable channels
+class RetransmitWindow
+{
+  public:
+    struct Entry
+    {
+        u32 seqno;
+        string channel;
+        vector<char> data;
+        i64 last_repair_utime = 0;   // only used by the repair thread
+    };
+
+    enum Status {
+        RETAINED,    // the message can be sent again
+        UNRELIABLE,  // the message was on a best effort channel
+        EXPIRED,     // the message is no longer retained
+    };
+
+    RetransmitWindow(size_t maxBytes) : maxBytes(maxBytes) {}
+
+    // Record that message 'seqno' was sent. Reliable messages are retained
+    void add(u32 seqno, const char *channel, const char *data, size_t len, bool reliable);
+
+    // Find message 'seqno'. The entry remains valid after it leaves the window
+    Status lookup(u32 seqno, std::shared_ptr<Entry>& entry);
+
+    size_t getBytes();
+
+  private:
+    std::mutex mut;
+    std::deque<std::shared_ptr<Entry>> entries;   // ordered by seqno
+    size_t bytes = 0;
+    size_t maxBytes;
+
+    // Whether each of the last RELIABLE_HISTORY messages was reliable, so that
+    // NACKs for best effort messages can be told apart from expired ones
+    vector<bool> history = vector<bool>(RELIABLE_HISTORY, false);
+    u32 newest = 0;
+    bool any = false;
+};
+
+// Receiver side: the messages that are missing and when to ask for them again
+class NackTracker
+{
+  public:
+    // Start asking for message 'seqno' from 'sender', if not already asking
+    void add(const struct sockaddr_in *sender, u32 seqno, i64 utime);
+
+    // Stop asking for message 'seqno'. Returns true if it was being asked for
+    bool resolve(const struct sockaddr_in *sender, u32 seqno);
+
+    bool isPending(const struct sockaddr_in *sender, u32 seqno) const;
+    bool empty() const { return pending.empty(); }
+
+    // Call 'send(sender, seqno, count)' for every run of consecutive messages
+    // that are due to be asked for (again). Messages that were asked for too
+    // many times are given up on, and counted in the return value
+    template<class F>
+    u64 poll(i64 utime, F send);
+
+  private:
+    struct Pending
+    {
+        struct sockaddr_in sender;
+        i64 next_utime;
+        int tries;
+    };
+    typedef std::pair<u64, u32> Key;   // sender, seqno
+    std::map<Key, Pending> pending;
+};
+
+template<class F>
+u64 NackTracker::poll(i64 utime, F send)
+{
+    u64 gaveUp = 0;
+    const Pending *first = NULL;
+    u32 firstSeqno = 0, count = 0;
+    u64 firstSender = 0;
+
+    for (auto it = pending.begin(); it != pending.end(); ) {
+        Pending& p = it->second;
+        if (p.next_utime > utime) {
+            ++it;
+            continue;
+        }
+
+        if (p.tries >= NACK_MAX_TRIES) {
+            gaveUp++;
+            it = pending.erase(it);
+            continue;
+        }
+        p.tries++;
+        p.next_utime = utime + NACK_RETRY_US;
+
+        // merge runs of consecutive seqnos from the same sender into one NACK
+        if (first && it->first.first == firstSender && it->first.second == firstSeqno + count &&
+            count < NACK_MAX_RANGE) {
+            count++;
+        } else {
+            if (first)
+                send(&first->sender, firstSeqno, count);
+            first = &p;
+            firstSender = it->first.first;
+            firstSeqno = it->first.second;
+            count = 1;
+        }
+        ++it;
+    }
+    if (first)
+        send(&first->sender, firstSeqno, count);
+
+    return gaveUp;
+}
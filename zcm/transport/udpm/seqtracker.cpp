@@ -0,0 +1,80 @@
+#include "seqtracker.hpp"
+
+SeqTracker::Result SeqTracker::observe(const struct sockaddr_in *from, u32 seqno, i64 utime,
+                                       u32 *missed)
+{
+    if (missed)
+        *missed = 0;
+
+    auto ret = senders.emplace(senderKey(from), Sender{});
+    Sender& s = ret.first->second;
+    s.utime = utime;
+
+    if (ret.second) {
+        s.last = seqno;
+        s.seen = 1;
+        return RESET;
+    }
+
+    // Note: the subtraction handles the seqno wrapping around
+    i32 diff = (i32)(seqno - s.last);
+    if (diff > 0) {
+        numLost += diff - 1;
+        if (missed)
+            *missed = diff - 1;
+        s.seen = (diff < WINDOW) ? (s.seen << diff) | 1 : 1;
+        s.last = seqno;
+        return NEXT;
+    }
+
+    if (diff == 0) {
+        numDuplicate++;
+        return DUPLICATE;
+    }
+
+    if (-diff >= WINDOW) {
+        // Too far in the past to be a reordering: the sender probably restarted
+        ZCM_DEBUG("resetting sequence tracking for sender (seqno %u after %u)", seqno, s.last);
+        s.last = seqno;
+        s.seen = 1;
+        return RESET;
+    }
+
+    u64 bit = (u64)1 << -diff;
+    if (s.seen & bit) {
+        numDuplicate++;
+        return DUPLICATE;
+    }
+
+    // This message was counted as lost when the gap was first seen
+    s.seen |= bit;
+    numReordered++;
+    if (numLost > 0)
+        numLost--;
+    return REORDERED;
+}
+
+bool SeqTracker::hasSeen(const struct sockaddr_in *from, u32 seqno) const
+{
+    auto it = senders.find(senderKey(from));
+    if (it == senders.end())
+        return false;
+
+    const Sender& s = it->second;
+    i32 diff = (i32)(seqno - s.last);
+    if (diff > 0)
+        return false;
+    if (-diff >= WINDOW)
+        return true;
+    return (s.seen >> -diff) & 1;
+}
+
+void SeqTracker::prune(i64 utime)
+{
+    for (auto it = senders.begin(); it != senders.end(); ) {
+        if (it->second.utime < utime)
+            it = senders.erase(it);
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "udpm.hpp"
+
+// Tracks the message sequence numbers (msg_seqno) of every sender on the
+// group in order to detect lost, duplicated and reordered messages
+class SeqTracker
+{
+  public:
+    enum Result {
+        NEXT,       // the expected message, or a newer one after a gap
+        REORDERED,  // an older message that arrived after a newer one
+        DUPLICATE,  // a message that was already seen
+        RESET,      // the first message seen from a (possibly restarted) sender
+    };
+
+    // Record the arrival of the first packet of message 'seqno' from 'from'.
+    // If 'missed' is given, it is set to the number of messages skipped over
+    Result observe(const struct sockaddr_in *from, u32 seqno, i64 utime, u32 *missed = NULL);
+
+    // Whether message 'seqno' from 'from' was already observed. Messages too
+    // old to remember are reported as seen
+    bool hasSeen(const struct sockaddr_in *from, u32 seqno) const;
+
+    // Forget senders that haven't been heard from since 'utime'
+    void prune(i64 utime);
+
+    u64 getNumLost()       const { return numLost; }
+    u64 getNumDuplicate()  const { return numDuplicate; }
+    u64 getNumReordered()  const { return numReordered; }
+    size_t getNumSenders() const { return senders.size(); }
+
+  private:
+    // The last WINDOW seqnos of each sender are remembered in a bitmask
+    static const i32 WINDOW = 64;
+    struct Sender
+    {
+        u32 last;      // highest seqno seen
+        u64 seen;      // bit i set => message 'last-i' has been seen
+        i64 utime;     // time of the last observation
+    };
+    unordered_map<u64, Sender> senders;
+
+    u64 numLost = 0;
+    u64 numDuplicate = 0;
+    u64 numReordered = 0;
+};
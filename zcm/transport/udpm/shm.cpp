@@ -0,0 +1,221 @@
+#include "shm.hpp"
+
+#ifdef __linux__
+
+#include <random>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_MAGIC 0x5a434d41  // hex repr of ascii "ZCMA"
+#define SHM_HEADER_SIZE 64    // keeps the messages cache line aligned
+
+// The start of an arena. 'reserved' is only written by the sender: every
+// message before 'reserved - size' may have been overwritten
+struct ShmHeader
+{
+    u32 magic;
+    u32 pid;
+    u64 nonce;
+    u64 size;
+    u64 reserved;
+};
+
+static string shmPath(u32 pid, u64 nonce)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/zcm-udpm-%u-%016llx", pid, (unsigned long long)nonce);
+    return path;
+}
+
+// FNV-1a
+static u64 hashBytes(u64 hash, const void *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        hash ^= ((const u8*)data)[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+u64 shmHostId()
+{
+    static u64 id = 0;
+    if (id != 0)
+        return id;
+
+    // Two containers can share a kernel but not their /dev/shm
+    u64 hash = 14695981039346656037ull;
+    char bootId[64] = {};
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (f) {
+        size_t n = fread(bootId, 1, sizeof(bootId), f);
+        hash = hashBytes(hash, bootId, n);
+        fclose(f);
+    }
+    struct stat st;
+    if (stat("/dev/shm", &st) == 0) {
+        hash = hashBytes(hash, &st.st_dev, sizeof(st.st_dev));
+        hash = hashBytes(hash, &st.st_ino, sizeof(st.st_ino));
+    }
+    id = hash;
+    return id;
+}
+
+// Remove the arenas left behind by senders that died without cleaning up
+static void removeStaleArenas()
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir)
+        return;
+    while (struct dirent *ent = readdir(dir)) {
+        unsigned pid;
+        if (sscanf(ent->d_name, "zcm-udpm-%u-", &pid) != 1)
+            continue;
+        if (kill(pid, 0) < 0 && errno == ESRCH) {
+            ZCM_DEBUG("Removing the stale shm arena %s", ent->d_name);
+            unlinkat(dirfd(dir), ent->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+ShmArena::~ShmArena()
+{
+    if (map) {
+        munmap(map, mapSize);
+        unlink(path.c_str());
+    }
+}
+
+bool ShmArena::init(size_t size)
+{
+    removeStaleArenas();
+
+    std::random_device rd;
+    pid = getpid();
+    nonce = ((u64)rd() << 32) | rd();
+    path = shmPath(pid, nonce);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("udpm shm -- open");
+        return false;
+    }
+    // every local subscriber must be able to read it, regardless of the umask
+    fchmod(fd, 0644);
+
+    mapSize = SHM_HEADER_SIZE + size;
+    if (ftruncate(fd, mapSize) < 0) {
+        perror("udpm shm -- ftruncate");
+        close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+    void *p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("udpm shm -- mmap");
+        unlink(path.c_str());
+        return false;
+    }
+    map = (char*)p;
+    this->size = size;
+
+    ShmHeader *hdr = (ShmHeader*)map;
+    hdr->pid = pid;
+    hdr->nonce = nonce;
+    hdr->size = size;
+    hdr->reserved = 0;
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    ZCM_DEBUG("Created the shm arena %s (%zu bytes)", path.c_str(), size);
+    return true;
+}
+
+bool ShmArena::write(const char *data, size_t len, u64 *pos)
+{
+    if (!map || len > size / 2)
+        return false;
+
+    // messages aren't split across the end of the ring
+    u64 start = next;
+    if (start % size + len > size)
+        start += size - start % size;
+    u64 end = start + len;
+
+    // Claim the space before writing to it (a seqlock), so that a reader that
+    // copied from it in the meantime finds out
+    ShmHeader *hdr = (ShmHeader*)map;
+    __atomic_store_n(&hdr->reserved, end, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(map + SHM_HEADER_SIZE + start % size, data, len);
+
+    next = (end + 63) & ~(u64)63;
+    *pos = start;
+    return true;
+}
+
+ShmReader::~ShmReader()
+{
+    if (map)
+        munmap((void*)map, mapSize);
+}
+
+bool ShmReader::init(u32 pid, u64 nonce)
+{
+    string path = shmPath(pid, nonce);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ZCM_DEBUG("Failed to open the shm arena %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size <= SHM_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    map = (const char*)p;
+    mapSize = st.st_size;
+
+    const ShmHeader *hdr = (const ShmHeader*)map;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        hdr->nonce != nonce || hdr->size != mapSize - SHM_HEADER_SIZE) {
+        ZCM_DEBUG("Bad shm arena %s", path.c_str());
+        return false;
+    }
+    size = hdr->size;
+    ZCM_DEBUG("Mapped the shm arena %s", path.c_str());
+    return true;
+}
+
+bool ShmReader::read(u64 pos, size_t len, char *dst)
+{
+    if (len > size || pos % size + len > size)
+        return false;
+
+    const ShmHeader *hdr = (const ShmHeader*)map;
+    if (__atomic_load_n(&hdr->reserved, __ATOMIC_ACQUIRE) > pos + size)
+        return false;
+    memcpy(dst, map + SHM_HEADER_SIZE + pos % size, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr->reserved, __ATOMIC_RELAXED) <= pos + size;
+}
+
+#else // __linux__
+
+u64 shmHostId() { return 0; }
+
+ShmArena::~ShmArena() {}
+bool ShmArena::init(size_t size) { return false; }
+bool ShmArena::write(const char *data, size_t len, u64 *pos) { return false; }
+
+ShmReader::~ShmReader() {}
+bool ShmReader::init(u32 pid, u64 nonce) { return false; }
+bool ShmReader::read(u64 pos, size_t len, char *dst) { return false; }
+
+#endif // __linux__
@@ -0,0 +1,66 @@
+#pragma once
+#include "udpm.hpp"
+
+// The shared memory side channel for large messages ('shm' url option). A
+// sender copies each message that would otherwise be fragmented into its
+// arena, a ring in /dev/shm, and multicasts a small MsgHeaderShm that says
+// where it is. Receivers on the same host copy the message straight out of
+// the arena instead of reassembling it from the kernel's loopback.
+//
+// The arena never blocks the sender: a message stays readable until the
+// sender has written an arena's worth of newer messages after it. Readers
+// check that afterwards, so a message that was overwritten while it was being
+// copied is detected and dropped. Linux only.
+
+// Identifies the processes that share this host's /dev/shm
+u64 shmHostId();
+
+// Sender side: the arena, which is removed again when this is destroyed
+class ShmArena
+{
+  public:
+    ~ShmArena();
+
+    // Create an arena with room for 'size' bytes of messages
+    bool init(size_t size);
+
+    // Copy the 'len' bytes of 'data' into the arena, returning their position
+    // in 'pos'. Fails if the message is too large to stay in the arena for a
+    // while (more than half of it)
+    bool write(const char *data, size_t len, u64 *pos);
+
+    u32 getPid() const { return pid; }
+    u64 getNonce() const { return nonce; }
+
+  private:
+    string path;
+    char *map = nullptr;
+    size_t mapSize = 0;
+    size_t size = 0;
+    u32 pid = 0;
+    u64 nonce = 0;
+    u64 next = 0;       // where the next message goes
+};
+
+// Receiver side: a sender's arena, mapped read only
+class ShmReader
+{
+  public:
+    ~ShmReader();
+
+    // Map the arena of sender 'pid', which must be the one named by 'nonce'
+    bool init(u32 pid, u64 nonce);
+
+    // Copy the 'len' bytes at 'pos' to 'dst'. Returns false if they have
+    // been overwritten by newer messages
+    bool read(u64 pos, size_t len, char *dst);
+
+    size_t getSize() const { return size; }
+
+    i64 last_use_utime = 0;
+
+  private:
+    const char *map = nullptr;
+    size_t mapSize = 0;
+    size_t size = 0;
+};
@@ -2,13 +2,41 @@
 #include "buffers.hpp"
 #include "udpmsocket.hpp"
 #include "mempool.hpp"
+#include "seqtracker.hpp"
+#include "pacer.hpp"
+#include "reliable.hpp"
+#include "uring.hpp"
+#include "shm.hpp"
 
 #include "zcm/transport.h"
 #include "zcm/transport_registrar.h"
 #include "zcm/transport_register.hpp"
+#include "zcm/transport_udpm.h"
 
 #define MTU (1<<28)
 
+// dst ^= src, a word at a time
+static void xorBytes(char *dst, const char *src, size_t len)
+{
+    size_t i = 0;
+    for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+        u64 a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+static i64 utimeNow()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (i64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static i32 utimeInSeconds()
 {
     struct timeval tv;
@@ -26,6 +54,35 @@ static i32 utimeInSeconds()
  *                  don't use > 1.  that's just rude.
  * @recv_buf_size:  requested size of the kernel receive buffer, set with
  *                  SO_RCVBUF.  0 indicates to use the default settings.
+ * @send_buf_size:  requested size of the kernel send buffer, as above
+ * @auto_recv_buf:  grow the receive buffer to fit the observed traffic
+ * @auto_send_buf:  grow the send buffer to fit the largest message sent
+ * @fec_group:      if > 0, send a parity packet after every fec_group fragments
+ * @loss_inject:    fraction of received packets to drop on purpose (testing)
+ * @prewarm:        number of packets to pre-allocate pool memory for
+ * @loss_warn_secs: if > 0, warn about message loss at most this often
+ * @shards:         number of multicast groups the channels are spread over
+ * @shard_map:      channel to shard assignments that override the hash
+ * @pace_rate:      if > 0, limit fragmented sends to this many bytes/sec
+ * @pace_burst:     bytes that may be sent at full speed before pacing kicks in
+ * @reliable:       channels whose lost messages are repaired (NACK based)
+ * @reliable_window: bytes of recent reliable messages kept for repairs
+ * @busy_poll_us:   if > 0, spin on nonblocking reads for this long before
+ *                  sleeping in poll(), and set SO_BUSY_POLL on the sockets
+ * @recv_cpu:       if >= 0, pin the thread calling recvmsg() to this cpu
+ * @io_uring:       send and receive with io_uring, if the kernel supports it
+ * @unicast:        the udp:// transport: receive on the local address ip:port
+ *                  and send to each of the peers instead of a multicast group
+ * @peers:          where the unicast transport sends its packets
+ * @connect:        connect() the unicast send socket to its only peer
+ * @recv_sockets:   receive on this many sockets, each read and reassembled by
+ *                  its own thread, with the senders spread over them
+ * @partition:      if >= 0, this instance only receives, and only the senders
+ *                  of partition 'partition' of 'recv_sockets'
+ * @shm_size:       if > 0, large messages reach the receivers on this host
+ *                  through a shared memory arena of this many bytes
+ * @shm_only:       if true, they reach them only through the arena: the
+ *                  fragments aren't looped back (or sent at all with ttl=0)
  *
  */
 struct Params
@@ -35,6 +92,29 @@ struct Params
     u16            port;
     u8             ttl;
     size_t         recv_buf_size;
+    size_t         send_buf_size = 0;
+    bool           auto_recv_buf = false;
+    bool           auto_send_buf = false;
+    u16            fec_group = 0;
+    double         loss_inject = 0;
+    size_t         prewarm = 0;
+    i32            loss_warn_secs = 0;
+    u16            shards = 1;
+    unordered_map<string, u16> shard_map;
+    u64            pace_rate = 0;
+    u64            pace_burst = DEFAULT_PACE_BURST;
+    unordered_set<string> reliable;
+    size_t         reliable_window = DEFAULT_RELIABLE_WINDOW;
+    u32            busy_poll_us = 0;
+    int            recv_cpu = -1;
+    bool           io_uring = false;
+    bool           unicast = false;
+    vector<UDPMAddress> peers;
+    bool           connect = false;
+    u16            recv_sockets = 1;
+    int            partition = -1;
+    size_t         shm_size = 0;
+    bool           shm_only = false;
 
     Params(const string& ip, u16 port, size_t recv_buf_size, u8 ttl)
     {
@@ -47,50 +127,211 @@ struct Params
     }
 };
 
+/**
+ * Shard:
+ * One multicast group and port. By default there is a single shard. With the
+ * 'shards=N' url option every channel is carried on one of N groups (the base
+ * address + i and the base port + i), so a receiver only joins the groups that
+ * carry its channels and the kernel/NIC drops the rest of the traffic.
+ *
+ * Every shard sends from its own socket, so to a receiver each shard looks
+ * like an independent sender with its own msg_seqno sequence.
+ *
+ * The unicast transport (udp://) has a single shard. Its recvfd is bound to
+ * the local address in destAddr, and every packet is sent to each peer.
+ */
+struct Shard
+{
+    UDPMAddress destAddr;
+    vector<UDPMAddress> dests; // where packets go: destAddr, or the peers
+    UDPMSocket sendfd;
+    UDPMSocket recvfd;
+    u32 msg_seqno = 0;   // rolling counter of how many messages transmitted
+    bool joined = false; // whether recvfd should be open
+
+    // With reliable channels, the messages that can be repaired. Repairs are
+    // asked for (NACKs) by unicasting to sendfd
+    unique_ptr<RetransmitWindow> window;
+    i64 last_send_utime = 0;
+    i64 last_heartbeat_utime = 0;
+
+    Shard(const string& ip, u16 port) : destAddr(ip, port), dests {destAddr} {}
+};
+
 struct UDPM
 {
     Params params;
-    UDPMAddress destAddr;
 
-    UDPMSocket recvfd;
-    UDPMSocket sendfd;
+    vector<unique_ptr<Shard>> shards;
+    size_t nextShard = 0;        // where the receive loop starts polling
+    u32 closedKernelDrops = 0;   // kernel drops on recv sockets since closed
 
     /* size of the kernel UDP receive buffer */
     size_t kernel_rbuf_sz = 0;
     size_t kernel_sbuf_sz = 0;
     bool warned_about_small_kernel_buf = false;
 
+    /* automatic sizing of the kernel buffers (rcvbuf=auto, sndbuf=auto) */
+    size_t recv_buf_target = 0;      // last size requested for the recv sockets
+    size_t largest_recv_msg = 0;
+    size_t largest_send_msg = 0;     // only used by sendmsg()
+    i64    rx_window_start = 0;
+    size_t rx_window_bytes = 0;
+    size_t rx_peak_window_bytes = 0;
+
     MessagePool pool {MAX_FRAG_BUF_TOTAL_SIZE, MAX_NUM_FRAG_BUFS};
 
+    // Protects the pool and the counters below so that getStats()
+    // can be called concurrently with recvmsg()
+    mutex mut;
+
     /* other variables */
-    u32          udp_rx = 0;            // packets received and processed
-    u32          udp_discarded_bad = 0; // packets discarded because they were bad
+    u64          udp_rx = 0;            // packets received and processed
+    u64          udp_read = 0;          // packets read from the sockets, before any checks
+    u64          udp_discarded_bad = 0; // packets discarded because they were bad
                                     // somehow
-    double       udp_low_watermark = 1.0; // least buffer available
+    u64          udp_filtered = 0;      // packets dropped because their channel
+                                        // isn't enabled
+    u64          udp_parity_rx = 0;     // parity packets received
+    u64          udp_recovered = 0;     // fragments rebuilt from parity
+    u64          udp_loss_injected = 0; // packets dropped by 'loss_inject'
+    u64          udp_nacks_sent = 0;    // NACKs sent for missing messages
+    u64          udp_repaired = 0;      // missing messages that were repaired
+    u64          udp_unrecoverable = 0; // missing messages given up on
+    u64          udp_repairs_sent = 0;  // messages sent again in reply to NACKs
+    u64          udp_repairs_denied = 0;// NACKed messages that couldn't be sent again
+    u64          udp_busy_poll_hits = 0;   // packets read while spinning
+    u64          udp_busy_poll_misses = 0; // spins that ended up sleeping in poll()
+    u64          udp_recv_syscalls = 0;    // poll() and recvmsg() calls (io=sync)
+    std::atomic<u64> send_syscalls {0};    // sendmsg() calls (io=sync)
+
+    // The io_uring backend (io=uring). Without it, every packet is a system call
+    unique_ptr<UringReceiver> uringRecv;   // only used by recvmsg()
+    unique_ptr<UringSender>   uringSend;   // protected by 'sendmut'
+    u64          rng_state = 0x9e3779b97f4a7c15ull;
     i32          udp_last_report_secs = 0;
-
-    u32          msg_seqno = 0; // rolling counter of how many messages transmitted
+    u64          udp_last_report_lost = 0;
+    u32          udp_last_report_kernel_drops = 0;
+
+    // Per-sender msg_seqno tracking, for detecting loss
+    SeqTracker   seqtracker;
+
+    // Spreads out the fragments of large messages. Only used by sendmsg()
+    Pacer        pacer;
+
+    // Scratch space for computing parity packets. Protected by 'sendmut'
+    vector<char> parity_buf;
+
+    // Serializes sendmsg() and the repair thread, which share the shards'
+    // msg_seqno, the pacer and parity_buf
+    mutex sendmut;
+
+    // The reliable channels: missing messages, and the thread that answers
+    // the NACKs of other receivers and sends heartbeats
+    NackTracker  nacks;
+    std::thread  repairThread;
+    std::atomic<bool> repairRunning {false};
+
+    // Receive partitions (recv_sockets=N). This instance then only sends, and
+    // every partition is a receive-only UDPM with its own sockets, pool and
+    // loss tracking, read by its own thread. Their messages meet in 'recvq'
+    vector<unique_ptr<UDPM>> partitions;
+    vector<std::thread> partitionThreads;
+    std::atomic<bool> partitionsRunning {false};
+    mutex recvqMut;
+    condition_variable recvqCond; // signaled when recvq grows or shrinks
+    deque<pair<UDPM*, Message*>> recvq;
+
+    // The shared memory side channel (shm=<bytes>). Our arena is only used by
+    // sendmsg(), the arenas of the other senders on this host are mapped as
+    // their messages arrive and are protected by 'mut'
+    unique_ptr<ShmArena> shmArena;
+    unordered_map<u64, unique_ptr<ShmReader>> shmReaders;  // by nonce
+    std::atomic<u64> shm_sent {0};
+    u64          udp_shm_rx = 0;        // messages read from the arenas
+    u64          udp_shm_lost = 0;      // messages that couldn't be read from them
 
     /***** Methods ******/
-    UDPM(const string& ip, u16 port, size_t recv_buf_size, u8 ttl);
+    UDPM(const Params& params);
     bool init();
     ~UDPM();
 
     int handle();
 
     int sendmsg(zcm_msg_t msg);
+    int recvmsgEnable(const char *channel, bool enable);
     int recvmsg(zcm_msg_t *msg, int timeout);
 
+    void getStats(zcm_udpm_stats_t *stats);
+
   private:
     // These returns non-null when a full message has been received
     Message *recvShort(Packet *pkt, u32 sz);
-    Message *recvFragment(Packet *pkt, u32 sz);
+    Message *recvFragment(UDPMSocket& sock, Packet *pkt, u32 sz);
+    Message *recvParity(Packet *pkt, u32 sz);
+    Message *recvShm(Packet *pkt, u32 sz);
+    ShmReader *lookupShmArena(u32 pid, u64 nonce);
+    Message *completeMessage(FragBuf *fbuf);
+    bool recoverFragment(FragBuf *fbuf, u16 group);
+    void recvControl(Packet *pkt, u32 sz);
+    int sendMessage(Shard& shard, u32 seqno, const zcm_msg_t& msg);
+    int sendShm(Shard& shard, u32 seqno, const zcm_msg_t& msg, u64 pos);
+    void sendParity(Shard& shard, u32 seqno, const zcm_msg_t& msg, size_t channel_size,
+                    u16 nfragments, u16 group);
+    ssize_t sendPacket(Shard& shard, const char *a, size_t alen, const char *b, size_t blen,
+                       const char *c = NULL, size_t clen = 0);
+    bool flushPackets();
+    void pace(Shard& shard, size_t bytes);
+    void sendControl(UDPMSocket& sock, const UDPMAddress& dest, u32 magic,
+                     u32 seqno, u32 count, u32 reason);
+    double randomUniform();
     Message *readMessage(int timeout);
 
     Message *m = nullptr;
+    UDPM *mOwner = nullptr;      // the partition 'm' came from, if any
+
+    // The thread that was pinned to params.recv_cpu. Only used by recvmsg()
+    std::thread::id pinnedThread;
+    void pinRecvThread();
+
+    // The channels enabled with recvmsgEnable(). Traffic on any other channel is
+    // dropped before it is reassembled or copied. Each exact channel is counted
+    // once per enable, as several subscriptions may share it. Protected by 'mut'
+    bool recvAllChannels = false;
+    unordered_map<string, int> recvChannels;
+    vector<pair<string, std::regex>> recvRegexes;
+    unordered_map<string, bool> channelEnabledCache;
+    bool isChannelEnabled(const char *channel);
+
+    u16 wirePort(u16 port);
+    size_t shardFor(const char *channel);
+    bool openRecvSocket(Shard& shard);
+    void applyRecvBufSize(UDPMSocket& sock, size_t size);
+    void autoTuneRecvBuf(Packet *pkt, u32 sz);
+    void autoTuneSendBuf(size_t msglen);
+    bool updateShards();
+    u32 getKernelDrops();
 
     bool selftest();
     void checkForMessageLoss();
+
+    bool isReliable() const { return !params.reliable.empty(); }
+    bool isRepair(const struct sockaddr_in *from, u32 seqno);
+    bool observeMessage(const struct sockaddr_in *from, u32 seqno, i64 utime);
+    void dropStaleFragBuf(FragBuf *fbuf);
+    void resolveNack(const struct sockaddr_in *from, u32 seqno);
+    void processNacks();
+    void runRepairs();
+    void handleNack(Shard& shard, const struct sockaddr_in& from, MsgHeaderControl *hdr);
+    void sendHeartbeats();
+
+    bool isPartition() const { return params.partition >= 0; }
+    // Whether this instance has receive sockets of its own
+    bool receives() const { return params.recv_sockets == 1 || isPartition(); }
+    bool startPartitions();
+    void runPartition(UDPM *part);
+    int recvPartitioned(zcm_msg_t *msg, int timeout);
+    void releaseMessage(Message *msg);
 };
 
 Message *UDPM::recvShort(Packet *pkt, u32 sz)
@@ -106,6 +347,18 @@ Message *UDPM::recvShort(Packet *pkt, u32 sz)
 
     udp_rx++;
 
+    struct sockaddr_in *from = (struct sockaddr_in*)&pkt->from;
+    if (!observeMessage(from, hdr->getMsgSeqno(), pkt->utime)) {
+        ZCM_DEBUG("dropping duplicate message");
+        return NULL;
+    }
+    resolveNack(from, hdr->getMsgSeqno());
+
+    if (!isChannelEnabled(hdr->getChannelPtr())) {
+        udp_filtered++;
+        return NULL;
+    }
+
     Message *msg = pool.allocMessageEmpty();
     msg->utime = pkt->utime;
     msg->channel = hdr->getChannelPtr();
@@ -117,9 +370,13 @@ Message *UDPM::recvShort(Packet *pkt, u32 sz)
     return msg;
 }
 
-Message *UDPM::recvFragment(Packet *pkt, u32 sz)
+Message *UDPM::recvFragment(UDPMSocket& sock, Packet *pkt, u32 sz)
 {
     MsgHeaderLong *hdr = pkt->asHeaderLong();
+    if (sz < sizeof(MsgHeaderLong)) {
+        udp_discarded_bad++;
+        return NULL;
+    }
 
     // any existing fragment buffer for this message source?
     FragBuf *fbuf = pool.lookupFragBuf((struct sockaddr_in*)&pkt->from);
@@ -132,11 +389,34 @@ Message *UDPM::recvFragment(Packet *pkt, u32 sz)
     u32 frag_size = hdr->getFragmentSize(sz);
     char *data_start = hdr->getDataPtr();
 
+    // the first packet seen of each message is used for loss tracking, and any
+    // late fragment of a message we've already seen is dropped
+    if (!fbuf || fbuf->msg_seqno != msg_seqno) {
+        // the fragments of a message that was already read from its
+        // sender's shm arena, which aren't duplicates worth counting
+        if (!shmReaders.empty() && !isRepair((struct sockaddr_in*)&pkt->from, msg_seqno) &&
+            seqtracker.hasSeen((struct sockaddr_in*)&pkt->from, msg_seqno))
+            return NULL;
+        if (!observeMessage((struct sockaddr_in*)&pkt->from, msg_seqno, pkt->utime)) {
+            ZCM_DEBUG("dropping fragment of an old message");
+            return NULL;
+        }
+    }
+
+    // drop the rest of a message whose channel isn't enabled
+    if (fbuf && fbuf->discard && fbuf->msg_seqno == msg_seqno) {
+        udp_filtered++;
+        fbuf->last_packet_utime = pkt->utime;
+        if (--fbuf->fragments_remaining == 0)
+            pool.removeFragBuf(fbuf);
+        return NULL;
+    }
+
     // discard any stale fragments from previous messages
     if (fbuf && ((fbuf->msg_seqno != msg_seqno) ||
-                 (fbuf->buf.size != data_size + fbuf->channellen+1))) {
-        pool.removeFragBuf(fbuf);
-        ZCM_DEBUG("Dropping message (missing %d fragments)", fbuf->fragments_remaining);
+                 (fbuf->data_size != data_size) ||
+                 (fbuf->fragments_in_msg != fragments_in_msg))) {
+        dropStaleFragBuf(fbuf);
         fbuf = NULL;
     }
 
@@ -145,52 +425,339 @@ Message *UDPM::recvFragment(Packet *pkt, u32 sz)
         return NULL;
     }
 
-    // create a new fragment buffer if necessary
-    if (!fbuf && fragment_no == 0) {
-        char *channel = (char*) (hdr + 1);
-        int channel_sz = strlen(channel);
-        if (channel_sz > ZCM_CHANNEL_MAXLEN) {
+    if (fragment_no >= fragments_in_msg) {
+        ZCM_DEBUG("dropping invalid fragment (%d of %d)", fragment_no, fragments_in_msg);
+        udp_discarded_bad++;
+        return NULL;
+    }
+
+    // fragment 0 carries the NULL-terminated channel ahead of its data
+    const char *channel = NULL;
+    size_t channel_sz = 0;
+    if (fragment_no == 0) {
+        channel = data_start;
+        channel_sz = strnlen(channel, std::min((size_t)frag_size, (size_t)ZCM_CHANNEL_MAXLEN+1));
+        if (channel_sz > ZCM_CHANNEL_MAXLEN || channel_sz == frag_size ||
+            (fbuf && fbuf->fec_group > 0 && fbuf->channellen != channel_sz)) {
             ZCM_DEBUG("bad channel name length");
             udp_discarded_bad++;
             return NULL;
         }
+        data_start += channel_sz + 1;
+        frag_size -= channel_sz + 1;
+
+        // Not subscribed: drop this message without allocating or copying
+        // anything more. Any fragments that beat fragment 0 here are released.
+        if (!isChannelEnabled(channel)) {
+            udp_filtered++;
+            resolveNack((struct sockaddr_in*)&pkt->from, msg_seqno);
+            u16 remaining = fragments_in_msg - 1;
+            if (fbuf) {
+                remaining = fbuf->fragments_remaining - 1;
+                pool.removeFragBuf(fbuf);
+            }
+            if (remaining > 0) {
+                fbuf = pool.addDiscardFragBuf();
+                fbuf->last_packet_utime = pkt->utime;
+                fbuf->msg_seqno = msg_seqno;
+                fbuf->data_size = data_size;
+                fbuf->fragments_in_msg = fragments_in_msg;
+                fbuf->fragments_remaining = remaining;
+                fbuf->from = *(struct sockaddr_in*)&pkt->from;
+            }
+            return NULL;
+        }
+    }
 
-        fbuf = pool.addFragBuf(channel_sz + 1 + data_size);
-        fbuf->last_packet_utime = pkt->utime;
+    if ((u64)fragment_offset + frag_size > data_size) {
+        ZCM_DEBUG("dropping invalid fragment (off: %d, %d / %d)",
+                fragment_offset, frag_size, data_size);
+        if (fbuf)
+            pool.removeFragBuf(fbuf);
+        return NULL;
+    }
+
+    // create a new fragment buffer on the first fragment seen, whichever it is
+    if (!fbuf) {
+        fbuf = pool.addFragBuf(data_size, fragments_in_msg);
         fbuf->msg_seqno = msg_seqno;
+        fbuf->data_size = data_size;
+        fbuf->fragments_in_msg = fragments_in_msg;
         fbuf->fragments_remaining = fragments_in_msg;
-        fbuf->channellen = channel_sz;
         fbuf->from = *(struct sockaddr_in*)&pkt->from;
-        memcpy(fbuf->buf.data, data_start, frag_size);
+    }
 
-        --fbuf->fragments_remaining;
+    if (fbuf->hasFragment(fragment_no)) {
+        ZCM_DEBUG("dropping duplicate fragment (%d of %d)", fragment_no, fragments_in_msg);
         return NULL;
     }
 
-    if (!fbuf) return NULL;
-    recvfd.checkAndWarnAboutSmallBuffer(data_size, kernel_rbuf_sz);
+    sock.checkAndWarnAboutSmallBuffer(data_size, kernel_rbuf_sz);
 
-    if (fbuf->channellen+1 + fragment_offset + frag_size > fbuf->buf.size) {
-        ZCM_DEBUG("dropping invalid fragment (off: %d, %d / %zu)",
-                fragment_offset, frag_size, fbuf->buf.size);
-        pool.removeFragBuf(fbuf);
+    // copy data
+    if (channel)
+        fbuf->setChannel(channel, channel_sz);
+    memcpy(fbuf->getDataPtr() + fragment_offset, data_start, frag_size);
+    fbuf->markFragment(fragment_no);
+
+    fbuf->last_packet_utime = pkt->utime;
+    fbuf->fragments_remaining--;
+
+    // this fragment may leave a single fragment of its group missing, which
+    // can be rebuilt if the group's parity arrived
+    if (fbuf->fec_group > 0 && !recoverFragment(fbuf, fragment_no / fbuf->fec_group))
+        return NULL;
+
+    return completeMessage(fbuf);
+}
+
+Message *UDPM::recvParity(Packet *pkt, u32 sz)
+{
+    MsgHeaderParity *hdr = pkt->asHeaderParity();
+    if (sz < sizeof(MsgHeaderParity)) {
+        udp_discarded_bad++;
         return NULL;
     }
 
-    // copy data
-    memcpy(fbuf->buf.data + fbuf->channellen+1 + fragment_offset, data_start, frag_size);
+    u32 msg_seqno = hdr->getMsgSeqno();
+    u32 data_size = hdr->getMsgSize();
+    u32 fragment_size = hdr->getFragmentSize();
+    u16 fragments_in_msg = hdr->getFragmentsInMsg();
+    u16 group_no = hdr->getGroupNo();
+    u8 group_size = hdr->getGroupSize();
+    u8 channel_len = hdr->getChannelLen();
+    u32 parity_size = hdr->getParitySize(sz);
+
+    // the header fully describes how the message was fragmented, check that it
+    // is consistent before trusting any of it
+    u64 stream_size = (u64)channel_len + 1 + data_size;
+    if (channel_len > ZCM_CHANNEL_MAXLEN || data_size > MTU || group_size == 0 ||
+        fragment_size <= (u32)channel_len + 1 ||
+        (stream_size + fragment_size - 1) / fragment_size != fragments_in_msg ||
+        (u32)group_no * group_size >= fragments_in_msg ||
+        parity_size != std::min((u64)fragment_size,
+                                stream_size - (u64)group_no * group_size * fragment_size)) {
+        ZCM_DEBUG("dropping invalid parity packet");
+        udp_discarded_bad++;
+        return NULL;
+    }
+    udp_parity_rx++;
+
+    struct sockaddr_in *from = (struct sockaddr_in*)&pkt->from;
+    FragBuf *fbuf = pool.lookupFragBuf(from);
+    if (!fbuf || fbuf->msg_seqno != msg_seqno) {
+        // the parity of a group usually arrives after the message completed
+        if (!isRepair(from, msg_seqno) && seqtracker.hasSeen(from, msg_seqno))
+            return NULL;
+        observeMessage(from, msg_seqno, pkt->utime);
+
+        if (fbuf) {
+            dropStaleFragBuf(fbuf);
+            fbuf = NULL;
+        }
+    }
+
+    if (fbuf && fbuf->discard)
+        return NULL;
+
+    if (fbuf && (fbuf->data_size != data_size || fbuf->fragments_in_msg != fragments_in_msg)) {
+        ZCM_DEBUG("dropping parity packet that doesn't match its message");
+        udp_discarded_bad++;
+        return NULL;
+    }
+
+    if (!fbuf) {
+        fbuf = pool.addFragBuf(data_size, fragments_in_msg);
+        fbuf->msg_seqno = msg_seqno;
+        fbuf->data_size = data_size;
+        fbuf->fragments_in_msg = fragments_in_msg;
+        fbuf->fragments_remaining = fragments_in_msg;
+        fbuf->from = *from;
+    }
+
+    if (fbuf->fec_group == 0) {
+        if (fbuf->has_channel && fbuf->channellen != channel_len) {
+            ZCM_DEBUG("dropping parity packet that doesn't match its message");
+            udp_discarded_bad++;
+            return NULL;
+        }
+        fbuf->channellen = channel_len;
+        pool.allocParity(fbuf, group_size, fragment_size);
+    } else if (fbuf->fec_group != group_size || fbuf->fec_fragment_size != fragment_size ||
+               fbuf->channellen != channel_len) {
+        ZCM_DEBUG("dropping parity packet that doesn't match its message");
+        udp_discarded_bad++;
+        return NULL;
+    }
 
     fbuf->last_packet_utime = pkt->utime;
-    if (--fbuf->fragments_remaining > 0)
+    if (fbuf->parity_received[group_no])
         return NULL;
+    memcpy(fbuf->parity.data + (size_t)group_no * fragment_size, hdr->getDataPtr(), parity_size);
+    fbuf->parity_received[group_no] = true;
+
+    if (!recoverFragment(fbuf, group_no))
+        return NULL;
+    return completeMessage(fbuf);
+}
+
+// A large message from a sender on this host, copied out of its shm arena
+Message *UDPM::recvShm(Packet *pkt, u32 sz)
+{
+    MsgHeaderShm *hdr = pkt->asHeaderShm();
+    if (sz <= sizeof(*hdr)) {
+        udp_discarded_bad++;
+        return NULL;
+    }
+
+    // other hosts get the fragments of the message instead
+    if (hdr->getHost() != shmHostId())
+        return NULL;
+
+    size_t clen = strnlen(hdr->getChannelPtr(), sz - sizeof(*hdr));
+    if (clen > ZCM_CHANNEL_MAXLEN || clen == sz - sizeof(*hdr)) {
+        ZCM_DEBUG("bad channel name length");
+        udp_discarded_bad++;
+        return NULL;
+    }
+
+    struct sockaddr_in *from = (struct sockaddr_in*)&pkt->from;
+    u32 seqno = hdr->getMsgSeqno();
+    if (!isChannelEnabled(hdr->getChannelPtr())) {
+        if (observeMessage(from, seqno, pkt->utime))
+            resolveNack(from, seqno);
+        udp_filtered++;
+        return NULL;
+    }
+    if (!isRepair(from, seqno) && seqtracker.hasSeen(from, seqno)) {
+        ZCM_DEBUG("dropping duplicate message");
+        return NULL;
+    }
+
+    ShmReader *arena = lookupShmArena(hdr->getPid(), hdr->getNonce());
+    u32 size = hdr->getMsgSize();
+    if (!arena || size > arena->getSize()) {
+        udp_shm_lost++;
+        return NULL;
+    }
+
+    Buffer buf = pool.allocBuffer(clen + 1 + size);
+    if (!arena->read(hdr->getPos(), size, buf.data + clen + 1)) {
+        ZCM_DEBUG("message %u was overwritten in the shm arena before it was read", seqno);
+        pool.freeBuffer(buf);
+        udp_shm_lost++;
+        return NULL;
+    }
+    memcpy(buf.data, hdr->getChannelPtr(), clen + 1);
+    // the message only counts as seen once it has been read: unless the
+    // sender uses shm_only, its fragments follow and are the fallback
+    observeMessage(from, seqno, pkt->utime);
+    resolveNack(from, seqno);
+    udp_shm_rx++;
+
+    Message *msg = pool.allocMessageEmpty();
+    msg->utime = pkt->utime;
+    pool.moveBuffer(msg->buf, buf);
+    msg->channel = msg->buf.data;
+    msg->channellen = clen;
+    msg->data = msg->buf.data + clen + 1;
+    msg->datalen = size;
+    return msg;
+}
+
+ShmReader *UDPM::lookupShmArena(u32 pid, u64 nonce)
+{
+    i64 now = utimeNow();
+    auto it = shmReaders.find(nonce);
+    if (it == shmReaders.end()) {
+        // unmap the arenas of senders that have gone quiet
+        for (auto i = shmReaders.begin(); i != shmReaders.end(); ) {
+            if (now - i->second->last_use_utime > (i64)SENDER_TIMEOUT_SECS * 1000000)
+                i = shmReaders.erase(i);
+            else
+                i++;
+        }
+
+        unique_ptr<ShmReader> reader(new ShmReader());
+        if (!reader->init(pid, nonce))
+            return nullptr;
+        it = shmReaders.emplace(nonce, std::move(reader)).first;
+    }
+    it->second->last_use_utime = now;
+    return it->second.get();
+}
+
+// Rebuild the missing fragment of 'group' from the group's parity, if exactly
+// one is missing. Returns false if the rebuilt data was bad, in which case the
+// whole message is dropped
+bool UDPM::recoverFragment(FragBuf *fbuf, u16 group)
+{
+    if (!fbuf->parity_received[group])
+        return true;
+
+    size_t fs = fbuf->fec_fragment_size;
+    size_t first = (size_t)group * fbuf->fec_group;
+    size_t end = std::min((size_t)fbuf->fragments_in_msg, first + fbuf->fec_group);
+    size_t missing = end;
+    for (size_t i = first; i < end; i++) {
+        if (!fbuf->hasFragment(i)) {
+            if (missing != end)
+                return true;
+            missing = i;
+        }
+    }
+    if (missing == end)
+        return true;
+
+    // the missing fragment is the parity XOR every other fragment of the group
+    char *stream = fbuf->getStreamPtr();
+    size_t stream_size = fbuf->getStreamSize();
+    char *dst = stream + missing * fs;
+    size_t len = std::min(fs, stream_size - missing * fs);
+    memcpy(dst, fbuf->parity.data + (size_t)group * fs, len);
+    for (size_t i = first; i < end; i++)
+        if (i != missing)
+            xorBytes(dst, stream + i * fs, std::min(len, stream_size - i * fs));
+
+    if (missing == 0) {
+        if (memchr(dst, '\0', fbuf->channellen + 1) != dst + fbuf->channellen) {
+            ZCM_DEBUG("Dropping message (bad channel rebuilt from parity)");
+            udp_discarded_bad++;
+            pool.removeFragBuf(fbuf);
+            return false;
+        }
+        fbuf->has_channel = true;
+        fbuf->channel_recovered = true;
+    }
+
+    ZCM_DEBUG("Rebuilt fragment %zu of %d from parity", missing, fbuf->fragments_in_msg);
+    fbuf->markFragment(missing);
+    fbuf->fragments_remaining--;
+    udp_recovered++;
+    return true;
+}
+
+// Returns a new Message once all of the fragments of 'fbuf' are in
+Message *UDPM::completeMessage(FragBuf *fbuf)
+{
+    if (fbuf->fragments_remaining > 0)
+        return NULL;
+    resolveNack(&fbuf->from, fbuf->msg_seqno);
+
+    // a rebuilt fragment 0 never went through the channel filtering
+    assert(fbuf->has_channel);
+    if (fbuf->channel_recovered && !isChannelEnabled(fbuf->getChannelPtr())) {
+        udp_filtered++;
+        pool.removeFragBuf(fbuf);
+        return NULL;
+    }
 
-    // we've received all the fragments, return a new Message
     Message *msg = pool.allocMessageEmpty();
     msg->utime = fbuf->last_packet_utime;
-    msg->channel = fbuf->buf.data;
+    msg->channel = fbuf->getChannelPtr();
     msg->channellen = fbuf->channellen;
-    msg->data = fbuf->buf.data + fbuf->channellen + 1;
-    msg->datalen = fbuf->buf.size - (fbuf->channellen + 1);
+    msg->data = fbuf->getDataPtr();
+    msg->datalen = fbuf->data_size;
     pool.moveBuffer(msg->buf, fbuf->buf);
 
     // don't need the fragment buffer anymore
@@ -199,58 +766,524 @@ Message *UDPM::recvFragment(Packet *pkt, u32 sz)
     return msg;
 }
 
+// Whether message 'seqno' is the repair of a message this transport asked for
+bool UDPM::isRepair(const struct sockaddr_in *from, u32 seqno)
+{
+    return isReliable() && nacks.isPending(from, seqno);
+}
+
+// Track the first packet seen of message 'seqno'. Returns false if the message
+// was already received. With reliable channels, any messages skipped over are
+// asked for again
+bool UDPM::observeMessage(const struct sockaddr_in *from, u32 seqno, i64 utime)
+{
+    if (isRepair(from, seqno))
+        return true;
+
+    u32 missed;
+    if (seqtracker.observe(from, seqno, utime, &missed) == SeqTracker::DUPLICATE)
+        return false;
+
+    if (isReliable())
+        for (u32 i = std::min(missed, (u32)RELIABLE_HISTORY); i > 0; i--)
+            nacks.add(from, seqno - i, utime);
+    return true;
+}
+
+// Drop the partial message in 'fbuf' because another message from the same
+// sender started. With reliable channels it is asked for again
+void UDPM::dropStaleFragBuf(FragBuf *fbuf)
+{
+    if (!fbuf->discard) {
+        ZCM_DEBUG("Dropping message (missing %d fragments)", fbuf->fragments_remaining);
+        if (isReliable())
+            nacks.add(&fbuf->from, fbuf->msg_seqno, fbuf->last_packet_utime);
+    }
+    pool.removeFragBuf(fbuf);
+}
+
+// Message 'seqno' has been fully received (or filtered out)
+void UDPM::resolveNack(const struct sockaddr_in *from, u32 seqno)
+{
+    if (isReliable() && nacks.resolve(from, seqno)) {
+        ZCM_DEBUG("Message %u was repaired", seqno);
+        udp_repaired++;
+    }
+}
+
+// Send the NACKs that are due. Must be called with 'mut' held
+void UDPM::processNacks()
+{
+    if (nacks.empty())
+        return;
+
+    // A unicast sender may have connected its socket to our receive address,
+    // so NACKs have to come from there
+    UDPMSocket& sock = params.unicast ? shards[0]->recvfd : shards[0]->sendfd;
+    u64 gaveUp = nacks.poll(utimeNow(), [&](const struct sockaddr_in *sender, u32 seqno, u32 count) {
+        ZCM_DEBUG("Asking for %u messages starting at %u", count, seqno);
+        sendControl(sock, UDPMAddress(*sender), ZCM_MAGIC_NACK, seqno, count, 0);
+        udp_nacks_sent++;
+    });
+    if (gaveUp > 0)
+        ZCM_DEBUG("Gave up on %llu missing messages", (unsigned long long)gaveUp);
+    udp_unrecoverable += gaveUp;
+}
+
+// DENY and HEARTBEAT packets from the senders of reliable channels
+void UDPM::recvControl(Packet *pkt, u32 sz)
+{
+    if (sz < sizeof(MsgHeaderControl)) {
+        udp_discarded_bad++;
+        return;
+    }
+    if (!isReliable())
+        return;
+
+    MsgHeaderControl *hdr = pkt->asHeaderControl();
+    struct sockaddr_in *from = (struct sockaddr_in*)&pkt->from;
+    u32 seqno = hdr->getMsgSeqno();
+
+    if (hdr->getMagic() == ZCM_MAGIC_DENY) {
+        u32 count = std::min(hdr->getCount(), (u32)NACK_MAX_RANGE);
+        for (u32 i = 0; i < count; i++) {
+            // messages on best effort channels were never going to be repaired
+            if (nacks.resolve(from, seqno + i) && hdr->getReason() != RetransmitWindow::UNRELIABLE) {
+                ZCM_DEBUG("Message %u can't be repaired", seqno + i);
+                udp_unrecoverable++;
+            }
+        }
+        return;
+    }
+
+    // A heartbeat: the last messages the sender sent may all have been lost
+    if (!seqtracker.hasSeen(from, seqno)) {
+        u32 missed;
+        if (seqtracker.observe(from, seqno, pkt->utime, &missed) == SeqTracker::NEXT)
+            for (u32 i = std::min(missed + 1, (u32)RELIABLE_HISTORY); i > 0; i--)
+                nacks.add(from, seqno + 1 - i, pkt->utime);
+    }
+
+    // ... or the last fragments of its last message
+    FragBuf *fbuf = pool.lookupFragBuf(from);
+    if (fbuf && !fbuf->discard && pkt->utime - fbuf->last_packet_utime > NACK_DELAY_US)
+        nacks.add(from, fbuf->msg_seqno, fbuf->last_packet_utime);
+}
+
+static bool isRegexChannel(const string& channel)
+{
+    // These chars are considered regex
+    auto isRegexChar = [](char c) {
+        return c == '(' || c == ')' || c == '|' ||
+        c == '.' || c == '*' || c == '+';
+    };
+
+    for (auto& c : channel)
+        if (isRegexChar(c))
+            return true;
+
+    return false;
+}
+
+bool UDPM::isChannelEnabled(const char *channel)
+{
+    if (recvAllChannels)
+        return true;
+    if (recvChannels.empty() && recvRegexes.empty())
+        return false;
+
+    string chan {channel};
+    if (recvChannels.count(chan))
+        return true;
+    if (recvRegexes.empty())
+        return false;
+
+    // Regex matching is slow, so remember the answer for each channel we see
+    auto it = channelEnabledCache.find(chan);
+    if (it != channelEnabledCache.end())
+        return it->second;
+
+    bool enabled = false;
+    for (auto& r : recvRegexes) {
+        if (std::regex_match(chan, r.second)) {
+            enabled = true;
+            break;
+        }
+    }
+
+    if (channelEnabledCache.size() > MAX_CHANNEL_CACHE_SIZE)
+        channelEnabledCache.clear();
+    channelEnabledCache.emplace(std::move(chan), enabled);
+    return enabled;
+}
+
+int UDPM::recvmsgEnable(const char *channel, bool enable)
+{
+    if (!partitions.empty()) {
+        int ret = ZCM_EOK;
+        for (auto& part : partitions) {
+            int err = part->recvmsgEnable(channel, enable);
+            if (err != ZCM_EOK)
+                ret = err;
+        }
+        return ret;
+    }
+
+    unique_lock<mutex> lk(mut);
+    channelEnabledCache.clear();
+
+    if (channel == NULL) {
+        recvAllChannels = enable;
+        return updateShards() ? ZCM_EOK : ZCM_ECONNECT;
+    }
+
+    string chan {channel};
+    if (!isRegexChannel(chan)) {
+        if (enable) {
+            recvChannels[chan]++;
+        } else {
+            auto it = recvChannels.find(chan);
+            if (it != recvChannels.end() && --it->second <= 0)
+                recvChannels.erase(it);
+        }
+        return updateShards() ? ZCM_EOK : ZCM_ECONNECT;
+    }
+
+    auto it = std::find_if(recvRegexes.begin(), recvRegexes.end(),
+                           [&](const pair<string, std::regex>& r) { return r.first == chan; });
+    if (enable && it == recvRegexes.end()) {
+        try {
+            recvRegexes.emplace_back(chan, std::regex(chan));
+        } catch (const std::regex_error& e) {
+            ZCM_DEBUG("invalid channel regex: %s", channel);
+            return ZCM_EINVALID;
+        }
+    } else if (!enable && it != recvRegexes.end()) {
+        recvRegexes.erase(it);
+    }
+    return updateShards() ? ZCM_EOK : ZCM_ECONNECT;
+}
+
+// The port to bind and send to for a url port. udpm has always put the url
+// port into sin_port as is, so multicast keeps doing that to stay compatible
+// with existing peers. The unicast transport uses the port it was given
+u16 UDPM::wirePort(u16 port)
+{
+    return params.unicast ? port : ntohs(port);
+}
+
+size_t UDPM::shardFor(const char *channel)
+{
+    if (shards.size() == 1)
+        return 0;
+
+    if (!params.shard_map.empty()) {
+        auto it = params.shard_map.find(channel);
+        if (it != params.shard_map.end())
+            return it->second;
+    }
+
+    // FNV-1a, so every process maps a channel to the same shard
+    u32 hash = 2166136261u;
+    for (const char *c = channel; *c; c++) {
+        hash ^= (u8)*c;
+        hash *= 16777619u;
+    }
+    return hash % shards.size();
+}
+
+bool UDPM::openRecvSocket(Shard& shard)
+{
+    u32 nparts = isPartition() ? params.recv_sockets : 1;
+    if (params.unicast) {
+        ZCM_DEBUG("Receiving on %s:%d",
+                  shard.destAddr.getIP().c_str(), shard.destAddr.getPort());
+        shard.recvfd = UDPMSocket::createUnicastRecvSocket(shard.destAddr.getInAddr(),
+                                                           shard.destAddr.getPort(), nparts);
+    } else {
+        ZCM_DEBUG("Joining multicast group %s:%d",
+                  shard.destAddr.getIP().c_str(), shard.destAddr.getPort());
+        shard.recvfd = UDPMSocket::createRecvSocket(shard.destAddr.getInAddr(),
+                                                    shard.destAddr.getPort());
+        if (nparts > 1 && !shard.recvfd.filterPartition(params.partition, nparts))
+            shard.recvfd.close();
+    }
+    if (!shard.recvfd.isOpen())
+        return false;
+
+    size_t size = params.auto_recv_buf ? recv_buf_target : params.recv_buf_size;
+    if (size > 0)
+        applyRecvBufSize(shard.recvfd, size);
+    if (params.busy_poll_us > 0)
+        shard.recvfd.setBusyPoll(params.busy_poll_us);
+    kernel_rbuf_sz = shard.recvfd.getRecvBufSize();
+
+    // auto mode only ever grows the buffer past the system default
+    if (params.auto_recv_buf)
+        recv_buf_target = std::max(recv_buf_target, kernel_rbuf_sz / 2);
+    return true;
+}
+
+void UDPM::applyRecvBufSize(UDPMSocket& sock, size_t size)
+{
+    sock.setRecvBufSize(size);
+    size_t effective = sock.getRecvBufSize() / 2;
+    if (effective < size && !warned_about_small_kernel_buf) {
+        warned_about_small_kernel_buf = true;
+        fprintf(stderr,
+                "ZCM Warning: requested a %zu byte UDP receive buffer, but the kernel "
+                "limited it to %zu bytes.\n"
+                "Raise net.core.rmem_max or give the process CAP_NET_ADMIN.\n",
+                size, effective);
+    }
+}
+
+// Must be called with 'mut' held
+void UDPM::autoTuneRecvBuf(Packet *pkt, u32 sz)
+{
+    // A fragment carries the size of its whole message, which is only
+    // trusted if the header passes the checks recvFragment() makes: a bogus
+    // packet must not be able to blow the buffers up
+    size_t msgsz = sz;
+    if (sz >= sizeof(MsgHeaderLong) && pkt->asHeaderShort()->getMagic() == ZCM_MAGIC_LONG) {
+        MsgHeaderLong *hdr = pkt->asHeaderLong();
+        u32 data_size = hdr->getMsgSize();
+        u64 end = (u64)hdr->getFragmentOffset() + hdr->getFragmentSize(sz);
+        // fragment 0 also carries the channel
+        if (hdr->getFragmentNo() == 0)
+            end -= std::min(end, (u64)ZCM_CHANNEL_MAXLEN + 1);
+        if (data_size <= MTU && hdr->getFragmentNo() < hdr->getFragmentsInMsg() &&
+            end <= data_size)
+            msgsz = data_size;
+    }
+    largest_recv_msg = std::max(largest_recv_msg, msgsz);
+
+    if (pkt->utime - rx_window_start > AUTO_BUF_WINDOW_US) {
+        rx_window_start = pkt->utime;
+        rx_window_bytes = 0;
+    }
+    rx_window_bytes += sz;
+    rx_peak_window_bytes = std::max(rx_peak_window_bytes, rx_window_bytes);
+
+    size_t wanted = std::max(AUTO_BUF_MSGS * largest_recv_msg, rx_peak_window_bytes);
+    if (wanted <= recv_buf_target || recv_buf_target >= AUTO_BUF_MAX_SIZE)
+        return;
+
+    // grow geometrically so that a slowly rising rate doesn't cause a resize
+    // on every packet
+    recv_buf_target = std::min((size_t)AUTO_BUF_MAX_SIZE, std::max(wanted, 2 * recv_buf_target));
+    ZCM_DEBUG("Growing the receive buffers to %zu bytes", recv_buf_target);
+    for (auto& shard : shards) {
+        if (shard->recvfd.isOpen()) {
+            applyRecvBufSize(shard->recvfd, recv_buf_target);
+            kernel_rbuf_sz = shard->recvfd.getRecvBufSize();
+        }
+    }
+}
+
+void UDPM::autoTuneSendBuf(size_t msglen)
+{
+    if (msglen <= largest_send_msg)
+        return;
+    largest_send_msg = msglen;
+
+    // room for a couple of the largest message, so a burst of fragments doesn't
+    // block the sender
+    size_t wanted = std::min((size_t)AUTO_BUF_MAX_SIZE, 2 * msglen);
+    if (wanted <= kernel_sbuf_sz / 2)
+        return;
+
+    ZCM_DEBUG("Growing the send buffers to %zu bytes", wanted);
+    size_t effective = 0;
+    for (auto& shard : shards) {
+        shard->sendfd.setSendBufSize(wanted);
+        effective = shard->sendfd.getSendBufSize();
+    }
+    unique_lock<mutex> lk(mut);
+    kernel_sbuf_sz = effective;
+}
+
+// Join the groups that carry the enabled channels. Regexes can match channels
+// on any shard, so they require all of them. Must be called with 'mut' held
+bool UDPM::updateShards()
+{
+    // the only group is always joined, and the partitions join their own
+    if (shards.size() == 1 || !receives())
+        return true;
+
+    bool all = recvAllChannels || !recvRegexes.empty();
+    vector<bool> wanted(shards.size(), all);
+    if (!all)
+        for (auto& chan : recvChannels)
+            wanted[shardFor(chan.first.c_str())] = true;
+
+    bool ok = true;
+    for (size_t i = 0; i < shards.size(); i++) {
+        Shard& shard = *shards[i];
+        shard.joined = wanted[i];
+        // Sockets are only opened here. The receive loop may be waiting on
+        // them, so it is the one that closes sockets that are no longer needed
+        if (shard.joined && !shard.recvfd.isOpen() && !openRecvSocket(shard)) {
+            shard.joined = false;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+u32 UDPM::getKernelDrops()
+{
+    // a partition may go without packets, and so without drop counts, for long
+    u32 drops = closedKernelDrops;
+    for (auto& shard : shards)
+        drops += isPartition() ? shard->recvfd.queryKernelDrops()
+                               : shard->recvfd.getKernelDrops();
+    return drops;
+}
+
+// xorshift64*, only used to inject loss
+double UDPM::randomUniform()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dull >> 11) * (1.0 / (1ull << 53));
+}
+
 void UDPM::checkForMessageLoss()
 {
-    // XXX add this back
-    // TODO warn about message loss somewhere else.
-    // u32 ring_capacity = ringbuf->get_capacity();
-    // u32 ring_used = ringbuf->get_used();
-
-    // double buf_avail = ((double)(ring_capacity - ring_used)) / ring_capacity;
-    // if (buf_avail < udp_low_watermark)
-    //     udp_low_watermark = buf_avail;
-
-    // i32 tm = utimeInSeconds();
-    // int elapsedsecs = tm - udp_last_report_secs;
-    // if (elapsedsecs > 2) {
-    //    if (udp_discarded_bad > 0 || udp_low_watermark < 0.5) {
-    //        fprintf(stderr,
-    //                "%d ZCM loss %4.1f%% : %5d err, "
-    //                "buf avail %4.1f%%\n",
-    //                (int) tm,
-    //                udp_discarded_bad * 100.0 / (udp_rx + udp_discarded_bad),
-    //                udp_discarded_bad,
-    //                100.0 * udp_low_watermark);
-
-    //        udp_rx = 0;
-    //        udp_discarded_bad = 0;
-    //        udp_last_report_secs = tm;
-    //        udp_low_watermark = HUGE;
-    //    }
-    // }
+    i32 tm = utimeInSeconds();
+    if (params.loss_warn_secs <= 0 || tm - udp_last_report_secs < params.loss_warn_secs)
+        return;
+
+    u64 lost = seqtracker.getNumLost() - std::min(seqtracker.getNumLost(), udp_last_report_lost);
+    u32 kernel_drops = getKernelDrops() - udp_last_report_kernel_drops;
+    // the sockets of a multicast partition count the packets of the other
+    // partitions as drops. Only getStats() can tell the real drops apart
+    if (isPartition() && !params.unicast)
+        kernel_drops = 0;
+    if (udp_last_report_secs != 0 && (lost > 0 || kernel_drops > 0)) {
+        fprintf(stderr,
+                "%d ZCM udpm: %llu messages lost, %u packets dropped by the kernel "
+                "in the last %d secs\n",
+                (int) tm, (unsigned long long) lost, kernel_drops,
+                (int) (tm - udp_last_report_secs));
+    }
+
+    udp_last_report_secs = tm;
+    udp_last_report_lost = seqtracker.getNumLost();
+    udp_last_report_kernel_drops = getKernelDrops();
+
+    // senders that have gone quiet have most likely exited
+    seqtracker.prune((i64)(tm - SENDER_TIMEOUT_SECS) * 1000000);
 }
 
 // read continuously until a complete message arrives
 Message *UDPM::readMessage(int timeout)
 {
+    unique_lock<mutex> lk(mut);
     Packet *pkt = pool.allocPacket(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
     UDPM::checkForMessageLoss();
 
+    // NACKs are sent from this thread, so with reliable channels it wakes up
+    // regularly until the caller's timeout is over
+    i64 deadline = (timeout >= 0) ? utimeNow() + (i64)timeout * 1000 : -1;
+
     Message *msg = NULL;
     while (!msg) {
-        // // wait for either incoming UDP data, or for an abort message
-        if (!recvfd.waitUntilData(timeout))
-            break;
+        int wait = timeout;
+        if (isReliable()) {
+            processNacks();
+            wait = NACK_DELAY_US / 1000;
+            if (deadline >= 0)
+                wait = std::min((i64)wait, std::max((i64)0, (deadline - utimeNow()) / 1000));
+        }
 
-        int sz = recvfd.recvPacket(pkt);
+        // gather the sockets of the joined groups, starting after the one that
+        // was last read from so that a busy group can't starve the others
+        UDPMSocket *socks[MAX_SHARDS];
+        size_t sockShard[MAX_SHARDS];
+        size_t nsocks = 0;
+        for (size_t i = 0; i < shards.size(); i++) {
+            size_t idx = (nextShard + i) % shards.size();
+            Shard& shard = *shards[idx];
+            if (!shard.joined && shard.recvfd.isOpen()) {
+                ZCM_DEBUG("Leaving multicast group %s:%d",
+                          shard.destAddr.getIP().c_str(), shard.destAddr.getPort());
+                closedKernelDrops += isPartition() ? shard.recvfd.queryKernelDrops()
+                                                   : shard.recvfd.getKernelDrops();
+                if (uringRecv)
+                    uringRecv->cancel(shard.recvfd);
+                shard.recvfd.close();
+            }
+            if (shard.recvfd.isOpen()) {
+                socks[nsocks] = &shard.recvfd;
+                sockShard[nsocks] = idx;
+                nsocks++;
+            }
+        }
+
+        // wait for incoming UDP data. Groups joined while we wait are picked
+        // up on the next call. In busy poll mode, spin for a while first so
+        // that a packet arriving soon doesn't pay for a wakeup
+        lk.unlock();
+        int ready = -1, sz = -1;
+        bool spinHit = false, spinMiss = false;
+        if (uringRecv) {
+            ready = uringRecv->recvPacket(socks, nsocks, pkt, wait, &sz);
+        } else {
+            if (params.busy_poll_us > 0 && wait != 0) {
+                u64 spin = params.busy_poll_us;
+                if (wait > 0)
+                    spin = std::min(spin, (u64)wait * 1000);
+                ready = UDPMSocket::spinRecvPacket(socks, nsocks, pkt, spin, &sz);
+                spinHit = (ready >= 0);
+                spinMiss = !spinHit;
+            }
+            if (ready < 0)
+                ready = UDPMSocket::waitUntilData(socks, nsocks, wait);
+        }
+        lk.lock();
+        udp_busy_poll_hits += spinHit;
+        udp_busy_poll_misses += spinMiss;
+        if (!uringRecv && !spinHit)
+            udp_recv_syscalls++;
+        if (uringRecv && uringRecv->failed()) {
+            fprintf(stderr, "ZCM Warning: io_uring receives failed, falling back to io=sync\n");
+            udp_recv_syscalls += uringRecv->getNumSyscalls();
+            uringRecv.reset();
+            continue;
+        }
+        if (ready < 0) {
+            if (!isReliable() || (deadline >= 0 && utimeNow() >= deadline))
+                break;
+            continue;
+        }
+
+        UDPMSocket& recvfd = *socks[ready];
+        nextShard = sockShard[ready] + 1;
+
+        if (!spinHit && !uringRecv) {
+            sz = recvfd.recvPacket(pkt);
+            udp_recv_syscalls++;
+        }
         if (sz < 0) {
             ZCM_DEBUG("udp_read_packet -- recvmsg");
             udp_discarded_bad++;
             continue;
         }
+        udp_read++;
 
         ZCM_DEBUG("Got packet of size %d", sz);
 
+        if (params.loss_inject > 0 && randomUniform() < params.loss_inject) {
+            udp_loss_injected++;
+            continue;
+        }
+
+        if (params.auto_recv_buf)
+            autoTuneRecvBuf(pkt, sz);
+
         if (sz < (int)sizeof(MsgHeaderShort)) {
             // packet too short to be ZCM
             udp_discarded_bad++;
@@ -261,7 +1294,13 @@ Message *UDPM::readMessage(int timeout)
         if (magic == ZCM_MAGIC_SHORT)
             msg = recvShort(pkt, sz);
         else if (magic == ZCM_MAGIC_LONG)
-            msg = recvFragment(pkt, sz);
+            msg = recvFragment(recvfd, pkt, sz);
+        else if (magic == ZCM_MAGIC_PARITY)
+            msg = recvParity(pkt, sz);
+        else if (magic == ZCM_MAGIC_SHM)
+            msg = recvShm(pkt, sz);
+        else if (magic == ZCM_MAGIC_DENY || magic == ZCM_MAGIC_HEARTBEAT)
+            recvControl(pkt, sz);
         else {
             ZCM_DEBUG("ZCM: bad magic");
             udp_discarded_bad++;
@@ -281,38 +1320,77 @@ int UDPM::sendmsg(zcm_msg_t msg)
         return ZCM_EINVALID;
     }
 
+    int payload_size = channel_size + 1 + msg.len;
+    if (payload_size > ZCM_SHORT_MESSAGE_MAX_SIZE &&
+        (payload_size + ZCM_FRAGMENT_MAX_PAYLOAD - 1) / ZCM_FRAGMENT_MAX_PAYLOAD > 65535) {
+        fprintf(stderr, "ZCM error: too much data for a single message\n");
+        return -1;
+    }
+
+    Shard& shard = *shards[shardFor(msg.channel)];
+
+    unique_lock<mutex> lk(sendmut);
+    if (params.auto_send_buf)
+        autoTuneSendBuf(msg.len);
+
+    u32 seqno = shard.msg_seqno++;
+    if (shard.window) {
+        shard.window->add(seqno, msg.channel, msg.buf, msg.len,
+                          params.reliable.count(msg.channel) > 0);
+        shard.last_send_utime = utimeNow();
+    }
+
+    return sendMessage(shard, seqno, msg);
+}
+
+// Send 'msg' as message 'seqno' of 'shard'. Must be called with 'sendmut' held
+int UDPM::sendMessage(Shard& shard, u32 seqno, const zcm_msg_t& msg)
+{
+    int channel_size = strlen(msg.channel);
     int payload_size = channel_size + 1 + msg.len;
     if (payload_size <= ZCM_SHORT_MESSAGE_MAX_SIZE) {
         // message is short.  send in a single packet
 
         MsgHeaderShort hdr;
         hdr.setMagic(ZCM_MAGIC_SHORT);
-        hdr.setMsgSeqno(msg_seqno);
+        hdr.setMsgSeqno(seqno);
 
-        ssize_t status = sendfd.sendBuffers(destAddr,
-                              (char*)&hdr, sizeof(hdr),
-                              (char*)msg.channel, channel_size+1,
-                              msg.buf, msg.len);
+        ssize_t status = sendPacket(shard, (char*)&hdr, sizeof(hdr),
+                                    (char*)msg.channel, channel_size+1,
+                                    msg.buf, msg.len);
+        if (!flushPackets())
+            status = -1;
 
         int packet_size = sizeof(hdr) + payload_size;
         ZCM_DEBUG("transmitting %zu byte [%s] payload (%d byte pkt)",
                   msg.len, msg.channel, packet_size);
-        msg_seqno++;
 
         return (status == packet_size) ? 0 : status;
     }
 
 
     else {
+        // Large messages reach the zcm receivers on this host through the
+        // shm arena. The descriptor goes first, so that they drop the
+        // fragments that follow for the peers that can't read the arena.
+        // With shm_only there are no such peers on this host: with ttl=0
+        // nobody else can hear the fragments, otherwise they are kept off
+        // the loopback
+        u64 shmPos = 0;
+        bool viaShm = shmArena && shmArena->write(msg.buf, msg.len, &shmPos);
+        if (viaShm) {
+            int ret = sendShm(shard, seqno, msg, shmPos);
+            if (params.shm_only && params.ttl == 0)
+                return ret;
+            if (params.shm_only)
+                shard.sendfd.setLoopback(false);
+        }
+
         // message is large.  fragment into multiple packets
         int fragment_size = ZCM_FRAGMENT_MAX_PAYLOAD;
         int nfragments = payload_size / fragment_size +
             !!(payload_size % fragment_size);
-
-        if (nfragments > 65535) {
-            fprintf(stderr, "ZCM error: too much data for a single message\n");
-            return -1;
-        }
+        assert(nfragments <= 65535);
 
         // acquire transmit lock so that all fragments are transmitted
         // together, and so that no other message uses the same sequence number
@@ -325,7 +1403,7 @@ int UDPM::sendmsg(zcm_msg_t msg)
 
         MsgHeaderLong hdr;
         hdr.magic = htonl(ZCM_MAGIC_LONG);
-        hdr.msg_seqno = htonl(msg_seqno);
+        hdr.msg_seqno = htonl(seqno);
         hdr.msg_size = htonl(msg.len);
         hdr.fragment_offset = 0;
         hdr.fragment_no = 0;
@@ -338,10 +1416,19 @@ int UDPM::sendmsg(zcm_msg_t msg)
         int packet_size = sizeof(hdr) + (channel_size + 1) + firstfrag_datasize;
         fragment_offset += firstfrag_datasize;
 
-        ssize_t status = sendfd.sendBuffers(destAddr,
-                                            (char*)&hdr, sizeof(hdr),
-                                            (char*)msg.channel, channel_size+1,
-                                            msg.buf, firstfrag_datasize);
+        pace(shard, packet_size);
+        ssize_t status = sendPacket(shard, (char*)&hdr, sizeof(hdr),
+                                    (char*)msg.channel, channel_size+1,
+                                    msg.buf, firstfrag_datasize);
+
+        // with forward error correction, each group of fragments is followed by
+        // its parity
+        u16 fec = params.fec_group;
+        auto endsGroup = [&](u16 frag_no) {
+            return fec > 0 && ((frag_no + 1) % fec == 0 || frag_no + 1 == nfragments);
+        };
+        if (packet_size == status && endsGroup(0))
+            sendParity(shard, seqno, msg, channel_size, nfragments, 0);
 
         // transmit the rest of the fragments
         for (u16 frag_no = 1; packet_size == status && frag_no < nfragments; frag_no++) {
@@ -349,29 +1436,252 @@ int UDPM::sendmsg(zcm_msg_t msg)
             hdr.fragment_no = htons(frag_no);
 
             int fraglen = std::min(fragment_size, (int)msg.len - (int)fragment_offset);
-            status = sendfd.sendBuffers(destAddr,
-                                        (char*)&hdr, sizeof(hdr),
-                                        (char*)(msg.buf + fragment_offset), fraglen);
+            pace(shard, sizeof(hdr) + fraglen);
+            status = sendPacket(shard, (char*)&hdr, sizeof(hdr),
+                                (char*)(msg.buf + fragment_offset), fraglen);
 
             fragment_offset += fraglen;
             packet_size = sizeof(hdr) + fraglen;
+
+            if (packet_size == status && endsGroup(frag_no))
+                sendParity(shard, seqno, msg, channel_size, nfragments, frag_no / fec);
         }
 
+        // with io=uring the fragments were only queued
+        flushPackets();
+
+        if (viaShm && params.shm_only)
+            shard.sendfd.setLoopback(true);
+
         // sanity check
         if (0 == status) {
             assert(fragment_offset == msg.len);
         }
-
-        msg_seqno++;
     }
 
     return 0;
 }
 
+// Tell the receivers on this host where message 'seqno' is in the shm arena.
+// Must be called with 'sendmut' held
+int UDPM::sendShm(Shard& shard, u32 seqno, const zcm_msg_t& msg, u64 pos)
+{
+    MsgHeaderShm hdr;
+    hdr.setMagic(ZCM_MAGIC_SHM);
+    hdr.setMsgSeqno(seqno);
+    hdr.setMsgSize(msg.len);
+    hdr.setPid(shmArena->getPid());
+    hdr.setHost(shmHostId());
+    hdr.setNonce(shmArena->getNonce());
+    hdr.setPos(pos);
+
+    size_t channel_size = strlen(msg.channel);
+    ssize_t status = sendPacket(shard, (char*)&hdr, sizeof(hdr),
+                                msg.channel, channel_size+1);
+    if (!flushPackets())
+        status = -1;
+    shm_sent++;
+
+    ZCM_DEBUG("transmitting %zu byte [%s] payload through shm", msg.len, msg.channel);
+    return (status == (ssize_t)(sizeof(hdr) + channel_size + 1)) ? 0 : status;
+}
+
+// Parity packets are best effort, so failures to send them are ignored
+void UDPM::sendParity(Shard& shard, u32 seqno, const zcm_msg_t& msg, size_t channel_size,
+                      u16 nfragments, u16 group)
+{
+    // fragments carry consecutive pieces of the stream "channel, NULL, data"
+    const size_t fs = ZCM_FRAGMENT_MAX_PAYLOAD;
+    size_t prefix = channel_size + 1;
+    size_t stream_size = prefix + msg.len;
+    size_t first = (size_t)group * params.fec_group;
+    size_t end = std::min((size_t)nfragments, first + params.fec_group);
+    size_t parity_size = std::min(fs, stream_size - first * fs);
+
+    parity_buf.resize(fs);
+    char *parity = parity_buf.data();
+    memset(parity, 0, parity_size);
+    for (size_t i = first; i < end; i++) {
+        size_t off = i * fs;
+        size_t len = std::min(parity_size, stream_size - off);
+        if (off == 0) {
+            xorBytes(parity, msg.channel, prefix);
+            xorBytes(parity + prefix, msg.buf, len - prefix);
+        } else {
+            xorBytes(parity, msg.buf + off - prefix, len);
+        }
+    }
+
+    MsgHeaderParity hdr;
+    hdr.setMagic(ZCM_MAGIC_PARITY);
+    hdr.setMsgSeqno(seqno);
+    hdr.setMsgSize(msg.len);
+    hdr.setFragmentSize(fs);
+    hdr.setFragmentsInMsg(nfragments);
+    hdr.setGroupNo(group);
+    hdr.setGroupSize(params.fec_group);
+    hdr.setChannelLen(channel_size);
+
+    pace(shard, sizeof(hdr) + parity_size);
+    sendPacket(shard, (char*)&hdr, sizeof(hdr), parity, parity_size);
+
+    // parity_buf is reused by the next group
+    flushPackets();
+}
+
+// Send one packet of a fragmented message to each of the shard's destinations.
+// With io=uring the packet is only queued, and 'b' and 'c' must remain valid
+// until flushPackets(). Must be called with 'sendmut' held
+ssize_t UDPM::sendPacket(Shard& shard, const char *a, size_t alen, const char *b, size_t blen,
+                         const char *c, size_t clen)
+{
+    ssize_t status = alen + blen + clen;
+    for (auto& dest : shard.dests) {
+        if (uringSend) {
+            if (!uringSend->queue(shard.sendfd, dest, a, alen, b, blen, c, clen))
+                status = -1;
+            continue;
+        }
+
+        send_syscalls++;
+        ssize_t ret = c ? shard.sendfd.sendBuffers(dest, a, alen, b, blen, c, clen)
+                        : shard.sendfd.sendBuffers(dest, a, alen, b, blen);
+        if (ret < 0)
+            status = ret;
+    }
+    return status;
+}
+
+bool UDPM::flushPackets()
+{
+    return !uringSend || uringSend->flush();
+}
+
+// Queued packets must be on their way before the pacer sleeps. The rate limits
+// what leaves the host, so a unicast packet counts once per peer
+void UDPM::pace(Shard& shard, size_t bytes)
+{
+    u64 us = pacer.reserve(bytes * shard.dests.size());
+    if (us > 0) {
+        flushPackets();
+        pacer.wait(us);
+    }
+}
+
+// Control packets are best effort, like parity packets
+void UDPM::sendControl(UDPMSocket& sock, const UDPMAddress& dest, u32 magic,
+                       u32 seqno, u32 count, u32 reason)
+{
+    MsgHeaderControl hdr;
+    hdr.setMagic(magic);
+    hdr.setMsgSeqno(seqno);
+    hdr.setCount(count);
+    hdr.setReason(reason);
+    sock.sendBuffers(dest, (char*)&hdr, sizeof(hdr));
+}
+
+// Answers NACKs and sends heartbeats, for as long as the transport exists
+void UDPM::runRepairs()
+{
+    vector<char> data(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
+    Packet pkt;
+    pkt.buf.data = data.data();
+    pkt.buf.size = data.size();
+
+    UDPMSocket *socks[MAX_SHARDS];
+    for (size_t i = 0; i < shards.size(); i++)
+        socks[i] = &shards[i]->sendfd;
+
+    while (repairRunning) {
+        int ready = UDPMSocket::waitUntilData(socks, shards.size(), HEARTBEAT_INTERVAL_US / 1000);
+        if (ready >= 0) {
+            int sz = socks[ready]->recvPacket(&pkt);
+            if (sz >= (int)sizeof(MsgHeaderControl) &&
+                pkt.asHeaderControl()->getMagic() == ZCM_MAGIC_NACK)
+                handleNack(*shards[ready], *(struct sockaddr_in*)&pkt.from, pkt.asHeaderControl());
+        }
+        sendHeartbeats();
+    }
+
+    // the data belongs to the vector, not to the pool
+    pkt.buf.data = nullptr;
+}
+
+void UDPM::handleNack(Shard& shard, const struct sockaddr_in& from, MsgHeaderControl *hdr)
+{
+    u32 first = hdr->getMsgSeqno();
+    u32 count = std::min(hdr->getCount(), (u32)NACK_MAX_RANGE);
+    i64 now = utimeNow();
+
+    u64 sent = 0, denied = 0;
+    for (u32 i = 0; i < count; ) {
+        std::shared_ptr<RetransmitWindow::Entry> entry;
+        auto status = shard.window->lookup(first + i, entry);
+        if (status != RetransmitWindow::RETAINED) {
+            // deny the whole run of messages that can't be repaired at once
+            u32 n = 1;
+            while (i + n < count && shard.window->lookup(first + i + n, entry) == status)
+                n++;
+            for (auto& dest : shard.dests)
+                sendControl(shard.sendfd, dest, ZCM_MAGIC_DENY, first + i, n, status);
+            denied += n;
+            i += n;
+            continue;
+        }
+        i++;
+
+        // Every receiver that missed a message asks for it. The first repair
+        // goes to all of them, so the rest of the NACKs are ignored
+        if (now - entry->last_repair_utime < REPAIR_HOLDOFF_US)
+            continue;
+        entry->last_repair_utime = now;
+
+        zcm_msg_t msg;
+        msg.utime = 0;
+        msg.channel = entry->channel.c_str();
+        msg.len = entry->data.size();
+        msg.buf = entry->data.data();
+        ZCM_DEBUG("Repairing message %u [%s] for %s:%d", entry->seqno, msg.channel,
+                  inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+        unique_lock<mutex> lk(sendmut);
+        sendMessage(shard, entry->seqno, msg);
+        sent++;
+    }
+
+    unique_lock<mutex> lk(mut);
+    udp_repairs_sent += sent;
+    udp_repairs_denied += denied;
+}
+
+// Receivers notice lost messages when the next one arrives. Heartbeats let
+// them notice when the last messages sent were lost
+void UDPM::sendHeartbeats()
+{
+    i64 now = utimeNow();
+    unique_lock<mutex> lk(sendmut);
+    for (auto& shard : shards) {
+        if (shard->last_send_utime == 0 || now - shard->last_send_utime > HEARTBEAT_IDLE_US ||
+            now - shard->last_heartbeat_utime < HEARTBEAT_INTERVAL_US)
+            continue;
+        shard->last_heartbeat_utime = now;
+        for (auto& dest : shard->dests)
+            sendControl(shard->sendfd, dest, ZCM_MAGIC_HEARTBEAT, shard->msg_seqno - 1, 0, 0);
+    }
+}
+
 int UDPM::recvmsg(zcm_msg_t *msg, int timeout)
 {
-    if (m)
+    if (!partitions.empty())
+        return recvPartitioned(msg, timeout);
+
+    if (params.recv_cpu >= 0 && pinnedThread != std::this_thread::get_id())
+        pinRecvThread();
+
+    if (m) {
+        unique_lock<mutex> lk(mut);
         pool.freeMessage(m);
+        m = nullptr;
+    }
 
     m = readMessage(timeout);
     if (m == nullptr)
@@ -384,30 +1694,334 @@ int UDPM::recvmsg(zcm_msg_t *msg, int timeout)
     return ZCM_EOK;
 }
 
+// With recv_sockets > 1, hand out the messages reassembled by the partitions
+int UDPM::recvPartitioned(zcm_msg_t *msg, int timeout)
+{
+    if (m) {
+        mOwner->releaseMessage(m);
+        m = nullptr;
+    }
+
+    unique_lock<mutex> lk(recvqMut);
+    auto ready = [&]() { return !recvq.empty(); };
+    if (timeout < 0)
+        recvqCond.wait(lk, ready);
+    else if (!recvqCond.wait_for(lk, std::chrono::milliseconds(timeout), ready))
+        return ZCM_EAGAIN;
+    mOwner = recvq.front().first;
+    m = recvq.front().second;
+    recvq.pop_front();
+    recvqCond.notify_all();
+    lk.unlock();
+
+    msg->channel = m->channel;
+    msg->len = m->datalen;
+    msg->buf = m->data;
+
+    return ZCM_EOK;
+}
+
+void UDPM::releaseMessage(Message *msg)
+{
+    unique_lock<mutex> lk(mut);
+    pool.freeMessage(msg);
+}
+
+// The receive loop of one partition. Every sender is always read by the same
+// partition, so its messages stay in order
+void UDPM::runPartition(UDPM *part)
+{
+    if (part->params.recv_cpu >= 0)
+        part->pinRecvThread();
+
+    while (partitionsRunning) {
+        Message *msg = part->readMessage(PARTITION_POLL_MS);
+        if (!msg)
+            continue;
+
+        // while recvmsg() is behind, packets wait in the socket buffer
+        unique_lock<mutex> lk(recvqMut);
+        recvqCond.wait(lk, [&]() {
+            return recvq.size() < RECV_QUEUE_SIZE || !partitionsRunning;
+        });
+        if (!partitionsRunning) {
+            lk.unlock();
+            part->releaseMessage(msg);
+            break;
+        }
+        recvq.emplace_back(part, msg);
+        recvqCond.notify_all();
+    }
+}
+
+bool UDPM::startPartitions()
+{
+    ZCM_DEBUG("Receiving on %u sockets", params.recv_sockets);
+    for (u16 i = 0; i < params.recv_sockets; i++) {
+        Params p = params;
+        p.partition = i;
+        p.prewarm = (params.prewarm + params.recv_sockets - 1) / params.recv_sockets;
+        if (params.recv_cpu >= 0)
+            p.recv_cpu = params.recv_cpu + i;
+        // in order: the unicast sockets are steered to by the order they bind in
+        partitions.emplace_back(new UDPM(p));
+        if (!partitions.back()->init())
+            return false;
+    }
+
+    partitionsRunning = true;
+    for (auto& part : partitions)
+        partitionThreads.emplace_back(&UDPM::runPartition, this, part.get());
+    return true;
+}
+
+// Busy polling is only worth it if the receiving thread keeps its cpu
+void UDPM::pinRecvThread()
+{
+    pinnedThread = std::this_thread::get_id();
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(params.recv_cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+        fprintf(stderr, "ZCM Warning: failed to pin the udpm receive thread to cpu %d: %s\n",
+                params.recv_cpu, strerror(err));
+    else
+        ZCM_DEBUG("Pinned the receive thread to cpu %d", params.recv_cpu);
+#else
+    fprintf(stderr, "ZCM Warning: recv_cpu is not supported on this platform\n");
+#endif
+}
+
+// Add the receive side of a partition's counters to the transport's
+static void addRecvStats(zcm_udpm_stats_t *dst, const zcm_udpm_stats_t& src)
+{
+    dst->packets_received += src.packets_received;
+    dst->packets_discarded += src.packets_discarded;
+    dst->packets_filtered += src.packets_filtered;
+    dst->kernel_drops += src.kernel_drops;
+    dst->messages_lost += src.messages_lost;
+    dst->messages_duplicate += src.messages_duplicate;
+    dst->messages_reordered += src.messages_reordered;
+    dst->senders += src.senders;
+    dst->parity_received += src.parity_received;
+    dst->fragments_recovered += src.fragments_recovered;
+    dst->packets_loss_injected += src.packets_loss_injected;
+    dst->nacks_sent += src.nacks_sent;
+    dst->messages_repaired += src.messages_repaired;
+    dst->messages_unrecoverable += src.messages_unrecoverable;
+    dst->shm_received += src.shm_received;
+    dst->shm_lost += src.shm_lost;
+    dst->recv_buf_size = std::max(dst->recv_buf_size, src.recv_buf_size);
+    dst->largest_message = std::max(dst->largest_message, src.largest_message);
+    dst->busy_poll_hits += src.busy_poll_hits;
+    dst->busy_poll_misses += src.busy_poll_misses;
+    dst->io_uring |= src.io_uring;
+    dst->recv_syscalls += src.recv_syscalls;
+    dst->shards_joined = std::max(dst->shards_joined, src.shards_joined);
+    dst->fragbufs += src.fragbufs;
+    dst->fragbuf_bytes += src.fragbuf_bytes;
+    dst->fragbufs_evicted += src.fragbufs_evicted;
+    dst->slab_bytes += src.slab_bytes;
+    dst->slab_bytes_max += src.slab_bytes_max;
+    for (size_t i = 0; i < std::min(dst->num_size_classes, src.num_size_classes); i++) {
+        dst->size_classes[i].slabs += src.size_classes[i].slabs;
+        dst->size_classes[i].inuse += src.size_classes[i].inuse;
+        dst->size_classes[i].free += src.size_classes[i].free;
+        dst->size_classes[i].overflow += src.size_classes[i].overflow;
+    }
+}
+
+void UDPM::getStats(zcm_udpm_stats_t *stats)
+{
+    unique_lock<mutex> lk(mut);
+    memset(stats, 0, sizeof(*stats));
+    stats->packets_received = udp_rx;
+    stats->packets_discarded = udp_discarded_bad;
+    stats->packets_filtered = udp_filtered;
+    stats->kernel_drops = getKernelDrops();
+    stats->messages_lost = seqtracker.getNumLost();
+    stats->messages_duplicate = seqtracker.getNumDuplicate();
+    stats->messages_reordered = seqtracker.getNumReordered();
+    stats->senders = seqtracker.getNumSenders();
+    stats->parity_received = udp_parity_rx;
+    stats->fragments_recovered = udp_recovered;
+    stats->packets_loss_injected = udp_loss_injected;
+    stats->nacks_sent = udp_nacks_sent;
+    stats->messages_repaired = udp_repaired;
+    stats->messages_unrecoverable = udp_unrecoverable;
+    stats->repairs_sent = udp_repairs_sent;
+    stats->repairs_denied = udp_repairs_denied;
+    stats->shm_sent = shm_sent;
+    stats->shm_received = udp_shm_rx;
+    stats->shm_lost = udp_shm_lost;
+    for (auto& shard : shards)
+        if (shard->window)
+            stats->retransmit_window_bytes += shard->window->getBytes();
+    stats->recv_buf_size = kernel_rbuf_sz;
+    stats->send_buf_size = kernel_sbuf_sz;
+    stats->largest_message = largest_recv_msg;
+    stats->pace_waits = pacer.getNumWaits();
+    stats->pace_wait_us = pacer.getWaitUtime();
+    stats->busy_poll_hits = udp_busy_poll_hits;
+    stats->busy_poll_misses = udp_busy_poll_misses;
+    stats->io_uring = (uringRecv || uringSend) ? 1 : 0;
+    stats->recv_syscalls = udp_recv_syscalls + (uringRecv ? uringRecv->getNumSyscalls() : 0);
+    stats->send_syscalls = send_syscalls + (uringSend ? uringSend->getNumSyscalls() : 0);
+    stats->shards = shards.size();
+    for (auto& shard : shards)
+        if (shard->recvfd.isOpen())
+            stats->shards_joined++;
+    pool.fillStats(stats);
+    stats->recv_sockets = params.recv_sockets;
+    lk.unlock();
+
+    if (partitions.empty()) {
+        stats->recv_socket_packets[0] = udp_read;
+        return;
+    }
+
+    u64 read = 0;
+    for (size_t i = 0; i < partitions.size(); i++) {
+        zcm_udpm_stats_t part;
+        partitions[i]->getStats(&part);
+        addRecvStats(stats, part);
+        stats->recv_socket_packets[i] = part.recv_socket_packets[0];
+        read += part.recv_socket_packets[0];
+    }
+
+    // Every multicast packet reaches all N sockets, and N-1 of them refuse it
+    // as a drop. So the drop counts add up to (N-1) * (read + dropped) plus
+    // the packets that were really dropped, give or take what is still queued
+    if (!params.unicast) {
+        u64 n = partitions.size();
+        u64 refused = (n - 1) * read;
+        stats->kernel_drops = stats->kernel_drops > refused ?
+            (stats->kernel_drops - refused) / n : 0;
+    }
+}
+
 UDPM::~UDPM()
 {
     ZCM_DEBUG("closing zcm context");
+    if (repairThread.joinable()) {
+        repairRunning = false;
+        repairThread.join();
+    }
+    if (!partitionThreads.empty()) {
+        {
+            unique_lock<mutex> lk(recvqMut);
+            partitionsRunning = false;
+            recvqCond.notify_all();
+        }
+        for (auto& thr : partitionThreads)
+            thr.join();
+        for (auto& entry : recvq)
+            entry.first->releaseMessage(entry.second);
+        recvq.clear();
+    }
+    if (m)
+        (mOwner ? mOwner : this)->releaseMessage(m);
 }
 
-UDPM::UDPM(const string& ip, u16 port, size_t recv_buf_size, u8 ttl)
-    : params(ip, port, recv_buf_size, ttl),
-      destAddr(ip, port)
+UDPM::UDPM(const Params& params)
+    : params(params),
+      pacer(params.pace_rate, params.pace_burst)
 {
+    for (u16 i = 0; i < params.shards; i++) {
+        struct in_addr addr;
+        addr.s_addr = htonl(ntohl(params.addr.s_addr) + i);
+        shards.emplace_back(new Shard(inet_ntoa(addr), wirePort(params.port + i)));
+        if (params.unicast)
+            shards.back()->dests = params.peers;
+        if (isReliable() && !isPartition())
+            shards.back()->window.reset(new RetransmitWindow(params.reliable_window));
+    }
 }
 
 bool UDPM::init()
 {
     ZCM_DEBUG("Initializing ZCM UDPM context...");
-    ZCM_DEBUG("Multicast %s:%d", params.ip.c_str(), params.port);
-    UDPMSocket::checkConnection(params.ip, params.port);
+    if (isPartition()) {
+        ZCM_DEBUG("Receive partition %d of %u", params.partition, params.recv_sockets);
+    } else if (params.unicast) {
+        ZCM_DEBUG("Unicast %s:%d to %zu peers", params.ip.c_str(), params.port,
+                  params.peers.size());
+        for (auto& peer : params.peers)
+            UDPMSocket::checkConnection(peer.getIP(), peer.getPort());
+    } else {
+        ZCM_DEBUG("Multicast %s:%d", params.ip.c_str(), params.port);
+        UDPMSocket::checkConnection(params.ip, wirePort(params.port));
+    }
+
+    if (params.prewarm > 0 && receives()) {
+        ZCM_DEBUG("Prewarming the udpm memory pool for %zu packets", params.prewarm);
+        pool.prewarm(params.prewarm, ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
+    }
+
+    for (auto& shard : shards) {
+        if (params.unicast)
+            shard->sendfd = UDPMSocket::createUnicastSendSocket();
+        else
+            shard->sendfd = UDPMSocket::createSendSocket(shard->destAddr.getInAddr(), params.ttl);
+        if (!shard->sendfd.isOpen()) return false;
+        if (params.connect && !shard->sendfd.connectTo(shard->dests[0])) return false;
+        if (params.send_buf_size > 0)
+            shard->sendfd.setSendBufSize(params.send_buf_size);
+    }
+    kernel_sbuf_sz = shards[0]->sendfd.getSendBufSize();
+    if (params.send_buf_size > 0 && kernel_sbuf_sz / 2 < params.send_buf_size)
+        fprintf(stderr,
+                "ZCM Warning: requested a %zu byte UDP send buffer, but the kernel "
+                "limited it to %zu bytes.\n"
+                "Raise net.core.wmem_max or give the process CAP_NET_ADMIN.\n",
+                params.send_buf_size, kernel_sbuf_sz / 2);
+
+    // With a single group, always join it. Otherwise groups are joined as
+    // channels are enabled
+    if (!receives()) {
+        // the partitions receive, once the rest of this instance is set up
+    } else if (shards.size() == 1) {
+        shards[0]->joined = true;
+        if (!openRecvSocket(*shards[0])) return false;
+    } else {
+        ZCM_DEBUG("Spreading channels over %zu multicast groups", shards.size());
+    }
+
+    if (params.io_uring) {
+        if (receives())
+            uringRecv.reset(new UringReceiver());
+        if (!isPartition())
+            uringSend.reset(new UringSender());
+        if (!UringEngine::probe() || (uringRecv && !uringRecv->init()) ||
+            (uringSend && !uringSend->init())) {
+            fprintf(stderr, "ZCM Warning: io_uring is not available, falling back to io=sync\n");
+            uringRecv.reset();
+            uringSend.reset();
+        } else {
+            ZCM_DEBUG("Using the io_uring backend");
+        }
+    }
+
+    if (params.shm_size > 0 && !isPartition()) {
+        shmArena.reset(new ShmArena());
+        if (!shmArena->init(params.shm_size)) {
+            fprintf(stderr, "ZCM Warning: failed to create the shm arena, "
+                    "sending large messages as fragments\n");
+            shmArena.reset();
+        }
+    }
 
-    sendfd = UDPMSocket::createSendSocket(params.addr, params.ttl);
-    if (!sendfd.isOpen()) return false;
-    kernel_sbuf_sz = sendfd.getSendBufSize();
+    // Partitions only receive: NACKs are answered by the sending instance
+    if (isReliable() && !isPartition()) {
+        ZCM_DEBUG("Repairing lost messages on %zu channels", params.reliable.size());
+        repairRunning = true;
+        repairThread = std::thread(&UDPM::runRepairs, this);
+    }
 
-    recvfd = UDPMSocket::createRecvSocket(params.addr, params.port);
-    if (!recvfd.isOpen()) return false;
-    kernel_rbuf_sz = recvfd.getRecvBufSize();
+    if (!receives() && !startPartitions())
+        return false;
 
     if (!this->selftest()) {
         // self test failed.  destroy the read thread
@@ -435,8 +2049,8 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 {
     UDPM udpm;
 
-    ZCM_TRANS_CLASSNAME(const string& ip, u16 port, size_t recv_buf_size, u8 ttl)
-        : udpm(ip, port, recv_buf_size, ttl)
+    ZCM_TRANS_CLASSNAME(const Params& params)
+        : udpm(params)
     {
         trans_type = ZCM_BLOCKING;
         vtbl = &methods;
@@ -459,7 +2073,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     { return cast(zt)->udpm.sendmsg(msg); }
 
     static int _recvmsgEnable(zcm_trans_t *zt, const char *channel, bool enable)
-    { return ZCM_EOK; }
+    { return cast(zt)->udpm.recvmsgEnable(channel, enable); }
 
     static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, int timeout)
     { return cast(zt)->udpm.recvmsg(msg, timeout); }
@@ -468,8 +2082,17 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     { delete cast(zt); }
 
     static const TransportRegister regUdpm;
+    static const TransportRegister regUdp;
 };
 
+int zcm_trans_udpm_stats(zcm_trans_t *zt, zcm_udpm_stats_t *stats)
+{
+    if (!zt || zt->vtbl != &ZCM_TRANS_CLASSNAME::methods)
+        return ZCM_EINVALID;
+    ZCM_TRANS_CLASSNAME::cast(zt)->udpm.getStats(stats);
+    return ZCM_EOK;
+}
+
 zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_getMtu,
     &ZCM_TRANS_CLASSNAME::_sendmsg,
@@ -505,7 +2128,8 @@ static vector<string> split(const string& str, char delimiter)
     return v;
 }
 
-static zcm_trans_t *createUdpm(zcm_url_t *url)
+// Both udpm:// and udp:// take <ip-address>:<port> and the same url options
+static zcm_trans_t *create(zcm_url_t *url, bool unicast)
 {
     auto *ip = zcm_url_address(url);
     vector<string> parts = split(ip, ':');
@@ -522,8 +2146,187 @@ static zcm_trans_t *createUdpm(zcm_url_t *url)
         ZCM_DEBUG("No ttl specified. Using default ttl=0");
         ttl = "0";
     }
-    size_t recv_buf_size = 1024;
-    auto *trans = new ZCM_TRANS_CLASSNAME(address, atoi(port.c_str()), recv_buf_size, atoi(ttl));
+    Params params(address, atoi(port.c_str()), 0, atoi(ttl));
+    params.unicast = unicast;
+
+    // Format is <ip-address>:<port>,<ip-address>:<port>,...
+    auto *peers = optFind(opts, "peers");
+    if (peers) {
+        if (!unicast) {
+            ZCM_DEBUG("ERROR: peers is only supported by the udp transport");
+            return nullptr;
+        }
+        for (auto& peer : split(peers, ',')) {
+            vector<string> peerParts = split(peer, ':');
+            struct in_addr peerAddr;
+            if (peerParts.size() != 2 || !inet_aton(peerParts[0].c_str(), &peerAddr)) {
+                ZCM_DEBUG("ERROR: invalid peer '%s' (expected <ip-address>:<port>)",
+                          peer.c_str());
+                return nullptr;
+            }
+            params.peers.emplace_back(peerParts[0], atoi(peerParts[1].c_str()));
+        }
+    }
+    auto *connect = optFind(opts, "connect");
+    if (connect) {
+        params.connect = atoi(connect) != 0;
+        if (params.connect && params.peers.size() != 1) {
+            ZCM_DEBUG("ERROR: connect requires exactly one peer");
+            return nullptr;
+        }
+    }
+
+    // Kernel buffer sizes are given in bytes, or as 'auto'
+    auto *rcvbuf = optFind(opts, "rcvbuf");
+    if (rcvbuf) {
+        if (string(rcvbuf) == "auto")
+            params.auto_recv_buf = true;
+        else
+            params.recv_buf_size = strtoull(rcvbuf, NULL, 10);
+    }
+    auto *sndbuf = optFind(opts, "sndbuf");
+    if (sndbuf) {
+        if (string(sndbuf) == "auto")
+            params.auto_send_buf = true;
+        else
+            params.send_buf_size = strtoull(sndbuf, NULL, 10);
+    }
+
+    auto *prewarm = optFind(opts, "prewarm");
+    if (prewarm)
+        params.prewarm = atoi(prewarm);
+    auto *lossWarn = optFind(opts, "loss_warn");
+    if (lossWarn)
+        params.loss_warn_secs = atoi(lossWarn);
+
+    auto *paceRate = optFind(opts, "pace_rate");
+    if (paceRate)
+        params.pace_rate = strtoull(paceRate, NULL, 10);
+    auto *paceBurst = optFind(opts, "pace_burst");
+    if (paceBurst)
+        params.pace_burst = strtoull(paceBurst, NULL, 10);
+
+    auto *fec = optFind(opts, "fec");
+    if (fec) {
+        int n = atoi(fec);
+        if (n < 0 || n > MAX_FEC_GROUP) {
+            ZCM_DEBUG("ERROR: invalid fec=%s (at most %d)", fec, MAX_FEC_GROUP);
+            return nullptr;
+        }
+        params.fec_group = n;
+    }
+    auto *lossInject = optFind(opts, "loss_inject");
+    if (lossInject)
+        params.loss_inject = atof(lossInject);
+
+    // Format is <channel>,<channel>,...
+    auto *reliable = optFind(opts, "reliable");
+    if (reliable) {
+        for (auto& chan : split(reliable, ','))
+            if (!chan.empty())
+                params.reliable.insert(chan);
+    }
+    auto *reliableWindow = optFind(opts, "reliable_window");
+    if (reliableWindow)
+        params.reliable_window = strtoull(reliableWindow, NULL, 10);
+
+    auto *io = optFind(opts, "io");
+    if (io) {
+        if (string(io) == "uring") {
+            params.io_uring = true;
+        } else if (string(io) != "sync") {
+            ZCM_DEBUG("ERROR: invalid io=%s (expected 'sync' or 'uring')", io);
+            return nullptr;
+        }
+    }
+
+    auto *busyPoll = optFind(opts, "busy_poll");
+    if (busyPoll)
+        params.busy_poll_us = strtoul(busyPoll, NULL, 10);
+    auto *recvCpu = optFind(opts, "recv_cpu");
+    if (recvCpu) {
+        int cpu = atoi(recvCpu);
+        if (cpu < 0) {
+            ZCM_DEBUG("ERROR: invalid recv_cpu=%s", recvCpu);
+            return nullptr;
+        }
+        params.recv_cpu = cpu;
+    }
+
+    auto *recvSockets = optFind(opts, "recv_sockets");
+    if (recvSockets) {
+        int n = atoi(recvSockets);
+        if (n < 1 || n > ZCM_UDPM_MAX_RECV_SOCKETS) {
+            ZCM_DEBUG("ERROR: invalid recv_sockets=%s (at most %d)",
+                      recvSockets, ZCM_UDPM_MAX_RECV_SOCKETS);
+            return nullptr;
+        }
+#ifndef __linux__
+        if (n > 1) {
+            ZCM_DEBUG("ERROR: recv_sockets is only supported on linux");
+            return nullptr;
+        }
+#endif
+        params.recv_sockets = n;
+    }
+
+    auto *shm = optFind(opts, "shm");
+    if (shm) {
+        if (unicast) {
+            ZCM_DEBUG("ERROR: shm is only supported by the udpm transport");
+            return nullptr;
+        }
+#ifndef __linux__
+        ZCM_DEBUG("ERROR: shm is only supported on linux");
+        return nullptr;
+#endif
+        params.shm_size = strtoull(shm, NULL, 10);
+        if (params.shm_size < SHM_MIN_SIZE) {
+            ZCM_DEBUG("ERROR: invalid shm=%s (at least %d bytes)", shm, SHM_MIN_SIZE);
+            return nullptr;
+        }
+    }
+
+    auto *shmOnly = optFind(opts, "shm_only");
+    if (shmOnly) {
+        params.shm_only = atoi(shmOnly) != 0;
+        if (params.shm_only && !shm) {
+            ZCM_DEBUG("ERROR: shm_only requires shm");
+            return nullptr;
+        }
+    }
+
+    auto *shards = optFind(opts, "shards");
+    if (shards && unicast) {
+        ZCM_DEBUG("ERROR: shards is only supported by the udpm transport");
+        return nullptr;
+    }
+    if (shards) {
+        int n = atoi(shards);
+        u32 lastAddr = ntohl(params.addr.s_addr) + n - 1;
+        if (n < 1 || n > MAX_SHARDS ||
+            (u32)params.port + n - 1 > 0xffff || !IN_MULTICAST(lastAddr)) {
+            ZCM_DEBUG("ERROR: invalid shards=%s (at most %d, and the last group "
+                      "address and port must be valid)", shards, MAX_SHARDS);
+            return nullptr;
+        }
+        params.shards = n;
+    }
+    auto *shardMap = optFind(opts, "shard_map");
+    if (shardMap) {
+        // Format is <channel>:<shard>,<channel>:<shard>,...
+        for (auto& entry : split(shardMap, ',')) {
+            size_t sep = entry.rfind(':');
+            int idx = (sep == string::npos) ? -1 : atoi(entry.c_str() + sep + 1);
+            if (idx < 0 || idx >= params.shards) {
+                ZCM_DEBUG("ERROR: invalid shard_map entry '%s'", entry.c_str());
+                return nullptr;
+            }
+            params.shard_map[entry.substr(0, sep)] = idx;
+        }
+    }
+
+    auto *trans = new ZCM_TRANS_CLASSNAME(params);
     if (!trans->init()) {
         delete trans;
         return nullptr;
@@ -532,9 +2335,22 @@ static zcm_trans_t *createUdpm(zcm_url_t *url)
     }
 }
 
+static zcm_trans_t *createUdpm(zcm_url_t *url)
+{
+    return create(url, false);
+}
+
+static zcm_trans_t *createUdp(zcm_url_t *url)
+{
+    return create(url, true);
+}
+
 #ifdef USING_TRANS_UDPM
 // Register this transport with ZCM
 const TransportRegister ZCM_TRANS_CLASSNAME::regUdpm(
     // XXX: the example url does not work
     "udpm", "Transfer data via UDP Multicast (e.g. 'udpm')", createUdpm);
+const TransportRegister ZCM_TRANS_CLASSNAME::regUdp(
+    "udp", "Transfer data via UDP unicast to fixed peers "
+    "(e.g. 'udp://0.0.0.0:7667?peers=10.0.0.2:7667')", createUdp);
 #endif
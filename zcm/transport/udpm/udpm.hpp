@@ -18,9 +18,13 @@
 
 // Headers for C++ library
 #include <algorithm>
+#include <memory>
 #include <vector>
 #include <stack>
+#include <deque>
 #include <unordered_map>
+#include <unordered_set>
+#include <regex>
 #include <string>
 using namespace std;
 
@@ -36,6 +40,8 @@ using namespace std;
 # include <sys/socket.h>
 # include <sys/poll.h>
 # include <sys/select.h>
+# include <pthread.h>
+# include <sched.h>
 typedef int SOCKET;
 #endif
 
@@ -87,6 +93,11 @@ typedef int64_t  i64;
 /************************* Important Defines *******************/
 #define ZCM_MAGIC_SHORT 0x4c433032   // hex repr of ascii "LC02"
 #define ZCM_MAGIC_LONG  0x4c433033   // hex repr of ascii "LC03"
+#define ZCM_MAGIC_PARITY 0x4c433034  // hex repr of ascii "LC04"
+#define ZCM_MAGIC_NACK  0x4c433035   // hex repr of ascii "LC05"
+#define ZCM_MAGIC_DENY  0x4c433036   // hex repr of ascii "LC06"
+#define ZCM_MAGIC_HEARTBEAT 0x4c433037 // hex repr of ascii "LC07"
+#define ZCM_MAGIC_SHM   0x4c433038   // hex repr of ascii "LC08"
 
 #ifdef __APPLE__
 # define ZCM_SHORT_MESSAGE_MAX_SIZE 1435
@@ -102,5 +113,36 @@ typedef int64_t  i64;
 
 #define MAX_FRAG_BUF_TOTAL_SIZE (1 << 24)// 16 megabytes
 #define MAX_NUM_FRAG_BUFS 1000
+#define MAX_CHANNEL_CACHE_SIZE 1024
+#define SENDER_TIMEOUT_SECS 60
+#define MAX_SHARDS 256
+#define RECV_QUEUE_SIZE 256          // messages waiting to be read with recv_sockets > 1
+#define PARTITION_POLL_MS 100        // how often the partition threads check for shutdown
+#define SHM_MIN_SIZE (1 << 20)       // smallest 'shm' arena
+#define MAX_FEC_GROUP 255
+#define DEFAULT_PACE_BURST (1 << 17) // 128 kilobytes
+
+// Automatic kernel buffer sizing: hold AUTO_BUF_WINDOW_US of traffic at the
+// peak rate seen, and at least AUTO_BUF_MSGS of the largest message
+#define AUTO_BUF_WINDOW_US 100000
+#define AUTO_BUF_MSGS 4
+#define AUTO_BUF_MAX_SIZE (1 << 26) // 64 megabytes
+
+// Reliable channels (the 'reliable' url option)
+#define DEFAULT_RELIABLE_WINDOW (1 << 24) // 16 megabytes
+#define RELIABLE_HISTORY 4096        // messages per sender that can be repaired
+#define NACK_DELAY_US 10000          // wait for reordered packets before the first NACK
+#define NACK_RETRY_US 20000
+#define NACK_MAX_TRIES 5
+#define NACK_MAX_RANGE 64            // messages asked for by a single NACK
+#define REPAIR_HOLDOFF_US 5000       // ignore repeated NACKs for a message this long
+#define HEARTBEAT_INTERVAL_US 50000
+#define HEARTBEAT_IDLE_US 1000000    // stop heartbeats this long after the last send
 
 #define SELF_TEST_CHANNEL "LCM_SELF_TEST"
+
+// Identifies a sender on the group by its address and port
+static inline u64 senderKey(const struct sockaddr_in *addr)
+{
+    return ((u64)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
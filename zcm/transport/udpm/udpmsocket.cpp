@@ -1,6 +1,13 @@
 #include "udpmsocket.hpp"
 #include "buffers.hpp"
 
+#include <chrono>
+
+#ifdef __linux__
+# include <linux/filter.h>
+# include <linux/sock_diag.h>
+#endif
+
 // Platform specifics
 #ifdef WIN32
 struct Platform
@@ -80,6 +87,7 @@ void UDPMSocket::close()
         Platform::closesocket(fd);
         fd = -1;
     }
+    connected = false;
 }
 
 bool UDPMSocket::init()
@@ -119,13 +127,13 @@ bool UDPMSocket::setTTL(u8 ttl)
     return true;
 }
 
-bool UDPMSocket::bindPort(u16 port)
+bool UDPMSocket::bindPort(u16 port, u32 inaddr)
 {
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof (addr));
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = port;
+    addr.sin_addr.s_addr = inaddr;
+    addr.sin_port = htons(port);
 
     if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
@@ -134,6 +142,16 @@ bool UDPMSocket::bindPort(u16 port)
     return true;
 }
 
+bool UDPMSocket::connectTo(const UDPMAddress& peer)
+{
+    if (connect(fd, peer.getAddrPtr(), peer.getAddrSize()) < 0) {
+        perror("connect");
+        return false;
+    }
+    connected = true;
+    return true;
+}
+
 bool UDPMSocket::setReuseAddr()
 {
     // allow other applications on the local machine to also bind to this
@@ -175,6 +193,108 @@ bool UDPMSocket::enablePacketTimestamp()
     return true;
 }
 
+bool UDPMSocket::enableDropCounter()
+{
+    /* Have the kernel report its count of dropped packets with each packet */
+#ifdef SO_RXQ_OVFL
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt)) < 0)
+        ZCM_DEBUG("ZCM: failed to enable SO_RXQ_OVFL, kernel drops will not be reported");
+#endif
+    return true;
+}
+
+bool UDPMSocket::setBusyPoll(u32 usecs)
+{
+#ifdef SO_BUSY_POLL
+    /* Note: values above net.core.busy_read require CAP_NET_ADMIN */
+    int opt = usecs;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)) < 0) {
+        ZCM_DEBUG("ZCM: failed to set SO_BUSY_POLL to %u usecs", usecs);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UDPMSocket::disableMulticastAll()
+{
+    /* Only deliver traffic for the groups joined on this socket. Otherwise linux
+     * delivers every group joined by any socket on the host that uses our port */
+#ifdef IP_MULTICAST_ALL
+    int opt = 0;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &opt, sizeof(opt)) < 0)
+        ZCM_DEBUG("ZCM: failed to disable IP_MULTICAST_ALL");
+#endif
+    return true;
+}
+
+#ifdef __linux__
+// Classic BPF that leaves hash(source address, source port) % count in A.
+// The port is read assuming an IP header without options, which is only ever
+// wrong consistently for a given sender
+static vector<struct sock_filter> partitionHash(u32 count)
+{
+    return {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (u32)SKF_NET_OFF + 12),  // source address
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, (u32)SKF_NET_OFF + 20),  // source port
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+    };
+}
+#endif
+
+bool UDPMSocket::filterPartition(u32 index, u32 count)
+{
+#ifdef __linux__
+    auto prog = partitionHash(count);
+    prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, index, 0, 1));
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    struct sock_fprog fprog = { (unsigned short)prog.size(), prog.data() };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        perror("setsockopt (SOL_SOCKET, SO_ATTACH_FILTER)");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UDPMSocket::steerPartitions(u32 count)
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    auto prog = partitionHash(count);
+    prog.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    struct sock_fprog fprog = { (unsigned short)prog.size(), prog.data() };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) < 0) {
+        perror("setsockopt (SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF)");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+u32 UDPMSocket::queryKernelDrops()
+{
+#if defined(__linux__) && defined(SO_MEMINFO)
+    u32 meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 &&
+        len > SK_MEMINFO_DROPS * sizeof(u32))
+        return meminfo[SK_MEMINFO_DROPS];
+#endif
+    return kernelDrops;
+}
+
 bool UDPMSocket::enableLoopback()
 {
     // NOTE: For support on SUN Operating Systems, send_lo_opt should be 'u8'
@@ -187,6 +307,16 @@ bool UDPMSocket::enableLoopback()
     return true;
 }
 
+bool UDPMSocket::setLoopback(bool enable)
+{
+    u32 opt = enable ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, (char *)&opt, sizeof(opt)) < 0) {
+        perror("setsockopt (IPPROTO_IP, IP_MULTICAST_LOOP)");
+        return false;
+    }
+    return true;
+}
+
 size_t UDPMSocket::getRecvBufSize()
 {
     int size;
@@ -201,10 +331,40 @@ size_t UDPMSocket::getSendBufSize()
     int size;
     uint retsize = sizeof(int);
     getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char*)&size, (socklen_t *)&retsize);
-    ZCM_DEBUG("ZCM: receive buffer is %d bytes", size);
+    ZCM_DEBUG("ZCM: send buffer is %d bytes", size);
     return size;
 }
 
+bool UDPMSocket::setRecvBufSize(size_t size)
+{
+    int opt = std::min(size, (size_t)INT32_MAX / 2);
+#ifdef SO_RCVBUFFORCE
+    // Not limited by net.core.rmem_max, but requires CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, (char*)&opt, sizeof(opt)) == 0)
+        return true;
+#endif
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char*)&opt, sizeof(opt)) < 0) {
+        perror("setsockopt (SOL_SOCKET, SO_RCVBUF)");
+        return false;
+    }
+    return true;
+}
+
+bool UDPMSocket::setSendBufSize(size_t size)
+{
+    int opt = std::min(size, (size_t)INT32_MAX / 2);
+#ifdef SO_SNDBUFFORCE
+    // Not limited by net.core.wmem_max, but requires CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, (char*)&opt, sizeof(opt)) == 0)
+        return true;
+#endif
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char*)&opt, sizeof(opt)) < 0) {
+        perror("setsockopt (SOL_SOCKET, SO_SNDBUF)");
+        return false;
+    }
+    return true;
+}
+
 bool UDPMSocket::waitUntilData(int timeout)
 {
     assert(isOpen());
@@ -231,7 +391,47 @@ bool UDPMSocket::waitUntilData(int timeout)
     }
 }
 
-int UDPMSocket::recvPacket(Packet *pkt)
+int UDPMSocket::waitUntilData(UDPMSocket **socks, size_t n, int timeout)
+{
+    assert(n <= MAX_SHARDS);
+    struct pollfd pfds[MAX_SHARDS];
+    for (size_t i = 0; i < n; i++) {
+        assert(socks[i]->isOpen());
+        pfds[i].fd = socks[i]->fd;
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+
+    int status = poll(pfds, n, timeout);
+    if (status < 0) {
+        if (errno != EINTR)
+            perror("udp_read_packet -- poll:");
+        return -1;
+    }
+
+    for (size_t i = 0; status > 0 && i < n; i++)
+        if (pfds[i].revents & POLLIN)
+            return i;
+
+    // timeout
+    return -1;
+}
+
+int UDPMSocket::spinRecvPacket(UDPMSocket **socks, size_t n, Packet *pkt, u32 usecs, int *sz)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+    do {
+        for (size_t i = 0; i < n; i++) {
+            *sz = socks[i]->recvPacket(pkt, MSG_DONTWAIT);
+            if (*sz >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                return i;
+        }
+    } while (std::chrono::steady_clock::now() < deadline);
+
+    return -1;
+}
+
+int UDPMSocket::recvPacket(Packet *pkt, int flags)
 {
     struct iovec vec;
     vec.iov_base = pkt->buf.data;
@@ -248,28 +448,42 @@ int UDPMSocket::recvPacket(Packet *pkt)
     // operating systems that provide SO_TIMESTAMP allow us to obtain more
     // accurate timestamps by having the kernel produce timestamps as soon
     // as packets are received.
-    char controlbuf[64];
+    char controlbuf[128];
     msg.msg_control = controlbuf;
     msg.msg_controllen = sizeof(controlbuf);
     msg.msg_flags = 0;
 #endif
 
-    int ret = ::recvmsg(fd, &msg, 0);
+    int ret = ::recvmsg(fd, &msg, flags);
     pkt->fromlen = msg.msg_namelen;
+    if (ret >= 0)
+        readControl(&msg, pkt);
 
+    return ret;
+}
+
+void UDPMSocket::readControl(struct msghdr *msg, Packet *pkt)
+{
     bool got_utime = false;
-#ifdef SO_TIMESTAMP
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    /* Get the receive timestamp out of the packet headers if possible */
-    while (!pkt->utime && cmsg) {
+#ifdef MSG_EXT_HDR
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    while (cmsg) {
+# ifdef SO_TIMESTAMP
+        /* Get the receive timestamp out of the packet headers if possible */
         if (cmsg->cmsg_level == SOL_SOCKET &&
             cmsg->cmsg_type == SCM_TIMESTAMP) {
             struct timeval *t = (struct timeval*) CMSG_DATA (cmsg);
             pkt->utime = (int64_t) t->tv_sec * 1000000 + t->tv_usec;
             got_utime = true;
-            break;
         }
-        cmsg = CMSG_NXTHDR(&msg, cmsg);
+# endif
+# ifdef SO_RXQ_OVFL
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&kernelDrops, CMSG_DATA(cmsg), sizeof(kernelDrops));
+        }
+# endif
+        cmsg = CMSG_NXTHDR(msg, cmsg);
     }
 #endif
 
@@ -278,8 +492,6 @@ int UDPMSocket::recvPacket(Packet *pkt)
         gettimeofday(&tv, NULL);
         pkt->utime = (i64)tv.tv_sec * 1000000 + tv.tv_usec;
     }
-
-    return ret;
 }
 
 ssize_t UDPMSocket::sendBuffers(const UDPMAddress& dest, const char *a, size_t alen)
@@ -289,8 +501,8 @@ ssize_t UDPMSocket::sendBuffers(const UDPMAddress& dest, const char *a, size_t a
     iv.iov_len = alen;;
 
     struct msghdr mhdr;
-    mhdr.msg_name = dest.getAddrPtr();
-    mhdr.msg_namelen = dest.getAddrSize();
+    mhdr.msg_name = connected ? NULL : dest.getAddrPtr();
+    mhdr.msg_namelen = connected ? 0 : dest.getAddrSize();
     mhdr.msg_iov = &iv;
     mhdr.msg_iovlen = 1;
     mhdr.msg_control = NULL;
@@ -310,8 +522,8 @@ ssize_t UDPMSocket::sendBuffers(const UDPMAddress& dest, const char *a, size_t a
     iv[1].iov_len = blen;;
 
     struct msghdr mhdr;
-    mhdr.msg_name = dest.getAddrPtr();
-    mhdr.msg_namelen = dest.getAddrSize();
+    mhdr.msg_name = connected ? NULL : dest.getAddrPtr();
+    mhdr.msg_namelen = connected ? 0 : dest.getAddrSize();
     mhdr.msg_iov = iv;
     mhdr.msg_iovlen = 2;
     mhdr.msg_control = NULL;
@@ -333,8 +545,8 @@ ssize_t UDPMSocket::sendBuffers(const UDPMAddress& dest, const char *a, size_t a
     iv[2].iov_len = clen;;
 
     struct msghdr mhdr;
-    mhdr.msg_name = dest.getAddrPtr();
-    mhdr.msg_namelen = dest.getAddrSize();
+    mhdr.msg_name = connected ? NULL : dest.getAddrPtr();
+    mhdr.msg_namelen = connected ? 0 : dest.getAddrSize();
     mhdr.msg_iov = iv;
     mhdr.msg_iovlen = 3;
     mhdr.msg_control = NULL;
@@ -395,7 +607,38 @@ UDPMSocket UDPMSocket::createRecvSocket(struct in_addr multiaddr, u16 port)
     if (!sock.setReuseAddr())                { sock.close(); return sock; }
     if (!sock.setReusePort())                { sock.close(); return sock; }
     if (!sock.enablePacketTimestamp())       { sock.close(); return sock; }
+    if (!sock.enableDropCounter())           { sock.close(); return sock; }
+    if (!sock.disableMulticastAll())         { sock.close(); return sock; }
     if (!sock.bindPort(port))                { sock.close(); return sock; }
     if (!sock.joinMulticastGroup(multiaddr)) { sock.close(); return sock; }
     return sock;
 }
+
+UDPMSocket UDPMSocket::createUnicastSendSocket()
+{
+    UDPMSocket sock;
+    if (!sock.init())                        { sock.close(); return sock; }
+    return sock;
+}
+
+UDPMSocket UDPMSocket::createUnicastRecvSocket(struct in_addr addr, u16 port,
+                                               u32 partitions)
+{
+    UDPMSocket sock;
+    if (!sock.init())                        { sock.close(); return sock; }
+    if (!sock.enablePacketTimestamp())       { sock.close(); return sock; }
+    if (!sock.enableDropCounter())           { sock.close(); return sock; }
+    if (partitions > 1) {
+#ifdef SO_REUSEPORT
+        int opt = 1;
+        if (setsockopt(sock.fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt (SOL_SOCKET, SO_REUSEPORT)");
+            sock.close();
+            return sock;
+        }
+#endif
+    }
+    if (!sock.bindPort(port, addr.s_addr))   { sock.close(); return sock; }
+    if (partitions > 1 && !sock.steerPartitions(partitions)) { sock.close(); return sock; }
+    return sock;
+}
@@ -5,6 +5,7 @@
 class UDPMAddress
 {
   public:
+    // 'port' is in host byte order
     UDPMAddress(const string& ip, u16 port)
     {
         this->ip = ip;
@@ -13,11 +14,20 @@ class UDPMAddress
         memset(&this->addr, 0, sizeof(this->addr));
         this->addr.sin_family = AF_INET;
         inet_aton(ip.c_str(), &this->addr.sin_addr);
-        this->addr.sin_port = port;
+        this->addr.sin_port = htons(port);
+    }
+
+    // A unicast address, as reported by recvmsg()
+    UDPMAddress(const struct sockaddr_in& addr)
+    {
+        this->ip = inet_ntoa(addr.sin_addr);
+        this->port = ntohs(addr.sin_port);
+        this->addr = addr;
     }
 
     const string& getIP() const { return ip; }
     u16 getPort() const { return port; }
+    struct in_addr getInAddr() const { return addr.sin_addr; }
     struct sockaddr* getAddrPtr() const { return (struct sockaddr*)&addr; }
     size_t getAddrSize() const { return sizeof(addr); }
 
@@ -38,19 +48,52 @@ class UDPMSocket
     bool init();
     bool joinMulticastGroup(struct in_addr multiaddr);
     bool setTTL(u8 ttl);
-    bool bindPort(u16 port);
+    bool bindPort(u16 port, u32 addr = INADDR_ANY); // 'port' in host byte order
     bool setReuseAddr();
     bool setReusePort();
     bool enablePacketTimestamp();
+    bool enableDropCounter();
+    // Have the kernel busy poll the device queue for up to 'usecs' on reads
+    bool setBusyPoll(u32 usecs);
+    bool disableMulticastAll();
+    // Spread the senders over 'count' sockets by a hash of their address and
+    // port, so that all packets of a sender land on the same socket.
+    // filterPartition() only accepts the senders of partition 'index'. It is
+    // for multicast, where every socket gets a copy of every packet.
+    // steerPartitions() is for unicast sockets sharing a port with
+    // SO_REUSEPORT, where the kernel hands each packet to one of them: it
+    // goes to the socket that was bound (hash % count)th
+    bool filterPartition(u32 index, u32 count);
+    bool steerPartitions(u32 count);
     bool enableLoopback();
+    // Whether multicast sent from this socket is also delivered on this host
+    bool setLoopback(bool enable);
     bool setDestination(const string& ip, u16 port);
+    // Only exchange packets with 'peer'. The 'dest' given to sendBuffers() is
+    // ignored from then on, and the kernel skips the route lookup on every send
+    bool connectTo(const UDPMAddress& peer);
+    bool isConnected() const { return connected; }
 
     size_t getRecvBufSize();
     size_t getSendBufSize();
+    // Request kernel buffers of 'size' bytes. Note that the kernel reports back
+    // double the requested size, to account for its own bookkeeping
+    bool setRecvBufSize(size_t size);
+    bool setSendBufSize(size_t size);
 
     // Returns true when there is a packet available for receiving
     bool waitUntilData(int timeout);
-    int recvPacket(Packet *pkt);
+    // Returns the index of one of the 'n' sockets that has a packet available
+    // for receiving, or -1 on timeout
+    static int waitUntilData(UDPMSocket **socks, size_t n, int timeout);
+    // Spin on nonblocking reads of the 'n' sockets for up to 'usecs'. Returns
+    // the index of the socket a packet was read from, with the result of
+    // recvPacket() in 'sz', or -1 if nothing arrived in time
+    static int spinRecvPacket(UDPMSocket **socks, size_t n, Packet *pkt, u32 usecs, int *sz);
+    int recvPacket(Packet *pkt, int flags = 0);
+    // Fill in the receive timestamp of 'pkt' (and the kernel drop count) from
+    // the control messages of a packet received on this socket
+    void readControl(struct msghdr *msg, Packet *pkt);
 
     ssize_t sendBuffers(const UDPMAddress& dest, const char *a, size_t alen);
     ssize_t sendBuffers(const UDPMAddress& dest, const char *a, size_t alen,
@@ -58,15 +101,34 @@ class UDPMSocket
     ssize_t sendBuffers(const UDPMAddress& dest, const char *a, size_t alen,
                         const char *b, size_t blen, const char *c, size_t clen);
 
+    // The number of packets the kernel dropped because the receive buffer was
+    // full, as reported with the last packet (requires enableDropCounter())
+    u32 getKernelDrops() { return kernelDrops; }
+    // The same count, asked of the kernel right now (linux). Packets refused by
+    // filterPartition() are included
+    u32 queryKernelDrops();
+
+    // For alternative I/O backends (see uring.hpp)
+    SOCKET getFd() const { return fd; }
+
     static bool checkConnection(const string& ip, u16 port);
     void checkAndWarnAboutSmallBuffer(size_t datalen, size_t kbufsize);
 
     static UDPMSocket createSendSocket(struct in_addr multiaddr, u8 ttl);
     static UDPMSocket createRecvSocket(struct in_addr multiaddr, u16 port);
 
+    // For the unicast transport (udp://). The receive socket is bound to 'addr'
+    // and isn't shared with other processes, except with the other 'partitions'
+    // of this transport (see steerPartitions())
+    static UDPMSocket createUnicastSendSocket();
+    static UDPMSocket createUnicastRecvSocket(struct in_addr addr, u16 port,
+                                              u32 partitions = 1);
+
   private:
     SOCKET fd = -1;
     bool warnedAboutSmallBuffer = false;
+    u32 kernelDrops = 0;
+    bool connected = false;
 
   private:
     // Disallow copies
@@ -75,6 +137,15 @@ class UDPMSocket
 
   public:
     // Allow moves
-    UDPMSocket(UDPMSocket&& other) { std::swap(this->fd, other.fd); }
-    UDPMSocket& operator=(UDPMSocket&& other) { std::swap(this->fd, other.fd); return *this; }
+    UDPMSocket(UDPMSocket&& other) { swap(other); }
+    UDPMSocket& operator=(UDPMSocket&& other) { swap(other); return *this; }
+
+  private:
+    void swap(UDPMSocket& other)
+    {
+        std::swap(this->fd, other.fd);
+        std::swap(this->warnedAboutSmallBuffer, other.warnedAboutSmallBuffer);
+        std::swap(this->kernelDrops, other.kernelDrops);
+        std::swap(this->connected, other.connected);
+    }
 };
@@ -0,0 +1,484 @@
+#include "uring.hpp"
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  ifdef IORING_RECV_MULTISHOT // linux 6.0, like provided buffer rings
+#   define HAVE_URING
+#  endif
+# endif
+#endif
+
+#define URING_RECV_ENTRIES 64
+#define URING_SEND_ENTRIES 64
+#define URING_RECV_BUFS 128          // must be a power of 2
+#define URING_CONTROL_SIZE 128
+#define URING_CANCEL_TAG (~(u64)0)
+
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+
+/************************* The raw ring *******************/
+class UringQueue
+{
+  public:
+    ~UringQueue()
+    {
+        if (sqes)
+            munmap(sqes, sqesSize);
+        if (cqPtr && cqPtr != sqPtr)
+            munmap(cqPtr, cqSize);
+        if (sqPtr)
+            munmap(sqPtr, sqSize);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool init(unsigned entries)
+    {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+            return false;
+        features = p.features;
+
+        sqSize = p.sq_off.array + p.sq_entries * sizeof(u32);
+        cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sqSize = cqSize = std::max(sqSize, cqSize);
+
+        sqPtr = mapRing(sqSize, IORING_OFF_SQ_RING);
+        if (!sqPtr)
+            return false;
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cqPtr = sqPtr;
+        } else {
+            cqPtr = mapRing(cqSize, IORING_OFF_CQ_RING);
+            if (!cqPtr)
+                return false;
+        }
+        sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mapRing(sqesSize, IORING_OFF_SQES);
+        if (!sqes)
+            return false;
+
+        char *sq = (char*)sqPtr, *cq = (char*)cqPtr;
+        sqHead  = (u32*)(sq + p.sq_off.head);
+        sqTail  = (u32*)(sq + p.sq_off.tail);
+        sqMask  = *(u32*)(sq + p.sq_off.ring_mask);
+        sqArray = (u32*)(sq + p.sq_off.array);
+        sqEntries = p.sq_entries;
+        cqHead  = (u32*)(cq + p.cq_off.head);
+        cqTail  = (u32*)(cq + p.cq_off.tail);
+        cqMask  = *(u32*)(cq + p.cq_off.ring_mask);
+        cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+        localTail = *sqTail;
+        return true;
+    }
+
+    // Returns a zeroed submission entry, or NULL if the queue is full
+    struct io_uring_sqe *getSqe()
+    {
+        if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            return NULL;
+        u32 idx = localTail & sqMask;
+        struct io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[idx] = idx;
+        localTail++;
+        return sqe;
+    }
+
+    u32 numPending() const { return localTail - *sqTail; }
+
+    // Submit the pending entries and wait for 'minComplete' completions, for
+    // at most 'timeout' ms (if >= 0). Returns the result of io_uring_enter()
+    int enter(u32 minComplete, int timeout)
+    {
+        u32 submit = numPending();
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+
+        u32 flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        if (minComplete == 0 || timeout < 0)
+            return syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, NULL, 0);
+
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (u64)(uintptr_t)&ts;
+        return syscall(__NR_io_uring_enter, fd, submit, minComplete,
+                       flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    // The oldest completion, or NULL if there are none
+    struct io_uring_cqe *peekCqe()
+    {
+        u32 head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return NULL;
+        return &cqes[head & cqMask];
+    }
+
+    void popCqe() { __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE); }
+
+    int registerOp(unsigned op, void *arg, unsigned nargs)
+    {
+        return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+    }
+
+    u32 features = 0;
+
+  private:
+    int fd = -1;
+    void *sqPtr = nullptr, *cqPtr = nullptr;
+    size_t sqSize = 0, cqSize = 0, sqesSize = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    u32 *sqHead, *sqTail, *sqArray, sqMask, sqEntries;
+    u32 *cqHead, *cqTail, cqMask;
+    struct io_uring_cqe *cqes;
+    u32 localTail = 0;
+
+    void *mapRing(size_t size, u64 offset)
+    {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return (p == MAP_FAILED) ? NULL : p;
+    }
+};
+
+/************************* Common *******************/
+bool UringEngine::probe()
+{
+    UringQueue q;
+    if (!q.init(2)) {
+        ZCM_DEBUG("io_uring is not available: %s", strerror(errno));
+        return false;
+    }
+    if (!(q.features & IORING_FEAT_EXT_ARG)) {
+        ZCM_DEBUG("io_uring is too old (no IORING_FEAT_EXT_ARG)");
+        return false;
+    }
+
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    vector<char> buf(sz, 0);
+    struct io_uring_probe *pr = (struct io_uring_probe*)buf.data();
+    if (q.registerOp(IORING_REGISTER_PROBE, pr, 256) < 0)
+        return false;
+    for (u8 op : { (u8)IORING_OP_RECVMSG, (u8)IORING_OP_SENDMSG, (u8)IORING_OP_ASYNC_CANCEL }) {
+        if (op > pr->last_op || !(pr->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            ZCM_DEBUG("io_uring does not support opcode %d", op);
+            return false;
+        }
+    }
+
+    // provided buffer rings are as recent as multishot recvmsg (linux 6.0)
+    void *ring = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64)(uintptr_t)ring;
+    reg.ring_entries = 1;
+    bool ok = q.registerOp(IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+    if (!ok)
+        ZCM_DEBUG("io_uring does not support provided buffer rings");
+    munmap(ring, 4096);
+    return ok;
+}
+
+UringEngine::~UringEngine()
+{
+    delete q;
+}
+
+bool UringEngine::initQueue(unsigned entries)
+{
+    q = new UringQueue();
+    return q->init(entries);
+}
+
+/************************* Receiving *******************/
+UringReceiver::~UringReceiver()
+{
+    // the ring must be gone before the memory it writes to
+    delete q;
+    q = nullptr;
+    if (bufRing)
+        munmap(bufRing, URING_RECV_BUFS * sizeof(struct io_uring_buf));
+    if (bufs)
+        munmap(bufs, URING_RECV_BUFS * bufSize);
+}
+
+bool UringReceiver::init()
+{
+    if (!initQueue(URING_RECV_ENTRIES))
+        return false;
+
+    // every buffer holds an io_uring_recvmsg_out, the sender's address, the
+    // control messages and the largest possible datagram
+    memset(&recvHdr, 0, sizeof(recvHdr));
+    recvHdr.msg_namelen = sizeof(struct sockaddr_in);
+    recvHdr.msg_controllen = URING_CONTROL_SIZE;
+    bufSize = sizeof(struct io_uring_recvmsg_out) + recvHdr.msg_namelen +
+              recvHdr.msg_controllen + ZCM_MAX_UNFRAGMENTED_PACKET_SIZE;
+    bufSize = (bufSize + 63) & ~(size_t)63;
+
+    bufs = (char*)mmap(NULL, URING_RECV_BUFS * bufSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bufRing = mmap(NULL, URING_RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED || bufRing == MAP_FAILED) {
+        bufs = bufs == MAP_FAILED ? nullptr : bufs;
+        bufRing = bufRing == MAP_FAILED ? nullptr : bufRing;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64)(uintptr_t)bufRing;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = 0;
+    if (q->registerOp(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    for (u16 bid = 0; bid < URING_RECV_BUFS; bid++)
+        recycle(bid);
+    return true;
+}
+
+void UringReceiver::recycle(u16 bid)
+{
+    // Note: struct io_uring_buf_ring can't be used from C++, where its empty
+    // flexible array wrapper takes up space. The ring is an array of
+    // io_uring_buf, with the tail in the 'resv' field of the first one
+    struct io_uring_buf *ring = (struct io_uring_buf*)bufRing;
+    struct io_uring_buf *buf = &ring[bufTail & (URING_RECV_BUFS - 1)];
+    buf->addr = (u64)(uintptr_t)(bufs + (size_t)bid * bufSize);
+    buf->len = bufSize;
+    buf->bid = bid;
+    bufTail++;
+    __atomic_store_n(&ring[0].resv, bufTail, __ATOMIC_RELEASE);
+}
+
+bool UringReceiver::arm(int fd)
+{
+    struct io_uring_sqe *sqe = q->getSqe();
+    if (!sqe)
+        return false;
+
+    Armed& a = armed[fd];
+    a.tag = ((u64)nextTag++ << 32) | (u32)fd;
+    a.active = true;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (u64)(uintptr_t)&recvHdr;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = a.tag;
+    return true;
+}
+
+void UringReceiver::cancel(UDPMSocket& sock)
+{
+    auto it = armed.find(sock.getFd());
+    if (it == armed.end())
+        return;
+
+    struct io_uring_sqe *sqe = q->getSqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = it->second.tag;
+        sqe->user_data = URING_CANCEL_TAG;
+        q->enter(0, 0);
+        numSyscalls++;
+    }
+    armed.erase(it);
+}
+
+int UringReceiver::recvPacket(UDPMSocket **socks, size_t n, Packet *pkt, int timeout, int *sz)
+{
+    bool waited = false;
+    while (true) {
+        struct io_uring_cqe *cqe = q->peekCqe();
+        if (!cqe) {
+            // only wait once, so that the caller gets to handle the timeout
+            if (waited)
+                return -1;
+            for (size_t i = 0; i < n; i++) {
+                auto it = armed.find(socks[i]->getFd());
+                if (it == armed.end() || !it->second.active)
+                    arm(socks[i]->getFd());
+            }
+            int ret = q->enter(1, timeout);
+            numSyscalls++;
+            waited = true;
+            if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+                perror("udp_read_packet -- io_uring_enter:");
+                return -1;
+            }
+            continue;
+        }
+
+        u64 tag = cqe->user_data;
+        int res = cqe->res;
+        u32 flags = cqe->flags;
+        q->popCqe();
+        if (tag == URING_CANCEL_TAG)
+            continue;
+
+        int fd = (int)(u32)tag;
+        u16 bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        bool hasBuf = flags & IORING_CQE_F_BUFFER;
+
+        // a multishot receive ends on errors (e.g. out of buffers) and has to
+        // be armed again
+        auto it = armed.find(fd);
+        bool current = it != armed.end() && it->second.tag == tag;
+        if (current && !(flags & IORING_CQE_F_MORE)) {
+            it->second.active = false;
+            if (res == -EINVAL) {
+                ZCM_DEBUG("io_uring multishot recvmsg was turned down");
+                hasFailed = true;
+                if (hasBuf)
+                    recycle(bid);
+                return -1;
+            }
+        }
+
+        size_t idx = n;
+        for (size_t i = 0; current && i < n; i++)
+            if (socks[i]->getFd() == fd)
+                idx = i;
+        if (idx == n || res < 0 || !hasBuf) {
+            if (hasBuf)
+                recycle(bid);
+            if (idx != n && res < 0 && res != -ENOBUFS) {
+                *sz = -1;
+                errno = -res;
+                return idx;
+            }
+            continue;
+        }
+
+        // the buffer holds: io_uring_recvmsg_out, name, control, payload
+        char *buf = bufs + (size_t)bid * bufSize;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*)buf;
+        char *name = (char*)(out + 1);
+        char *control = name + recvHdr.msg_namelen;
+        char *payload = control + recvHdr.msg_controllen;
+
+        memset(&pkt->from, 0, sizeof(pkt->from));
+        memcpy(&pkt->from, name, std::min((size_t)out->namelen, sizeof(pkt->from)));
+        pkt->fromlen = out->namelen;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = out->controllen;
+        socks[idx]->readControl(&msg, pkt);
+
+        size_t avail = res - (payload - buf);
+        *sz = std::min(std::min((size_t)out->payloadlen, avail), pkt->buf.size);
+        memcpy(pkt->buf.data, payload, *sz);
+        recycle(bid);
+        return idx;
+    }
+}
+
+/************************* Sending *******************/
+bool UringSender::init()
+{
+    if (!initQueue(URING_SEND_ENTRIES))
+        return false;
+    slots.resize(URING_SEND_ENTRIES);
+    return true;
+}
+
+bool UringSender::queue(UDPMSocket& sock, const UDPMAddress& dest,
+                        const char *a, size_t alen, const char *b, size_t blen,
+                        const char *c, size_t clen)
+{
+    bool ok = true;
+    if (nqueued == slots.size())
+        ok = flush();
+
+    Slot& s = slots[nqueued];
+    assert(alen <= sizeof(s.head));
+    memcpy(s.head, a, alen);
+    s.iov[0].iov_base = s.head;
+    s.iov[0].iov_len = alen;
+    s.iov[1].iov_base = (char*)b;
+    s.iov[1].iov_len = blen;
+    s.iov[2].iov_base = (char*)c;
+    s.iov[2].iov_len = clen;
+    memset(&s.hdr, 0, sizeof(s.hdr));
+    s.hdr.msg_name = sock.isConnected() ? NULL : dest.getAddrPtr();
+    s.hdr.msg_namelen = sock.isConnected() ? 0 : dest.getAddrSize();
+    s.hdr.msg_iov = s.iov;
+    s.hdr.msg_iovlen = c ? 3 : 2;
+    s.len = alen + blen + clen;
+
+    struct io_uring_sqe *sqe = q->getSqe();
+    assert(sqe);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock.getFd();
+    sqe->addr = (u64)(uintptr_t)&s.hdr;
+    sqe->user_data = nqueued;
+    nqueued++;
+    return ok;
+}
+
+bool UringSender::flush()
+{
+    bool ok = true;
+    size_t done = 0;
+    while (done < nqueued) {
+        struct io_uring_cqe *cqe = q->peekCqe();
+        if (!cqe) {
+            int ret = q->enter(nqueued - done, -1);
+            numSyscalls++;
+            if (ret < 0 && errno != EINTR) {
+                perror("udp_send -- io_uring_enter:");
+                ok = false;
+                break;
+            }
+            continue;
+        }
+        if (cqe->user_data >= nqueued || cqe->res != (int)slots[cqe->user_data].len)
+            ok = false;
+        q->popCqe();
+        done++;
+    }
+    nqueued = 0;
+    return ok;
+}
+
+#else // HAVE_URING
+
+class UringQueue {};
+
+bool UringEngine::probe() { return false; }
+UringEngine::~UringEngine() { delete q; }
+bool UringEngine::initQueue(unsigned entries) { return false; }
+
+UringReceiver::~UringReceiver() {}
+bool UringReceiver::init() { return false; }
+int UringReceiver::recvPacket(UDPMSocket **socks, size_t n, Packet *pkt, int timeout, int *sz)
+{ return -1; }
+void UringReceiver::cancel(UDPMSocket& sock) {}
+
+bool UringSender::init() { return false; }
+bool UringSender::queue(UDPMSocket& sock, const UDPMAddress& dest,
+                        const char *a, size_t alen, const char *b, size_t blen,
+                        const char *c, size_t clen)
+{ return false; }
+bool UringSender::flush() { return false; }
+
+#endif // HAVE_URING
@@ -0,0 +1,100 @@
+#pragma once
+#include "udpm.hpp"
+#include "udpmsocket.hpp"
+#include <atomic>
+
+// An io_uring I/O backend for UDPMSocket (the 'io=uring' url option). It is
+// driven with the raw system calls, so it needs nothing beyond the kernel
+// headers. Receiving uses one multishot recvmsg per socket into a ring of
+// provided buffers, so a burst of packets costs a single wakeup and none of
+// them needs a system call of its own. Sending queues the fragments of a
+// message and submits them all with a single system call.
+//
+// Both classes must only be used by one thread at a time. UringEngine::probe()
+// reports whether the running kernel supports everything that is needed.
+
+class UringQueue;
+
+class UringEngine
+{
+  public:
+    // Whether io_uring, multishot receives and provided buffer rings are available
+    static bool probe();
+
+    // The number of io_uring_enter() calls made so far. May be read from any thread
+    u64 getNumSyscalls() const { return numSyscalls; }
+
+  protected:
+    UringEngine() {}
+    ~UringEngine();
+    bool initQueue(unsigned entries);
+
+    UringQueue *q = nullptr;
+    std::atomic<u64> numSyscalls {0};
+
+  private:
+    UringEngine(const UringEngine&) = delete;
+    UringEngine& operator=(const UringEngine&) = delete;
+};
+
+class UringReceiver : public UringEngine
+{
+  public:
+    UringReceiver() {}
+    ~UringReceiver();
+    bool init();
+
+    // Like UDPMSocket::waitUntilData() followed by UDPMSocket::recvPacket().
+    // Returns the index of the socket that 'pkt' was read from, with the
+    // packet size (or a negative errno) in 'sz', or -1 on timeout
+    int recvPacket(UDPMSocket **socks, size_t n, Packet *pkt, int timeout, int *sz);
+
+    // Must be called before 'sock' is closed
+    void cancel(UDPMSocket& sock);
+
+    // Set when the kernel turned down the multishot receives
+    bool failed() const { return hasFailed; }
+
+  private:
+    struct Armed { u64 tag; bool active; };
+    unordered_map<int, Armed> armed;   // by fd
+    u64 nextTag = 1;
+    bool hasFailed = false;
+
+    char *bufs = nullptr;              // URING_RECV_BUFS buffers of bufSize
+    size_t bufSize = 0;
+    void *bufRing = nullptr;
+    u16 bufTail = 0;
+    struct msghdr recvHdr;             // the layout of every receive
+
+    bool arm(int fd);
+    void recycle(u16 bid);
+};
+
+class UringSender : public UringEngine
+{
+  public:
+    UringSender() {}
+    bool init();
+
+    // Queue a datagram made of the buffers a, b and c. 'a' (a packet header)
+    // is copied, while 'b' and 'c' must stay valid until flush(). Returns false
+    // if the datagrams queued before this one failed to send
+    bool queue(UDPMSocket& sock, const UDPMAddress& dest,
+               const char *a, size_t alen, const char *b, size_t blen,
+               const char *c = NULL, size_t clen = 0);
+
+    // Send every queued datagram. Returns false if any failed
+    bool flush();
+
+  private:
+    struct Slot
+    {
+        struct msghdr hdr;
+        struct iovec iov[3];
+        char head[64];         // room for the largest MsgHeader*
+        size_t len;
+    };
+    vector<Slot> slots;
+    size_t nqueued = 0;
+};
@@ -0,0 +1,58 @@
+#ifndef _ZCM_TRANS_SERIAL_H
+#define _ZCM_TRANS_SERIAL_H
+
+/*******************************************************************************
+ * ZCM Serial Transport Extensions
+ *
+ *     The serial transport queues outgoing messages and writes them to the
+ *     device from a thread of its own, so publishing doesn't wait for the
+ *     UART. This header allows users that construct the transport themselves
+ *     (e.g. with zcm_transport_find() and zcm_create_trans()) to wait until
+ *     everything published has been transmitted, and to query its counters.
+ *
+ ******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "zcm/transport.h"
+
+typedef struct zcm_serial_stats_t zcm_serial_stats_t;
+struct zcm_serial_stats_t
+{
+    /* Send path */
+    uint64_t messages_sent;      /* messages queued by sendmsg() */
+    uint64_t bytes_written;      /* framed bytes written to the device */
+    uint64_t bytes_dropped;      /* queued bytes discarded because a write failed */
+    uint64_t write_syscalls;     /* write() calls it took */
+    double   bytes_per_sec;      /* write rate, averaged over about a second */
+
+    /* Receive path */
+    uint64_t messages_received;  /* messages received intact, on any channel */
+    uint64_t frames_invalid;     /* frames dropped for a bad checksum, length or version */
+
+    /* Send queue (the 'queue' url option) */
+    size_t queue_size;           /* capacity in bytes */
+    size_t queue_bytes;          /* bytes currently waiting to be written */
+    size_t queue_bytes_max;      /* the most that have ever been waiting */
+};
+
+/* Fill 'stats' with a snapshot of the transport's counters. This may be called
+   from any thread.
+   Returns ZCM_EOK on success, and ZCM_EINVALID if 'zt' is not a serial transport */
+int zcm_trans_serial_stats(zcm_trans_t *zt, zcm_serial_stats_t *stats);
+
+/* Block until every message sent so far has been written to the device and
+   transmitted (tcdrain()).
+   Returns ZCM_EOK on success, ZCM_EINVALID if 'zt' is not a serial transport,
+   and ZCM_EUNKNOWN if the device couldn't be drained */
+int zcm_trans_serial_flush(zcm_trans_t *zt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ZCM_TRANS_SERIAL_H */
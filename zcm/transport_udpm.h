@@ -0,0 +1,117 @@
+#ifndef _ZCM_TRANS_UDPM_H
+#define _ZCM_TRANS_UDPM_H
+
+/*******************************************************************************
+ * ZCM UDPM Transport Extensions
+ *
+ *     The UDP Multicast transport keeps a set of counters describing its
+ *     receive path and its internal memory pools. This header allows users
+ *     that construct the transport themselves (e.g. with zcm_transport_find()
+ *     and zcm_create_trans()) to query a snapshot of those counters.
+ *
+ ******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "zcm/transport.h"
+
+#define ZCM_UDPM_MAX_SIZE_CLASSES 16
+#define ZCM_UDPM_MAX_RECV_SOCKETS 32
+
+typedef struct zcm_udpm_size_class_stats_t zcm_udpm_size_class_stats_t;
+struct zcm_udpm_size_class_stats_t
+{
+    size_t objsize;   /* bytes per object in this class */
+    size_t slabs;     /* slabs carved up for this class */
+    size_t inuse;     /* objects currently handed out */
+    size_t free;      /* objects cached for reuse */
+    size_t overflow;  /* allocations that fell back to malloc() (slab limit reached) */
+};
+
+typedef struct zcm_udpm_stats_t zcm_udpm_stats_t;
+struct zcm_udpm_stats_t
+{
+    /* Receive path */
+    uint64_t packets_received;   /* packets received and processed */
+    uint64_t packets_discarded;  /* packets discarded because they were bad somehow */
+    uint64_t packets_filtered;   /* packets dropped early because their channel isn't enabled */
+    uint64_t kernel_drops;       /* packets dropped by the kernel (receive buffer full) */
+
+    /* Loss detection, from the per-sender message sequence numbers */
+    uint64_t messages_lost;      /* gaps in the sequence numbers */
+    uint64_t messages_duplicate; /* messages seen more than once (dropped) */
+    uint64_t messages_reordered; /* messages that arrived after a newer message */
+    size_t   senders;            /* senders currently being tracked */
+
+    /* Forward error correction (the 'fec' url option) */
+    uint64_t parity_received;    /* parity packets received */
+    uint64_t fragments_recovered;/* lost fragments rebuilt from parity */
+    uint64_t packets_loss_injected; /* packets dropped on purpose ('loss_inject' url option) */
+
+    /* Reliable channels (the 'reliable' url option) */
+    uint64_t nacks_sent;         /* requests sent for missing messages */
+    uint64_t messages_repaired;  /* missing messages that were received after a NACK */
+    uint64_t messages_unrecoverable; /* missing messages the senders couldn't repair */
+    uint64_t repairs_sent;       /* messages sent again in reply to other receivers' NACKs */
+    uint64_t repairs_denied;     /* NACKed messages that were no longer (or never) retained */
+    size_t   retransmit_window_bytes; /* bytes of sent messages kept for repairs */
+
+    /* Kernel buffers (the 'rcvbuf' and 'sndbuf' url options) */
+    size_t recv_buf_size;        /* effective size, as reported by the kernel */
+    size_t send_buf_size;        /* effective size, as reported by the kernel */
+    size_t largest_message;      /* largest message seen, tracked with rcvbuf=auto */
+
+    /* Send pacing (the 'pace_rate' url option) */
+    uint64_t pace_waits;         /* times the sender slept to stay under the rate */
+    uint64_t pace_wait_us;       /* total time spent sleeping */
+
+    /* Busy polling (the 'busy_poll' url option) */
+    uint64_t busy_poll_hits;     /* packets read while spinning */
+    uint64_t busy_poll_misses;   /* spins that ended up sleeping in poll() */
+
+    /* I/O backend (the 'io' url option) */
+    int      io_uring;           /* 1 if io_uring is used, 0 for plain system calls */
+    uint64_t recv_syscalls;      /* system calls made to receive (not counting busy polling) */
+    uint64_t send_syscalls;      /* system calls made to send */
+
+    /* Channel sharding (the 'shards' url option) */
+    size_t shards;               /* multicast groups the channels are spread over */
+    size_t shards_joined;        /* groups this transport currently receives from */
+
+    /* Shared memory side channel for large messages (the 'shm' url option) */
+    uint64_t shm_sent;           /* messages published through the shm arena */
+    uint64_t shm_received;       /* messages read from the arenas of senders on this host */
+    uint64_t shm_lost;           /* messages overwritten before they could be read, or
+                                    whose arena couldn't be mapped */
+
+    /* Receive partitions (the 'recv_sockets' url option). The other receive
+       counters are summed over the partitions */
+    size_t recv_sockets;         /* sockets (and threads) the senders are spread over */
+    uint64_t recv_socket_packets[ZCM_UDPM_MAX_RECV_SOCKETS]; /* packets received by each */
+
+    /* Fragment reassembly */
+    size_t fragbufs;             /* messages currently being reassembled */
+    size_t fragbuf_bytes;        /* bytes held by those messages */
+    uint64_t fragbufs_evicted;   /* partial messages evicted to make room for new ones */
+
+    /* Small-object slab allocator */
+    size_t slab_bytes;           /* bytes currently held in slabs */
+    size_t slab_bytes_max;       /* upper bound on slab_bytes */
+    size_t num_size_classes;
+    zcm_udpm_size_class_stats_t size_classes[ZCM_UDPM_MAX_SIZE_CLASSES];
+};
+
+/* Fill 'stats' with a snapshot of the transport's counters. This may be called
+   from any thread.
+   Returns ZCM_EOK on success, and ZCM_EINVALID if 'zt' is not a udpm or udp transport */
+int zcm_trans_udpm_stats(zcm_trans_t *zt, zcm_udpm_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ZCM_TRANS_UDPM_H */